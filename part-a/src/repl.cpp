@@ -2,6 +2,8 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <cstring>
+#include <memory>
 
 void printUsage() {
     std::cout << "Available commands:\n"
@@ -13,15 +15,63 @@ void printUsage() {
               << "6. EXIT - Exit the program\n";
 }
 
-int main() {
-    StorageEngine db;
+int main(int argc, char* argv[]) {
+    bool warm_up = false;
+    StorageEngine::FsyncPolicy fsync_policy = StorageEngine::FsyncPolicy::Interval;
+    unsigned fsync_interval_ms = 1000;
+    size_t max_memory = StorageEngine::DEFAULT_MAX_MEMORY;
+    const std::string usage = std::string("Usage: ") + argv[0] +
+                              " [--warm-up] [--fsync always|never|MS] [--maxmemory MB]\n";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--warm-up") == 0) {
+            // Load values into memory in the background after startup
+            warm_up = true;
+        } else if (strcmp(argv[i], "--fsync") == 0 && i + 1 < argc) {
+            // always, never, or an interval in milliseconds
+            std::string policy = argv[++i];
+            if (policy == "always") {
+                fsync_policy = StorageEngine::FsyncPolicy::Always;
+            } else if (policy == "never") {
+                fsync_policy = StorageEngine::FsyncPolicy::Never;
+            } else if (!policy.empty() && policy.find_first_not_of("0123456789") == std::string::npos &&
+                       std::stoul(policy) > 0) {
+                fsync_interval_ms = std::stoul(policy);
+            } else {
+                std::cerr << usage;
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc) {
+            // Cache budget in MB; 0 reads every value from disk
+            std::string mb = argv[++i];
+            if (mb.empty() || mb.find_first_not_of("0123456789") != std::string::npos) {
+                std::cerr << usage;
+                return 1;
+            }
+            max_memory = std::stoul(mb) * 1024 * 1024;
+        } else {
+            std::cerr << usage;
+            return 1;
+        }
+    }
+
+    std::unique_ptr<StorageEngine> engine;
+    try {
+        engine = std::make_unique<StorageEngine>(warm_up, fsync_policy, fsync_interval_ms, max_memory);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    StorageEngine& db = *engine;
     std::string line;
     std::cout << "BLINK DB REPL\n";
     printUsage();
     
     while (true) {
         std::cout << "\nUser> ";
-        std::getline(std::cin, line);
+        if (!std::getline(std::cin, line)) {
+            break;
+        }
         
         if (line.empty()) {
             continue;
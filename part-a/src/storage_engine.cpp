@@ -4,8 +4,48 @@
 #include <filesystem>
 #include <vector>
 #include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Little-endian integer fields of the on-disk format
+static void put_u32(char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = static_cast<char>(v >> (8 * i));
+}
+
+static void put_u64(char* p, uint64_t v) {
+    put_u32(p, static_cast<uint32_t>(v));
+    put_u32(p + 4, static_cast<uint32_t>(v >> 32));
+}
+
+static uint32_t get_u32(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(u[0]) | (static_cast<uint32_t>(u[1]) << 8) |
+           (static_cast<uint32_t>(u[2]) << 16) | (static_cast<uint32_t>(u[3]) << 24);
+}
+
+static uint64_t get_u64(const char* p) {
+    return static_cast<uint64_t>(get_u32(p)) | (static_cast<uint64_t>(get_u32(p + 4)) << 32);
+}
+
+static bool read_file(const char* path, std::string& contents) {
+    std::ifstream infile(path, std::ios::binary | std::ios::ate);
+    if (!infile.is_open()) return false;
+    contents.resize(static_cast<size_t>(infile.tellg()));
+    infile.seekg(0);
+    infile.read(&contents[0], contents.size());
+    contents.resize(static_cast<size_t>(infile.gcount()));
+    return true;
+}
 
-StorageEngine::StorageEngine() {
+StorageEngine::StorageEngine(bool warm_up, FsyncPolicy fsync_policy, unsigned fsync_interval_ms,
+                             size_t max_memory)
+    : max_memory(max_memory), fsync_policy(fsync_policy), fsync_interval(fsync_interval_ms) {
     // Create disk_storage directory if it doesn't exist
     if (system("mkdir -p disk_storage") != 0) {
         std::cerr << "Failed to create disk_storage directory" << std::endl;
@@ -14,260 +54,855 @@ StorageEngine::StorageEngine() {
     // Initialize empty state
     data_.clear();
     access_order.clear();
-    pending_writes = 0;
-    write_buffer.clear();
     disk_index.clear();
 
-    // Load existing data
-    load_disk_index();
+    // Load existing data: last checkpoint plus the deltas journaled after it,
+    // then any records data.dat holds past both
+    upgrade_legacy_files();
+    uint64_t data_file_size = prepare_data_file();
+    uint64_t indexed_end = FILE_HEADER_SIZE;
+    bool index_ok = load_disk_index(data_file_size, indexed_end);
+    bool journal_ok = index_ok && replay_journal(data_file_size, indexed_end);
+    size_t replayed = recover_data_tail(indexed_end, data_file_size);
+    key_filter.rebuild(disk_index, disk_index.size());
+
+    data_out.open("disk_storage/data.dat", std::ios::binary | std::ios::app);
+    if (!data_out.is_open()) {
+        std::cerr << "Failed to open data file for writing" << std::endl;
+    }
+    data_fd = open("disk_storage/data.dat", O_RDONLY | O_CLOEXEC);
+    if (data_fd < 0) {
+        std::cerr << "Failed to open data file for reading" << std::endl;
+    }
+    struct stat st;
+    if (data_fd >= 0 && fstat(data_fd, &st) == 0) {
+        data_size = static_cast<uint64_t>(st.st_size);
+        data_map.cover(data_fd, data_size);
+    }
+
+    // Fold whatever was replayed into a fresh checkpoint; this also drops
+    // any journal entry torn by a crash
+    if (!journal_ok || journal_entries > 0 || replayed > 0) {
+        checkpoint_disk_index();
+    } else {
+        journal_out.open("disk_storage/index.journal", std::ios::binary | std::ios::app);
+    }
+    // Checkpoints and clear() reopen the journal by path with truncation, which
+    // keeps the same file, so this descriptor stays valid
+    journal_fd = open("disk_storage/index.journal", O_RDONLY | O_CLOEXEC);
+
+    if (fsync_policy == FsyncPolicy::Interval) {
+        fsync_thread = std::thread(&StorageEngine::fsync_worker, this);
+    }
+    if (warm_up && !disk_index.empty() && max_memory > 0) {
+        warm_up_thread = std::thread(&StorageEngine::warm_up_cache, this);
+    }
 }
 
 StorageEngine::~StorageEngine() {
-    force_flush();  // Force flush any remaining data
-    save_disk_index();
+    warm_up_stop = true;
+    if (warm_up_thread.joinable()) {
+        warm_up_thread.join();
+    }
+    if (fsync_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(sync_mutex);
+            fsync_stop = true;
+        }
+        sync_cv.notify_all();
+        fsync_thread.join();
+    }
+    checkpoint_disk_index();
+    if (fsync_policy != FsyncPolicy::Never) {
+        sync_files();
+    }
+    if (data_fd >= 0) {
+        close(data_fd);
+    }
+    if (journal_fd >= 0) {
+        close(journal_fd);
+    }
+}
+
+void StorageEngine::sync_files() {
+    // Records before the journal deltas that point at them
+#ifdef __APPLE__
+    if (data_fd >= 0) fcntl(data_fd, F_FULLFSYNC);
+    if (journal_fd >= 0) fcntl(journal_fd, F_FULLFSYNC);
+#else
+    if (data_fd >= 0) fdatasync(data_fd);
+    if (journal_fd >= 0) fdatasync(journal_fd);
+#endif
+}
+
+// Syncs unless another thread is already doing so. Called with sync_mutex
+// held; returns once the sync it ran or waited for has finished, after which
+// the caller rechecks synced_seq.
+bool StorageEngine::sync_through(std::unique_lock<std::mutex>& lock, uint64_t seq) {
+    if (sync_running) {
+        // That sync may have started before seq was written; wait it out and
+        // let the caller decide whether another one is needed
+        sync_cv.wait(lock, [this] { return !sync_running; });
+        return synced_seq >= seq;
+    }
+    sync_running = true;
+    uint64_t target = written_seq.load(std::memory_order_acquire);
+    lock.unlock();
+    sync_files();
+    lock.lock();
+    sync_running = false;
+    synced_seq = std::max(synced_seq, target);
+    sync_cv.notify_all();
+    return true;
+}
+
+void StorageEngine::commit(uint64_t seq) {
+    if (fsync_policy != FsyncPolicy::Always) return;
+    std::unique_lock<std::mutex> lock(sync_mutex);
+    while (synced_seq < seq) {
+        sync_through(lock, seq);
+    }
+}
+
+void StorageEngine::fsync_worker() {
+    std::unique_lock<std::mutex> lock(sync_mutex);
+    while (!sync_cv.wait_for(lock, fsync_interval, [this] { return fsync_stop; })) {
+        uint64_t written = written_seq.load(std::memory_order_acquire);
+        if (synced_seq < written) {
+            sync_through(lock, written);
+        }
+    }
 }
 
 size_t StorageEngine::size() const {
     std::lock_guard<std::mutex> lock(mutex_);
-    return data_.size() + disk_index.size();
+    // SET flushes before returning, so every cached key is also in the index
+    return disk_index.size();
 }
 
-void StorageEngine::load_disk_index() {
-    std::ifstream infile("disk_storage/index.dat", std::ios::binary);
-    if (!infile.is_open()) {
-        // Create empty files if they don't exist
-        std::ofstream data_file("disk_storage/data.dat", std::ios::app);
-        std::ofstream index_file("disk_storage/index.dat", std::ios::app);
-        data_file.close();
-        index_file.close();
+size_t StorageEngine::cache_memory() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cache_bytes;
+}
+
+void StorageEngine::append_file_header(std::string& out, uint64_t magic) {
+    char header[FILE_HEADER_SIZE] = {};
+    put_u64(header, magic);
+    put_u32(header + 8, FORMAT_VERSION);
+    out.append(header, FILE_HEADER_SIZE);
+}
+
+// Rewrites a data.dat from before the checksummed format, keeping only the
+// records its index points at. Renaming the new file into place is the
+// commit point; the old index.dat and index.journal are deleted after it,
+// and if a crash gets in first they are ignored for want of a valid header.
+// Either way the index is then rebuilt by scanning the new data.dat.
+void StorageEngine::upgrade_legacy_files() {
+    int fd = open("disk_storage/data.dat", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    std::string expected;
+    append_file_header(expected, DATA_MAGIC);
+    char header[FILE_HEADER_SIZE];
+    size_t n = 0;
+    if (fstat(fd, &st) == 0) {
+        n = static_cast<size_t>(std::min<off_t>(st.st_size, FILE_HEADER_SIZE));
+    }
+    // An old file starts with a key length, which is far smaller than the
+    // first word of a header
+    bool legacy = n >= sizeof(uint32_t) && pread(fd, header, n, 0) == static_cast<ssize_t>(n) &&
+                  expected.compare(0, n, header, n) != 0 && get_u32(header) < static_cast<uint64_t>(st.st_size);
+    if (!legacy) {
+        close(fd);
         return;
     }
 
+    load_legacy_index();
+    replay_legacy_journal();
+    std::vector<std::pair<DiskEntry, const std::string*>> live;
+    live.reserve(disk_index.size());
+    for (const auto& [key, entry] : disk_index) {
+        live.emplace_back(entry, &key);
+    }
+    std::sort(live.begin(), live.end(),
+              [](const auto& a, const auto& b) { return a.first.offset < b.first.offset; });
+
+    // Old records: [key_len:u32][key][value_len:u32][value], host byte order
+    std::string out;
+    append_file_header(out, DATA_MAGIC);
+    std::string record;
+    size_t kept = 0;
+    for (const auto& [entry, key] : live) {
+        if (entry.size < 2 * sizeof(uint32_t) + key->size() ||
+            entry.offset + entry.size > static_cast<size_t>(st.st_size)) {
+            continue;
+        }
+        record.resize(entry.size);
+        if (pread(fd, &record[0], record.size(), entry.offset) != static_cast<ssize_t>(record.size())) continue;
+        uint32_t key_len, value_len;
+        std::memcpy(&key_len, record.data(), sizeof(key_len));
+        if (key_len != key->size() || record.compare(sizeof(key_len), key_len, *key) != 0) continue;
+        std::memcpy(&value_len, record.data() + sizeof(key_len) + key_len, sizeof(value_len));
+        if (2 * sizeof(uint32_t) + key_len + value_len != record.size()) continue;
+        encode_record(out, RecordType::Put, *key, record.substr(2 * sizeof(uint32_t) + key_len));
+        kept++;
+    }
+    close(fd);
+    disk_index.clear();
+
+    std::ofstream outfile("disk_storage/data.dat.tmp", std::ios::binary | std::ios::trunc);
+    outfile.write(out.data(), out.size());
+    outfile.close();
+    int tmp_fd = open("disk_storage/data.dat.tmp", O_RDONLY | O_CLOEXEC);
+    bool synced = tmp_fd >= 0 && fsync(tmp_fd) == 0;
+    if (tmp_fd >= 0) {
+        close(tmp_fd);
+    }
+    if (!outfile || !synced || std::rename("disk_storage/data.dat.tmp", "disk_storage/data.dat") != 0) {
+        std::remove("disk_storage/data.dat.tmp");
+        throw std::runtime_error("Failed to upgrade disk_storage/data.dat to the checksummed format");
+    }
+    // Their offsets no longer mean anything
+    std::remove("disk_storage/index.dat");
+    std::remove("disk_storage/index.journal");
+    std::cerr << "Upgraded disk_storage/data.dat to the checksummed format (" << kept << " keys)" << std::endl;
+}
+
+void StorageEngine::load_legacy_index() {
+    // [key_len:u32][key][offset:size_t][size:size_t] per key, host byte order
+    std::string buffer;
+    if (!read_file("disk_storage/index.dat", buffer)) return;
+
+    const char* p = buffer.data();
+    const char* end = p + buffer.size();
+    while (static_cast<size_t>(end - p) >= sizeof(uint32_t)) {
+        uint32_t key_len;
+        size_t offset, size;
+        std::memcpy(&key_len, p, sizeof(key_len));
+        if (static_cast<size_t>(end - p) < sizeof(key_len) + key_len + sizeof(offset) + sizeof(size)) {
+            break;
+        }
+        p += sizeof(key_len);
+
+        std::string key(p, key_len);
+        p += key_len;
+        std::memcpy(&offset, p, sizeof(offset));
+        p += sizeof(offset);
+        std::memcpy(&size, p, sizeof(size));
+        p += sizeof(size);
+
+        disk_index[std::move(key)] = {offset, size};
+    }
+}
+
+void StorageEngine::replay_legacy_journal() {
+    // [op:u8][key_len:u32][key][offset:size_t][size:size_t] per entry
+    std::ifstream infile("disk_storage/index.journal", std::ios::binary);
+    if (!infile.is_open()) return;
+    infile.seekg(0, std::ios::end);
+    std::streamoff file_size = infile.tellg();
+    infile.seekg(0, std::ios::beg);
+
     while (infile) {
+        uint8_t op;
         uint32_t key_len;
         size_t offset, size;
+        infile.read(reinterpret_cast<char*>(&op), sizeof(op));
         infile.read(reinterpret_cast<char*>(&key_len), sizeof(key_len));
-        if (!infile) break;
+        if (!infile || key_len > file_size) break;
 
         std::string key(key_len, '\0');
         infile.read(&key[0], key_len);
         infile.read(reinterpret_cast<char*>(&offset), sizeof(offset));
         infile.read(reinterpret_cast<char*>(&size), sizeof(size));
+        if (!infile) break;  // Torn final entry
 
-        if (infile) {
+        if (op == static_cast<uint8_t>(JournalOp::Update)) {
             disk_index[key] = {offset, size};
-            
-            // Also load into memory cache
-            std::ifstream data_file("disk_storage/data.dat", std::ios::binary);
-            if (data_file) {
-                data_file.seekg(offset);
-                
-                // Skip key
-                uint32_t stored_key_len;
-                data_file.read(reinterpret_cast<char*>(&stored_key_len), sizeof(stored_key_len));
-                data_file.seekg(stored_key_len, std::ios::cur);
-                
-                // Read value
-                uint32_t value_len;
-                data_file.read(reinterpret_cast<char*>(&value_len), sizeof(value_len));
-                std::string value(value_len, '\0');
-                data_file.read(&value[0], value_len);
-                
-                if (data_file) {
-                    data_[key] = value;
-                    access_order.push_back(key);
+        } else if (op == static_cast<uint8_t>(JournalOp::Remove)) {
+            disk_index.erase(key);
+        }
+    }
+}
+
+// Creates data.dat with its header, or restores a header a crash cut
+// short, and returns the file's size
+uint64_t StorageEngine::prepare_data_file() {
+    int fd = open("disk_storage/data.dat", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        std::cerr << "Failed to open data file" << std::endl;
+        return FILE_HEADER_SIZE;
+    }
+    std::string expected;
+    append_file_header(expected, DATA_MAGIC);
+    char header[FILE_HEADER_SIZE];
+    size_t n = static_cast<size_t>(std::min<off_t>(st.st_size, FILE_HEADER_SIZE));
+    bool readable = pread(fd, header, n, 0) == static_cast<ssize_t>(n);
+    if (!readable || expected.compare(0, n, header, n) != 0) {
+        close(fd);
+        throw std::runtime_error("disk_storage/data.dat is not in a format this build reads");
+    }
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    if (n < FILE_HEADER_SIZE) {
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, expected.data(), expected.size(), 0) != FILE_HEADER_SIZE) {
+            std::cerr << "Failed to write data file header" << std::endl;
+        }
+        size = FILE_HEADER_SIZE;
+    }
+    close(fd);
+    return size;
+}
+
+// Loads the last checkpoint. indexed_end receives how much of data.dat it
+// covers. False, with the index left empty, if index.dat is missing, torn
+// or from an older version.
+bool StorageEngine::load_disk_index(uint64_t data_file_size, uint64_t& indexed_end) {
+    // Read the whole checkpoint in one go and parse it from memory; values
+    // stay on disk until they are first requested
+    std::string buffer;
+    if (!read_file("disk_storage/index.dat", buffer)) {
+        return false;
+    }
+    std::string expected;
+    append_file_header(expected, INDEX_MAGIC);
+    if (buffer.size() < FILE_HEADER_SIZE + INDEX_FOOTER_SIZE ||
+        buffer.compare(0, FILE_HEADER_SIZE, expected) != 0 ||
+        get_u32(buffer.data() + buffer.size() - 4) != Crc32c::value(buffer.data(), buffer.size() - 4)) {
+        if (!buffer.empty()) {
+            std::cerr << "disk_storage/index.dat is damaged or from an older version; rebuilding it from data.dat"
+                      << std::endl;
+        }
+        return false;
+    }
+
+    const char* p = buffer.data() + FILE_HEADER_SIZE;
+    const char* end = buffer.data() + buffer.size() - INDEX_FOOTER_SIZE;
+    uint64_t entries = get_u64(end);
+    uint64_t count = 0;
+    while (p < end) {
+        if (static_cast<size_t>(end - p) < 4) break;
+        uint32_t key_len = get_u32(p);
+        if (static_cast<size_t>(end - p) < 4 + key_len + 16) break;
+        p += 4;
+        std::string key(p, key_len);
+        p += key_len;
+        uint64_t offset = get_u64(p);
+        uint64_t size = get_u64(p + 8);
+        p += 16;
+        count++;
+        // Records past the end of data.dat were lost, or cleared by a CLEAR
+        // that crashed before rewriting the checkpoint
+        if (offset + size <= data_file_size) {
+            disk_index[std::move(key)] = {static_cast<size_t>(offset), static_cast<size_t>(size)};
+        }
+    }
+    if (p != end || count != entries) {
+        std::cerr << "disk_storage/index.dat is inconsistent; rebuilding it from data.dat" << std::endl;
+        disk_index.clear();
+        return false;
+    }
+    indexed_end = std::max<uint64_t>(FILE_HEADER_SIZE, get_u64(end + 8));
+    return true;
+}
+
+void StorageEngine::warm_up_cache() {
+    struct WarmEntry {
+        DiskEntry entry;
+        std::string key;
+    };
+
+    // Snapshot the index in file order so data.dat is read front to back,
+    // stopping at about as many records as the cache can hold
+    std::vector<WarmEntry> entries;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t budget = 0;
+        for (const auto& [key, entry] : disk_index) {
+            budget += cache_entry_bytes(key.size(), entry.size);
+            if (budget > max_memory) break;
+            entries.push_back({entry, key});
+        }
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const WarmEntry& a, const WarmEntry& b) { return a.entry.offset < b.entry.offset; });
+
+    std::vector<std::pair<size_t, std::string>> values;  // Position in entries, value
+    values.reserve(WARM_UP_BATCH);
+    size_t next = 0;
+    while (next < entries.size() && !warm_up_stop.load(std::memory_order_relaxed)) {
+        values.clear();
+        for (; next < entries.size() && values.size() < WARM_UP_BATCH; ++next) {
+            std::string value;
+            if (read_record(entries[next].entry, entries[next].key, value)) {
+                values.emplace_back(next, std::move(value));
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (warm_up_stop.load(std::memory_order_relaxed)) return;
+        for (auto& [i, value] : values) {
+            // Warmed entries never evict ones that were actually used
+            size_t cost = cache_entry_bytes(entries[i].key.size(), value.size());
+            if (cache_bytes + cost > max_memory) return;
+            // Skip keys that were rewritten, deleted or cached meanwhile
+            auto disk_it = disk_index.find(entries[i].key);
+            if (disk_it == disk_index.end() || disk_it->second.offset != entries[i].entry.offset) continue;
+            auto [it, inserted] = data_.try_emplace(entries[i].key);
+            if (!inserted) continue;
+            it->second.value = std::move(value);
+            cache_bytes += cost;
+            // Warmed entries have not been used yet, so they go to the cold end
+            it->second.lru_pos = access_order.insert(access_order.begin(), &it->first);
+        }
+    }
+}
+
+// Applies the deltas journaled since the last checkpoint, up to the first
+// torn or corrupt entry, and extends indexed_end over the records they
+// cover. False unless the whole journal was intact.
+bool StorageEngine::replay_journal(uint64_t data_file_size, uint64_t& indexed_end) {
+    std::string buffer;
+    if (!read_file("disk_storage/index.journal", buffer)) return false;
+    std::string expected;
+    append_file_header(expected, JOURNAL_MAGIC);
+    if (buffer.compare(0, FILE_HEADER_SIZE, expected) != 0) return false;
+
+    const char* p = buffer.data() + FILE_HEADER_SIZE;
+    const char* end = buffer.data() + buffer.size();
+    while (static_cast<size_t>(end - p) >= JOURNAL_ENTRY_HEADER) {
+        uint8_t op = static_cast<uint8_t>(p[4]);
+        uint32_t key_len = get_u32(p + 5);
+        uint64_t offset = get_u64(p + 9);
+        uint64_t size = get_u64(p + 17);
+        if (key_len > static_cast<size_t>(end - p) - JOURNAL_ENTRY_HEADER ||
+            get_u32(p) != Crc32c::value(p + 4, JOURNAL_ENTRY_HEADER - 4 + key_len)) {
+            break;  // Torn or corrupt entry
+        }
+        std::string key(p + JOURNAL_ENTRY_HEADER, key_len);
+        p += JOURNAL_ENTRY_HEADER + key_len;
+        journal_entries++;
+
+        // Deltas may refer to data.dat records lost in a crash; ignore those
+        if (offset + size > data_file_size) continue;
+        indexed_end = std::max(indexed_end, offset + size);
+        if (op == static_cast<uint8_t>(JournalOp::Update)) {
+            disk_index[key] = {static_cast<size_t>(offset), static_cast<size_t>(size)};
+        } else if (op == static_cast<uint8_t>(JournalOp::Remove)) {
+            disk_index.erase(key);
+        }
+    }
+    return p == end;
+}
+
+// Replays the records data.dat holds past indexed_end, which a crash kept
+// out of the journal, reading the file front to back in large chunks. The
+// file is cut at the first torn or corrupt record. Returns how many records
+// were replayed.
+size_t StorageEngine::recover_data_tail(uint64_t indexed_end, uint64_t data_file_size) {
+    uint64_t pos = std::min(std::max<uint64_t>(indexed_end, FILE_HEADER_SIZE), data_file_size);
+    if (pos == data_file_size) return 0;
+    int fd = open("disk_storage/data.dat", O_RDWR | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    std::string buffer;   // File bytes from buffer_start on
+    uint64_t buffer_start = pos;
+    size_t replayed = 0;
+    while (true) {
+        size_t at = static_cast<size_t>(pos - buffer_start);
+        size_t avail = buffer.size() - at;
+        size_t want = SCAN_CHUNK;
+        if (avail >= RECORD_HEADER_SIZE) {
+            size_t total = record_size(buffer.data() + at);
+            if (total == 0 || total > data_file_size - pos) break;  // Garbage or torn
+            if (avail >= total) {
+                const char* record = buffer.data() + at;
+                if (get_u32(record) != Crc32c::value(record + 4, total - 4)) break;
+                std::string key(record + RECORD_HEADER_SIZE, get_u32(record + 5));
+                if (static_cast<RecordType>(record[4]) == RecordType::Put) {
+                    disk_index[std::move(key)] = {static_cast<size_t>(pos), total};
+                } else {
+                    disk_index.erase(key);
                 }
+                pos += total;
+                replayed++;
+                continue;
             }
+            want = std::max(want, total - avail);
+        }
+        uint64_t read_from = buffer_start + buffer.size();
+        if (read_from >= data_file_size) break;
+        buffer.erase(0, at);
+        buffer_start = pos;
+        size_t n = static_cast<size_t>(std::min<uint64_t>(want, data_file_size - read_from));
+        size_t old_size = buffer.size();
+        buffer.resize(old_size + n);
+        if (pread(fd, &buffer[old_size], n, read_from) != static_cast<ssize_t>(n)) {
+            // Not evidence of a torn tail, so nothing is cut
+            std::cerr << "Failed to read data file" << std::endl;
+            close(fd);
+            return replayed;
         }
     }
+
+    if (pos < data_file_size) {
+        std::cerr << "Truncating " << (data_file_size - pos) << " torn or corrupt bytes at the end of "
+                  << "disk_storage/data.dat" << std::endl;
+        if (ftruncate(fd, static_cast<off_t>(pos)) != 0) {
+            std::cerr << "Failed to truncate data file" << std::endl;
+        }
+    }
+    close(fd);
+    return replayed;
+}
+
+void StorageEngine::append_journal(JournalOp op, const std::string& key, size_t offset, size_t size) {
+    char header[JOURNAL_ENTRY_HEADER];
+    header[4] = static_cast<char>(op);
+    put_u32(header + 5, static_cast<uint32_t>(key.size()));
+    put_u64(header + 9, offset);
+    put_u64(header + 17, size);
+    put_u32(header, Crc32c::extend(Crc32c::value(header + 4, sizeof(header) - 4), key.data(), key.size()));
+    journal_out.write(header, sizeof(header));
+    journal_out.write(key.data(), key.size());
+    journal_entries++;
+}
+
+void StorageEngine::checkpoint_disk_index() {
+    save_disk_index();
+
+    // Everything journaled so far is now in index.dat
+    reset_journal();
+}
+
+void StorageEngine::reset_journal() {
+    journal_out.close();
+    journal_out.open("disk_storage/index.journal", std::ios::binary | std::ios::trunc);
+    std::string header;
+    append_file_header(header, JOURNAL_MAGIC);
+    journal_out.write(header.data(), header.size());
+    journal_out.flush();
+    journal_entries = 0;
 }
 
 void StorageEngine::save_disk_index() {
-    std::ofstream outfile("disk_storage/index.dat", std::ios::binary | std::ios::trunc);
+    // Write a new file and rename it over the old one, so a crash mid-write
+    // never leaves a half-written checkpoint
+    std::ofstream outfile("disk_storage/index.dat.tmp", std::ios::binary | std::ios::trunc);
     if (!outfile.is_open()) {
         std::cerr << "Failed to open index file for writing" << std::endl;
         return;
     }
 
+    std::string buffer;
+    append_file_header(buffer, INDEX_MAGIC);
+    uint32_t crc = 0;
+    char fields[16];
     for (const auto& [key, entry] : disk_index) {
-        uint32_t key_len = key.length();
-        outfile.write(reinterpret_cast<const char*>(&key_len), sizeof(key_len));
-        outfile.write(key.c_str(), key_len);
-        outfile.write(reinterpret_cast<const char*>(&entry.offset), sizeof(entry.offset));
-        outfile.write(reinterpret_cast<const char*>(&entry.size), sizeof(entry.size));
+        put_u32(fields, static_cast<uint32_t>(key.size()));
+        buffer.append(fields, 4);
+        buffer += key;
+        put_u64(fields, entry.offset);
+        put_u64(fields + 8, entry.size);
+        buffer.append(fields, 16);
+        if (buffer.size() >= SCAN_CHUNK) {
+            crc = Crc32c::extend(crc, buffer.data(), buffer.size());
+            outfile.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    char footer[INDEX_FOOTER_SIZE];
+    put_u64(footer, disk_index.size());
+    put_u64(footer + 8, data_size.load(std::memory_order_relaxed));
+    buffer.append(footer, 16);
+    crc = Crc32c::extend(crc, buffer.data(), buffer.size());
+    put_u32(footer + 16, crc);
+    buffer.append(footer + 16, 4);
+    outfile.write(buffer.data(), buffer.size());
+    outfile.close();
+    if (outfile && fsync_policy != FsyncPolicy::Never) {
+        // The journal is truncated right after this, so the checkpoint has
+        // to be on disk before it replaces the old one
+        int fd = open("disk_storage/index.dat.tmp", O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+    if (!outfile || std::rename("disk_storage/index.dat.tmp", "disk_storage/index.dat") != 0) {
+        std::cerr << "Failed to save index file" << std::endl;
     }
 }
 
 void StorageEngine::update_disk_index(const std::string& key, size_t offset, size_t size) {
-    disk_index[key] = {offset, size};
-    save_disk_index();  // Save index after each update
+    if (disk_index.insert_or_assign(key, DiskEntry{offset, size}).second) {
+        key_filter.add(key);
+        if (key_filter.needs_rebuild()) {
+            key_filter.rebuild(disk_index, disk_index.size());
+        }
+    }
+    append_journal(JournalOp::Update, key, offset, size);
 }
 
-void StorageEngine::remove_from_disk_index(const std::string& key) {
+// offset and size locate the delete record
+void StorageEngine::remove_from_disk_index(const std::string& key, size_t offset, size_t size) {
     disk_index.erase(key);
-    save_disk_index();  // Save index after each removal
+    append_journal(JournalOp::Remove, key, offset, size);
+}
+
+void StorageEngine::encode_record(std::string& out, RecordType type, const std::string& key,
+                                  const std::string& value) {
+    char header[RECORD_HEADER_SIZE];
+    header[4] = static_cast<char>(type);
+    put_u32(header + 5, static_cast<uint32_t>(key.size()));
+    put_u32(header + 9, static_cast<uint32_t>(value.size()));
+    uint32_t crc = Crc32c::extend(Crc32c::value(header + 4, sizeof(header) - 4), key.data(), key.size());
+    put_u32(header, Crc32c::extend(crc, value.data(), value.size()));
+    out.append(header, sizeof(header));
+    out += key;
+    out += value;
 }
 
-void StorageEngine::flush_write_buffer() {
-    if (write_buffer.empty()) return;
+// Size of the record whose header is at header, or 0 if it is not one
+size_t StorageEngine::record_size(const char* header) {
+    uint8_t type = static_cast<uint8_t>(header[4]);
+    if (type != static_cast<uint8_t>(RecordType::Put) && type != static_cast<uint8_t>(RecordType::Delete)) {
+        return 0;
+    }
+    return RECORD_HEADER_SIZE + get_u32(header + 5) + static_cast<size_t>(get_u32(header + 9));
+}
 
-    std::ofstream outfile("disk_storage/data.dat", std::ios::binary | std::ios::app);
-    if (!outfile.is_open()) {
-        std::cerr << "Failed to open data file for writing" << std::endl;
+// Writes one record to data_out; offset and size receive where it went.
+// finish_appends() makes it visible to readers.
+void StorageEngine::append_record(RecordType type, const std::string& key, const std::string& value,
+                                  size_t& offset, size_t& size) {
+    thread_local std::string encoded;
+    encoded.clear();
+    encode_record(encoded, type, key, value);
+    offset = static_cast<size_t>(data_out.tellp());
+    size = encoded.size();
+    data_out.write(encoded.data(), encoded.size());
+}
+
+void StorageEngine::finish_appends() {
+    // Data before the journal entries that point at it
+    data_out.flush();
+    journal_out.flush();
+
+    uint64_t flushed = static_cast<uint64_t>(data_out.tellp());
+    if (!data_map.covers(flushed)) {
+        std::unique_lock<std::shared_mutex> map_lock(map_mutex);
+        data_map.cover(data_fd, flushed);
+    }
+    data_size.store(flushed, std::memory_order_release);
+}
+
+void StorageEngine::cache_put(const std::string& key, const std::string& value) {
+    size_t cost = cache_entry_bytes(key.size(), value.size());
+    if (cost > max_memory) {
+        // Could never fit; keep the disk as the only copy
+        cache_erase(key);
         return;
     }
 
-    for (const auto& entry : write_buffer) {
-        std::streampos offset = outfile.tellp();
-        
-        // Write key length and key
-        uint32_t key_len = entry.key.length();
-        outfile.write(reinterpret_cast<const char*>(&key_len), sizeof(key_len));
-        outfile.write(entry.key.c_str(), key_len);
-        
-        // Write value length and value
-        uint32_t value_len = entry.value.length();
-        outfile.write(reinterpret_cast<const char*>(&value_len), sizeof(value_len));
-        outfile.write(entry.value.c_str(), value_len);
-        
-        std::streampos end_pos = outfile.tellp();
-        size_t size = static_cast<size_t>(end_pos - offset);
-        update_disk_index(entry.key, static_cast<size_t>(offset), size);
-    }
-    
-    outfile.close();
-    write_buffer.clear();
-    pending_writes = 0;
+    auto [it, inserted] = data_.try_emplace(key);
+    if (inserted) {
+        it->second.lru_pos = access_order.insert(access_order.end(), &it->first);
+    } else {
+        cache_bytes -= cache_entry_bytes(key.size(), it->second.value.size());
+        access_order.splice(access_order.end(), access_order, it->second.lru_pos);
+    }
+    it->second.value = value;
+    cache_bytes += cost;
+
+    // Evict least recently used entries until back under budget. The entry
+    // just stored is the most recent and fits on its own, so it stays.
+    while (cache_bytes > max_memory) {
+        cache_erase(*access_order.front());
+    }
+}
+
+void StorageEngine::cache_erase(const std::string& key) {
+    auto it = data_.find(key);
+    if (it != data_.end()) {
+        cache_bytes -= cache_entry_bytes(key.size(), it->second.value.size());
+        access_order.erase(it->second.lru_pos);
+        data_.erase(it);
+    }
 }
 
 bool StorageEngine::set(const std::string& key, const std::string& value) {
-    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // Add to memory cache
+        cache_put(key, value);
 
-    // Add to memory cache
-    data_[key] = value;
-    access_order.push_back(key);
-    pending_writes++;
-
-    // Add to write buffer
-    write_buffer.push_back({key, value});
-
-    // Check if we need to evict entries
-    if (data_.size() > MAX_CACHE_SIZE) {
-        // Remove 20% of oldest entries
-        size_t entries_to_remove = MAX_CACHE_SIZE / 5;
-        for (size_t i = 0; i < entries_to_remove && !access_order.empty(); ++i) {
-            std::string oldest_key = access_order.front();
-            access_order.pop_front();
-            data_.erase(oldest_key);
+        // Log the value, then point the disk index at it
+        size_t offset, size;
+        append_record(RecordType::Put, key, value, offset, size);
+        update_disk_index(key, offset, size);
+        finish_appends();
+        if (journal_entries >= std::max(JOURNAL_CHECKPOINT_MIN, disk_index.size())) {
+            checkpoint_disk_index();
         }
+        seq = ++written_seq;
     }
-    
-    // Flush write buffer immediately for better persistence
-    flush_write_buffer();
 
+    // Wait for durability without blocking other requests
+    commit(seq);
     return true;
 }
 
-std::string StorageEngine::get(const std::string& key) {
-    std::lock_guard<std::mutex> lock(mutex_);
+bool StorageEngine::parse_record(std::string_view record, const std::string& key, std::string& value) {
+    if (record.size() < RECORD_HEADER_SIZE + key.size() || record_size(record.data()) != record.size() ||
+        static_cast<RecordType>(record[4]) != RecordType::Put || get_u32(record.data() + 5) != key.size() ||
+        record.compare(RECORD_HEADER_SIZE, key.size(), key) != 0) {
+        return false;
+    }
+    if (get_u32(record.data()) != Crc32c::value(record.data() + 4, record.size() - 4)) {
+        return false;
+    }
+    value.assign(record.data() + RECORD_HEADER_SIZE + key.size(), record.size() - RECORD_HEADER_SIZE - key.size());
+    return true;
+}
 
-    // First check memory cache
-    auto it = data_.find(key);
-    if (it != data_.end()) {
-        // Update access order
-        access_order.remove(key);
-        access_order.push_back(key);
-        return it->second;
+bool StorageEngine::read_record(const DiskEntry& entry, const std::string& key, std::string& value) const {
+    // set() takes keys and values of any length, so the only bound on a
+    // record is the file it sits in
+    if (entry.size < RECORD_HEADER_SIZE || entry.offset + entry.size > data_size.load(std::memory_order_acquire)) {
+        return false;
     }
 
-    // If not in memory, check disk index
-    auto disk_it = disk_index.find(key);
-    if (disk_it != disk_index.end()) {
-        std::ifstream infile("disk_storage/data.dat", std::ios::binary);
-        if (!infile.is_open()) {
-            std::cerr << "Failed to open data file for reading" << std::endl;
-            return "";
+    // Copy straight out of the page cache when the record is mapped
+    {
+        std::shared_lock<std::shared_mutex> map_lock(map_mutex);
+        uint64_t end = entry.offset + entry.size;
+        if (end <= data_size.load(std::memory_order_acquire) && data_map.covers(end)) {
+            return parse_record(data_map.view(entry.offset, entry.size), key, value);
         }
+    }
 
-        infile.seekg(disk_it->second.offset);
-        if (!infile) {
-            std::cerr << "Failed to seek to offset " << disk_it->second.offset << std::endl;
-            return "";
-        }
-        
-        // Read key length and key
-        uint32_t key_len;
-        infile.read(reinterpret_cast<char*>(&key_len), sizeof(key_len));
-        if (!infile || key_len > MAX_KEY_SIZE) {
-            std::cerr << "Failed to read key length or invalid key length" << std::endl;
-            return "";
-        }
+    if (data_fd < 0) {
+        return false;
+    }
+    std::string record(entry.size, '\0');
+    size_t done = 0;
+    while (done < record.size()) {
+        ssize_t n = pread(data_fd, &record[done], record.size() - done, entry.offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return parse_record(record, key, value);
+}
 
-        std::string stored_key(key_len, '\0');
-        infile.read(&stored_key[0], key_len);
-        if (!infile || stored_key != key) {
-            std::cerr << "Failed to read key or key mismatch" << std::endl;
-            return "";
-        }
-        
-        // Read value length and value
-        uint32_t value_len;
-        infile.read(reinterpret_cast<char*>(&value_len), sizeof(value_len));
-        if (!infile || value_len > MAX_VALUE_SIZE) {
-            std::cerr << "Failed to read value length or invalid value length" << std::endl;
-            return "";
+std::string StorageEngine::get(const std::string& key) {
+    // SET indexes every key before returning, so a key the filter has never
+    // seen is in neither the cache nor the index
+    if (!key_filter.may_contain(key)) {
+        return "";
+    }
+
+    DiskEntry entry;
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // First check memory cache
+        auto it = data_.find(key);
+        if (it != data_.end()) {
+            // Update access order
+            access_order.splice(access_order.end(), access_order, it->second.lru_pos);
+            return it->second.value;
         }
 
-        std::string value(value_len, '\0');
-        infile.read(&value[0], value_len);
-        if (!infile) {
-            std::cerr << "Failed to read value" << std::endl;
+        // If not in memory, check disk index
+        auto disk_it = disk_index.find(key);
+        if (disk_it == disk_index.end()) {
             return "";
         }
-        
-        // Add back to cache
-        data_[key] = value;
-        access_order.push_back(key);
-        return value;
+        entry = disk_it->second;
+        generation = clear_generation;
+    }
+
+    // Records are immutable once indexed, so the read needs no lock and does
+    // not hold up requests served from the cache
+    std::string value;
+    if (!read_record(entry, key, value)) {
+        std::cerr << "Failed to read record for key " << key << " at offset " << entry.offset << std::endl;
+        return "";
     }
 
-    return "";
+    // Add back to cache unless the key was rewritten, deleted or cleared
+    // while the lock was released
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto disk_it = disk_index.find(key);
+    if (generation == clear_generation && disk_it != disk_index.end() &&
+        disk_it->second.offset == entry.offset) {
+        cache_put(key, value);
+    }
+    return value;
 }
 
 bool StorageEngine::del(const std::string& key) {
-    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
 
-    // Check if key exists
-    bool exists = data_.find(key) != data_.end() || disk_index.find(key) != disk_index.end();
-    if (!exists) return false;
+        // Check if key exists
+        bool exists = data_.find(key) != data_.end() || disk_index.find(key) != disk_index.end();
+        if (!exists) return false;
 
-    // Remove from memory cache
-    data_.erase(key);
-    access_order.remove(key);
+        // Remove from memory cache
+        cache_erase(key);
 
-    // Remove from disk index
-    remove_from_disk_index(key);
+        // Log the delete, then drop the key from the disk index
+        size_t offset, size;
+        append_record(RecordType::Delete, key, std::string(), offset, size);
+        remove_from_disk_index(key, offset, size);
+        finish_appends();
+        seq = ++written_seq;
+    }
 
+    commit(seq);
     return true;
 }
 
 void StorageEngine::clear() {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // Offsets are about to be reused, so the warm-up snapshot is meaningless
+    warm_up_stop = true;
+    clear_generation++;
 
     // Clear memory data
     data_.clear();
     access_order.clear();
-    pending_writes = 0;
-    write_buffer.clear();
+    cache_bytes = 0;
     disk_index.clear();
+    key_filter.clear();
+
+    // Clear disk files. data.dat goes first: checkpoint entries past its new
+    // end are dropped on load, so a crash partway leaves the store empty.
+    data_out.close();
+    {
+        // Mapped pages past the new EOF must not be read once truncated
+        std::unique_lock<std::shared_mutex> map_lock(map_mutex);
+        data_out.open("disk_storage/data.dat", std::ios::binary | std::ios::trunc);
+        std::string header;
+        append_file_header(header, DATA_MAGIC);
+        data_out.write(header.data(), header.size());
+        data_out.flush();
+        data_size = header.size();
+    }
+    save_disk_index();
+    reset_journal();
+    uint64_t seq = ++written_seq;
+    lock.unlock();
 
-    // Clear disk files
-    std::ofstream data_file("disk_storage/data.dat", std::ios::trunc);
-    std::ofstream index_file("disk_storage/index.dat", std::ios::trunc);
-    data_file.close();
-    index_file.close();
+    commit(seq);
 }
-
-void StorageEngine::force_flush() { 
-    flush_write_buffer(); 
-} 
\ No newline at end of file
+ 
\ No newline at end of file
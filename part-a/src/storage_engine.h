@@ -1,54 +1,183 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 #include <mutex>
+#include <shared_mutex>
 #include <list>
 #include <iostream>
 #include <map>
-#include <vector>
+#include <fstream>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <string_view>
+#include "bloom_filter.h"
+#include "crc32c.h"
+#include "mapped_file.h"
 
 class StorageEngine {
 public:
-    StorageEngine();
+    // When SET/DEL/CLEAR changes reach stable storage
+    enum class FsyncPolicy {
+        Always,    // Before the call returns; concurrent callers share one fsync
+        Interval,  // In the background, at most fsync_interval_ms apart
+        Never      // Whenever the OS flushes its page cache
+    };
+
+    static constexpr size_t DEFAULT_MAX_MEMORY = 256 * 1024 * 1024;
+
+    // Startup only loads the disk index; values are read on their first GET.
+    // Records data.dat holds past what the index covers are replayed, and a
+    // torn or corrupt tail left by a crash is cut off. Throws if a file is
+    // in a format this build does not know.
+    // With warm_up set, a background thread also streams data.dat into the
+    // cache so later GETs hit memory. Cached entries are held to max_memory
+    // bytes, counting keys, values and bookkeeping; 0 disables the cache.
+    explicit StorageEngine(bool warm_up = false, FsyncPolicy fsync_policy = FsyncPolicy::Interval,
+                           unsigned fsync_interval_ms = 1000, size_t max_memory = DEFAULT_MAX_MEMORY);
     ~StorageEngine();
 
     bool set(const std::string& key, const std::string& value);
     std::string get(const std::string& key);
     bool del(const std::string& key);
     void clear();  // Clear all data from memory and disk
-    void force_flush();  // Force flush write buffer
-    size_t size() const;  // Get total number of entries (in memory + on disk)
+    size_t size() const;  // Get total number of stored entries
+    size_t cache_memory() const;  // Bytes charged for cached entries
 
 private:
-    static constexpr size_t MAX_KEY_SIZE = 256;
-    static constexpr size_t MAX_VALUE_SIZE = 1024;
-    static constexpr size_t MAX_CACHE_SIZE = 10000000;  // 10M entries max in memory
-    static constexpr size_t BATCH_SIZE = 1000000;  // 1M entries to batch write
     static constexpr const char* DISK_DIR = "disk_storage";
     static constexpr const char* DATA_FILE = "data.dat";
     static constexpr const char* INDEX_FILE = "index.dat";
+    static constexpr const char* JOURNAL_FILE = "index.journal";
+    // Rewrite index.dat once the journal holds this many entries or as many
+    // entries as the index itself, whichever is larger, so checkpoints cost
+    // O(1) amortized per write
+    static constexpr size_t JOURNAL_CHECKPOINT_MIN = 100000;
+    // Records the warm-up thread reads before taking the lock to insert them
+    static constexpr size_t WARM_UP_BATCH = 4096;
+
+    // On-disk format. Integers are little-endian, and every file starts with
+    // [magic:u64][version:u32][reserved:u32]; files from before the header
+    // are upgraded on startup.
+    //   data.dat:      [crc:u32][type:u8][key_len:u32][value_len:u32][key][value]
+    //                  per record; deletes append a record with an empty value
+    //   index.journal: [crc:u32][op:u8][key_len:u32][offset:u64][size:u64][key]
+    //                  per entry; removals point at the delete record
+    //   index.dat:     [key_len:u32][key][offset:u64][size:u64] per key, then
+    //                  [entries:u64][data_end:u64][crc:u32]
+    // Record and journal crcs are the CRC-32C of the bytes after them; the
+    // one in index.dat covers everything before it.
+    static constexpr uint32_t FORMAT_VERSION = 2;
+    static constexpr size_t FILE_HEADER_SIZE = 8 + 4 + 4;
+    static constexpr uint64_t DATA_MAGIC = 0x4154414442444c42ULL;     // "BLDBDATA"
+    static constexpr uint64_t INDEX_MAGIC = 0x58444e4942444c42ULL;    // "BLDBINDX"
+    static constexpr uint64_t JOURNAL_MAGIC = 0x4c4e524a42444c42ULL;  // "BLDBJRNL"
+    static constexpr size_t RECORD_HEADER_SIZE = 4 + 1 + 4 + 4;
+    static constexpr size_t JOURNAL_ENTRY_HEADER = 4 + 1 + 4 + 8 + 8;
+    static constexpr size_t INDEX_FOOTER_SIZE = 8 + 8 + 4;
+    // Bytes read per step when scanning data.dat
+    static constexpr size_t SCAN_CHUNK = 1 << 20;
+
+    enum class RecordType : uint8_t {
+        Put = 1,
+        Delete = 2
+    };
+
+    enum class JournalOp : uint8_t {
+        Update = 1,
+        Remove = 2
+    };
 
     struct DiskEntry {
         size_t offset;
-        size_t size;
+        size_t size;  // Of the whole record
     };
 
-    struct BatchEntry {
-        std::string key;
+    // Cached value plus its position in access_order, so promotion and
+    // removal are O(1) splices instead of list scans
+    struct CacheEntry {
         std::string value;
+        std::list<const std::string*>::iterator lru_pos;
     };
 
-    std::unordered_map<std::string, std::string> data_;
-    std::list<std::string> access_order;  // Track access order for LRU eviction
+    // data_ node (key, CacheEntry, hash, next pointer), its bucket slot and
+    // the access_order node; keys and values are charged by size on top
+    static constexpr size_t CACHE_ENTRY_OVERHEAD =
+        sizeof(std::pair<const std::string, CacheEntry>) + 3 * sizeof(void*) +
+        sizeof(const std::string*) + 2 * sizeof(void*);
+
+    static size_t cache_entry_bytes(size_t key_size, size_t value_size) {
+        return key_size + value_size + CACHE_ENTRY_OVERHEAD;
+    }
+
+    std::unordered_map<std::string, CacheEntry> data_;
+    // LRU order, least recently used first. Points at the keys stored in
+    // data_ (node-based, so their addresses are stable) to avoid a copy.
+    std::list<const std::string*> access_order;
+    size_t max_memory;       // Budget for cached entries
+    size_t cache_bytes = 0;  // Charged for the entries in data_
     mutable std::mutex mutex_;  // Make mutex mutable for const methods
-    size_t pending_writes = 0;  // Track number of pending writes
     std::map<std::string, DiskEntry> disk_index;  // Index for disk entries
-    std::vector<BatchEntry> write_buffer;  // Buffer for batch writes
+    // Every key in disk_index, so a GET for an absent key returns without
+    // taking mutex_; updated under mutex_
+    KeyFilter key_filter;
+    std::ofstream data_out;  // disk_storage/data.dat, kept open for appends
+    int data_fd = -1;  // disk_storage/data.dat, kept open for cache misses
+    MappedFile data_map;  // Read-only mapping of data.dat; the pread path is the fallback
+    // Held shared while copying out of data_map, exclusively to remap it or
+    // truncate data.dat, so a reader never touches pages past EOF
+    mutable std::shared_mutex map_mutex;
+    std::atomic<uint64_t> data_size{0};  // Bytes of data.dat written and flushed
+    uint64_t clear_generation = 0;  // Bumped by clear(); data.dat offsets are reused after it
+    std::ofstream journal_out;  // disk_storage/index.journal, index deltas since the last checkpoint
+    size_t journal_entries = 0;
+    int journal_fd = -1;  // disk_storage/index.journal, for fsync only
+
+    // Group commit. Every write takes the next sequence number under mutex_;
+    // whoever syncs first covers all writes made up to then, and the callers
+    // it covers return without issuing their own fsync.
+    FsyncPolicy fsync_policy;
+    std::chrono::milliseconds fsync_interval;
+    std::atomic<uint64_t> written_seq{0};
+    std::mutex sync_mutex;
+    std::condition_variable sync_cv;
+    uint64_t synced_seq = 0;     // Guarded by sync_mutex
+    bool sync_running = false;   // A thread is inside sync_files(); guarded by sync_mutex
+    bool fsync_stop = false;     // Guarded by sync_mutex
+    std::thread fsync_thread;    // FsyncPolicy::Interval only
+
+    std::thread warm_up_thread;
+    std::atomic<bool> warm_up_stop{false};  // Set by clear() and the destructor
 
-    void load_disk_index();
+    void upgrade_legacy_files();
+    void load_legacy_index();
+    void replay_legacy_journal();
+    uint64_t prepare_data_file();
+    bool load_disk_index(uint64_t data_file_size, uint64_t& indexed_end);
+    bool replay_journal(uint64_t data_file_size, uint64_t& indexed_end);
+    size_t recover_data_tail(uint64_t indexed_end, uint64_t data_file_size);
+    void warm_up_cache();
+    void fsync_worker();
+    void sync_files();
+    bool sync_through(std::unique_lock<std::mutex>& lock, uint64_t seq);
+    void commit(uint64_t seq);
     void save_disk_index();
+    void checkpoint_disk_index();
+    void reset_journal();
+    void append_journal(JournalOp op, const std::string& key, size_t offset, size_t size);
     void update_disk_index(const std::string& key, size_t offset, size_t size);
-    void remove_from_disk_index(const std::string& key);
-    void flush_write_buffer();
+    void remove_from_disk_index(const std::string& key, size_t offset, size_t size);
+    void append_record(RecordType type, const std::string& key, const std::string& value, size_t& offset,
+                       size_t& size);
+    void finish_appends();
+    bool read_record(const DiskEntry& entry, const std::string& key, std::string& value) const;
+    static void encode_record(std::string& out, RecordType type, const std::string& key, const std::string& value);
+    static size_t record_size(const char* header);
+    static bool parse_record(std::string_view record, const std::string& key, std::string& value);
+    static void append_file_header(std::string& out, uint64_t magic);
+    void cache_put(const std::string& key, const std::string& value);
+    void cache_erase(const std::string& key);
 }; 
\ No newline at end of file
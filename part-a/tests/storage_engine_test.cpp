@@ -0,0 +1,235 @@
+// Tests for StorageEngine. Each test runs in a fresh temporary directory,
+// since the engine keeps its files under ./disk_storage.
+#include "../src/storage_engine.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                    \
+    do {                                                                               \
+        if (!(cond)) {                                                                 \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond "\n"; \
+            failures++;                                                                \
+        }                                                                              \
+    } while (0)
+
+static void run(const char* name, const std::function<void()>& test) {
+    char dir[] = "/tmp/blinkdb_test_XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) != 0) {
+        std::cerr << "Failed to create a directory for " << name << std::endl;
+        failures++;
+        return;
+    }
+    int before = failures;
+    test();
+    std::cout << (failures == before ? "PASS " : "FAIL ") << name << std::endl;
+    if (chdir("/") == 0) {
+        std::string cleanup = std::string("rm -rf ") + dir;
+        if (system(cleanup.c_str()) != 0) std::cerr << "Failed to remove " << dir << std::endl;
+    }
+}
+
+static StorageEngine::FsyncPolicy no_fsync = StorageEngine::FsyncPolicy::Never;
+
+static void large_values_survive_restart() {
+    std::string big(2000, 'b');
+    std::string huge(1 << 20, 'h');
+    {
+        StorageEngine db(false, no_fsync);
+        CHECK(db.set("big", big));
+        CHECK(db.set("huge", huge));
+        CHECK(db.set(std::string(1000, 'k'), "long key"));
+    }
+    // Values are faulted in from disk after a restart
+    StorageEngine db(false, no_fsync);
+    CHECK(db.get("big") == big);
+    CHECK(db.get("huge") == huge);
+    CHECK(db.get(std::string(1000, 'k')) == "long key");
+}
+
+static void large_values_without_cache() {
+    std::string big(5000, 'c');
+    StorageEngine db(false, no_fsync, 1000, 0);
+    CHECK(db.set("big", big));
+    CHECK(db.get("big") == big);
+}
+
+static off_t file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void flip_byte(const char* path, off_t offset) {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekg(offset);
+    char byte = static_cast<char>(file.get());
+    file.seekp(offset);
+    file.put(static_cast<char>(byte ^ 0x40));
+}
+
+// Runs writes in a child process that then dies without shutting the
+// engine down, leaving data.dat and the journal as a crash would
+static void write_then_crash(const std::function<void(StorageEngine&)>& writes) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        StorageEngine db(false, no_fsync);
+        writes(db);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// The final record written by write_keys(): header, "k7", "last"
+static constexpr off_t LAST_RECORD_SIZE = 4 + 1 + 4 + 4 + 2 + 4;
+
+static void write_keys(StorageEngine& db) {
+    for (int i = 0; i < 100; i++) {
+        db.set("k" + std::to_string(i), "v" + std::to_string(i));
+    }
+    db.set("k7", "last");
+}
+
+static void check_keys(StorageEngine& db, const std::string& k7) {
+    size_t bad = 0;
+    for (int i = 0; i < 100; i++) {
+        std::string want = i == 7 ? k7 : "v" + std::to_string(i);
+        if (db.get("k" + std::to_string(i)) != want) bad++;
+    }
+    CHECK(bad == 0);
+}
+
+static void torn_data_tail_is_cut() {
+    write_then_crash(write_keys);
+    off_t size = file_size("disk_storage/data.dat");
+    // The last record loses its final bytes, and its journal entry now
+    // points past the end of the file
+    CHECK(truncate("disk_storage/data.dat", size - 3) == 0);
+    {
+        StorageEngine db(false, no_fsync);
+        check_keys(db, "v7");
+        CHECK(db.size() == 100);
+        // Cut back to the end of the record before it
+        CHECK(file_size("disk_storage/data.dat") == size - LAST_RECORD_SIZE);
+        CHECK(db.set("k100", "after"));
+    }
+    StorageEngine db(false, no_fsync);
+    check_keys(db, "v7");
+    CHECK(db.get("k100") == "after");
+    CHECK(db.size() == 101);
+}
+
+static void corrupt_data_tail_is_cut() {
+    write_then_crash(write_keys);
+    off_t size = file_size("disk_storage/data.dat");
+    // Lose the journal, so the records are replayed from data.dat, and
+    // damage the value of the last one
+    CHECK(truncate("disk_storage/index.journal", 16) == 0);
+    flip_byte("disk_storage/data.dat", size - 2);
+    {
+        StorageEngine db(false, no_fsync);
+        check_keys(db, "v7");
+        CHECK(file_size("disk_storage/data.dat") == size - LAST_RECORD_SIZE);
+    }
+    StorageEngine db(false, no_fsync);
+    check_keys(db, "v7");
+}
+
+static void torn_journal_entry_is_ignored() {
+    write_then_crash(write_keys);
+    off_t size = file_size("disk_storage/data.dat");
+    // The record made it to data.dat, so the scan past the journal finds it
+    CHECK(truncate("disk_storage/index.journal", file_size("disk_storage/index.journal") - 3) == 0);
+    {
+        StorageEngine db(false, no_fsync);
+        check_keys(db, "last");
+        CHECK(file_size("disk_storage/data.dat") == size);
+    }
+    StorageEngine db(false, no_fsync);
+    check_keys(db, "last");
+}
+
+// Files as written before the checksummed format: data.dat records are
+// [key_len:u32][key][value_len:u32][value], index.dat entries
+// [key_len:u32][key][offset:size_t][size:size_t] and journal entries
+// [op:u8][key_len:u32][key][offset:size_t][size:size_t], all host order
+static void legacy_files_are_upgraded() {
+    CHECK(system("mkdir -p disk_storage") == 0);
+    std::string data, index, journal;
+    auto add_record = [&](const std::string& key, const std::string& value) {
+        size_t offset = data.size();
+        uint32_t key_len = key.size(), value_len = value.size();
+        data.append(reinterpret_cast<const char*>(&key_len), sizeof key_len).append(key);
+        data.append(reinterpret_cast<const char*>(&value_len), sizeof value_len).append(value);
+        return std::make_pair(offset, data.size() - offset);
+    };
+    auto add_entry = [](std::string& out, const std::string& key, std::pair<size_t, size_t> at) {
+        uint32_t key_len = key.size();
+        out.append(reinterpret_cast<const char*>(&key_len), sizeof key_len).append(key);
+        out.append(reinterpret_cast<const char*>(&at.first), sizeof at.first);
+        out.append(reinterpret_cast<const char*>(&at.second), sizeof at.second);
+    };
+    auto add_journal = [&](uint8_t op, const std::string& key, std::pair<size_t, size_t> at) {
+        journal.push_back(static_cast<char>(op));
+        add_entry(journal, key, at);
+    };
+    auto old_a = add_record("a", "old-a");
+    auto b = add_record("b", "bee");
+    auto big = add_record("big", std::string(5000, 'x'));
+    auto new_a = add_record("a", "new-a");
+    auto c = add_record("c", "sea");
+    add_entry(index, "a", old_a);
+    add_entry(index, "b", b);
+    add_entry(index, "big", big);
+    add_journal(1, "a", new_a);
+    add_journal(1, "c", c);
+    add_journal(2, "b", b);
+    std::ofstream("disk_storage/data.dat", std::ios::binary) << data;
+    std::ofstream("disk_storage/index.dat", std::ios::binary) << index;
+    std::ofstream("disk_storage/index.journal", std::ios::binary) << journal;
+
+    auto check = [](StorageEngine& db) {
+        CHECK(db.get("a") == "new-a");
+        CHECK(db.get("b") == "");
+        CHECK(db.get("big") == std::string(5000, 'x'));
+        CHECK(db.get("c") == "sea");
+    };
+    {
+        StorageEngine db(false, no_fsync);
+        check(db);
+        CHECK(db.size() == 3);
+        CHECK(db.set("d", "dee"));
+    }
+    // data.dat now starts with the current header
+    char magic[8] = {};
+    std::ifstream("disk_storage/data.dat", std::ios::binary).read(magic, sizeof magic);
+    CHECK(std::memcmp(magic, "BLDBDATA", sizeof magic) == 0);
+    StorageEngine db(false, no_fsync);
+    check(db);
+    CHECK(db.get("d") == "dee");
+    CHECK(db.size() == 4);
+}
+
+int main() {
+    run("large_values_survive_restart", large_values_survive_restart);
+    run("large_values_without_cache", large_values_without_cache);
+    run("torn_data_tail_is_cut", torn_data_tail_is_cut);
+    run("corrupt_data_tail_is_cut", corrupt_data_tail_is_cut);
+    run("torn_journal_entry_is_ignored", torn_journal_entry_is_ignored);
+    run("legacy_files_are_upgraded", legacy_files_are_upgraded);
+    if (failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <algorithm>
 #include <chrono>
 #include <string>
 #include <vector>
@@ -13,6 +14,8 @@
 #include <mutex>
 #include <atomic>
 #include <sstream>
+#include <cstdlib>
+#include "src/storage_engine.h"
 
 class BenchmarkClient {
 private:
@@ -56,9 +59,11 @@ public:
         }
         
         // Format command in RESP protocol
-        std::string resp_command = "*" + std::to_string(args.size()) + "\r\n";
+        std::string resp_command = "*";
+        resp_command += std::to_string(args.size()) + "\r\n";
         for (const auto& arg : args) {
-            resp_command += "$" + std::to_string(arg.length()) + "\r\n" + arg + "\r\n";
+            resp_command += '$';
+            resp_command += std::to_string(arg.length()) + "\r\n" + arg + "\r\n";
         }
         
         if (send(sock, resp_command.c_str(), resp_command.length(), 0) < 0) {
@@ -76,12 +81,29 @@ public:
 };
 
 struct BenchmarkResults {
-    double set_ops_per_sec;
-    double get_ops_per_sec;
+    double set_ops_per_sec = 0.0;
+    double get_ops_per_sec = 0.0;
+    // Round-trip time of every request, in microseconds
+    std::vector<double> set_latencies;
+    std::vector<double> get_latencies;
 };
 
+static double elapsed_us(std::chrono::high_resolution_clock::time_point since) {
+    return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - since).count();
+}
+
+// Nearest-rank percentile; sorts the samples in place
+static double percentile(std::vector<double>& samples, double p) {
+    if (samples.empty()) return 0.0;
+    size_t rank = static_cast<size_t>(p / 100.0 * (samples.size() - 1) + 0.5);
+    std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+    return samples[rank];
+}
+
 BenchmarkResults run_client_benchmark(int num_operations) {
-    BenchmarkResults results = {0.0, 0.0};
+    BenchmarkResults results;
+    results.set_latencies.reserve(num_operations);
+    results.get_latencies.reserve(num_operations);
     try {
         BenchmarkClient client;
         
@@ -90,7 +112,9 @@ BenchmarkResults run_client_benchmark(int num_operations) {
         for (int i = 0; i < num_operations; i++) {
             std::string key = "key" + std::to_string(i);
             std::string value = "value" + std::to_string(i);
+            auto sent = std::chrono::high_resolution_clock::now();
             std::string response = client.send_command("SET " + key + " " + value);
+            results.set_latencies.push_back(elapsed_us(sent));
             if (response != "+OK\r\n") {
                 throw std::runtime_error("SET operation failed");
             }
@@ -103,9 +127,12 @@ BenchmarkResults run_client_benchmark(int num_operations) {
         start = std::chrono::high_resolution_clock::now();
         for (int i = 0; i < num_operations; i++) {
             std::string key = "key" + std::to_string(i);
+            auto sent = std::chrono::high_resolution_clock::now();
             std::string response = client.send_command("GET " + key);
-            std::string expected = "$" + std::to_string(std::string("value" + std::to_string(i)).length()) + 
-                                 "\r\nvalue" + std::to_string(i) + "\r\n";
+            results.get_latencies.push_back(elapsed_us(sent));
+            std::string value = "value" + std::to_string(i);
+            std::string expected = "$";
+            expected += std::to_string(value.length()) + "\r\n" + value + "\r\n";
             if (response != expected) {
                 throw std::runtime_error("GET operation failed");
             }
@@ -122,18 +149,15 @@ BenchmarkResults run_client_benchmark(int num_operations) {
 
 void run_parallel_benchmark(int num_operations, int num_connections) {
     std::vector<std::thread> threads;
-    std::atomic<double> total_set_ops{0.0};
-    std::atomic<double> total_get_ops{0.0};
+    std::vector<BenchmarkResults> results(num_connections);
     
     // Calculate operations per thread
     int ops_per_thread = num_operations / num_connections;
     
     // Create and run threads
     for (int i = 0; i < num_connections; i++) {
-        threads.emplace_back([ops_per_thread, &total_set_ops, &total_get_ops]() {
-            auto results = run_client_benchmark(ops_per_thread);
-            total_set_ops.store(total_set_ops.load() + results.set_ops_per_sec);
-            total_get_ops.store(total_get_ops.load() + results.get_ops_per_sec);
+        threads.emplace_back([ops_per_thread, &result = results[i]]() {
+            result = run_client_benchmark(ops_per_thread);
         });
     }
     
@@ -142,25 +166,105 @@ void run_parallel_benchmark(int num_operations, int num_connections) {
         thread.join();
     }
     
+    double total_set_ops = 0.0;
+    double total_get_ops = 0.0;
+    std::vector<double> set_latencies;
+    std::vector<double> get_latencies;
+    for (const auto& result : results) {
+        total_set_ops += result.set_ops_per_sec;
+        total_get_ops += result.get_ops_per_sec;
+        set_latencies.insert(set_latencies.end(), result.set_latencies.begin(), result.set_latencies.end());
+        get_latencies.insert(get_latencies.end(), result.get_latencies.begin(), result.get_latencies.end());
+    }
+
     // Print results
     std::cout << "====== BENCHMARK RESULTS ======" << std::endl;
     std::cout << "Number of operations: " << num_operations << std::endl;
     std::cout << "Number of parallel connections: " << num_connections << std::endl;
-    std::cout << "Total SET operations per second: " << std::fixed << std::setprecision(2) << total_set_ops.load() << std::endl;
-    std::cout << "Total GET operations per second: " << std::fixed << std::setprecision(2) << total_get_ops.load() << std::endl;
+    std::cout << "Total SET operations per second: " << std::fixed << std::setprecision(2) << total_set_ops << std::endl;
+    std::cout << "Total GET operations per second: " << std::fixed << std::setprecision(2) << total_get_ops << std::endl;
+    std::cout << "SET latency p50/p99 (us): " << percentile(set_latencies, 50) << " / "
+              << percentile(set_latencies, 99) << std::endl;
+    std::cout << "GET latency p50/p99 (us): " << percentile(get_latencies, 50) << " / "
+              << percentile(get_latencies, 99) << std::endl;
+}
+
+// Calls StorageEngine::put() directly from num_threads threads, so the
+// timings cover the engine's write path without the network round trip.
+// Keeps its data in a fresh directory under /tmp, away from the server's.
+void run_local_benchmark(int num_operations, int num_threads) {
+    char dir[] = "/tmp/blinkdb_bench_XXXXXX";
+    if (!mkdtemp(dir)) {
+        throw std::runtime_error("Failed to create a benchmark directory");
+    }
+    std::vector<std::vector<double>> latencies(num_threads);
+    double seconds;
+    {
+        StorageEngine engine(StorageEngine::DEFAULT_CACHE_BYTES, FsyncPolicy::Interval, 1000, EvictionPolicy::LRU,
+                             DiskEngine::Log, dir);
+        int ops_per_thread = num_operations / num_threads;
+        std::atomic<int> ready{0};
+        std::vector<std::thread> threads;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t]() {
+                std::vector<double>& samples = latencies[t];
+                samples.reserve(ops_per_thread);
+                ready++;
+                while (ready.load() < num_threads) std::this_thread::yield();
+                for (int i = 0; i < ops_per_thread; i++) {
+                    std::string key = "key" + std::to_string(t) + ":" + std::to_string(i);
+                    std::string value = "value" + std::to_string(i);
+                    auto sent = std::chrono::high_resolution_clock::now();
+                    engine.set(key, value);
+                    samples.push_back(elapsed_us(sent));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+    std::string cleanup = std::string("rm -rf ") + dir;
+    if (system(cleanup.c_str()) != 0) {
+        std::cerr << "Failed to remove " << dir << std::endl;
+    }
+
+    std::vector<double> all;
+    for (const auto& samples : latencies) {
+        all.insert(all.end(), samples.begin(), samples.end());
+    }
+    std::cout << "====== LOCAL SET BENCHMARK ======" << std::endl;
+    std::cout << "Number of operations: " << all.size() << std::endl;
+    std::cout << "Number of threads: " << num_threads << std::endl;
+    std::cout << "SET operations per second: " << std::fixed << std::setprecision(2) << all.size() / seconds
+              << std::endl;
+    std::cout << "SET latency p50/p99/p99.9 (us): " << percentile(all, 50) << " / " << percentile(all, 99)
+              << " / " << percentile(all, 99.9) << std::endl;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <num_operations> <num_connections>" << std::endl;
+    bool local = argc == 4 && strcmp(argv[1], "--local") == 0;
+    if (argc != 3 && !local) {
+        std::cerr << "Usage: " << argv[0] << " [--local] <num_operations> <num_connections>" << std::endl;
+        std::cerr << "  --local  call the storage engine in-process from num_connections threads" << std::endl;
         return 1;
     }
     
-    int num_operations = std::stoi(argv[1]);
-    int num_connections = std::stoi(argv[2]);
+    int num_operations = std::stoi(argv[local ? 2 : 1]);
+    int num_connections = std::stoi(argv[local ? 3 : 2]);
+    if (num_connections <= 0) {
+        std::cerr << "num_connections must be positive" << std::endl;
+        return 1;
+    }
     
     try {
-        run_parallel_benchmark(num_operations, num_connections);
+        if (local) {
+            run_local_benchmark(num_operations, num_connections);
+        } else {
+            run_parallel_benchmark(num_operations, num_connections);
+        }
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
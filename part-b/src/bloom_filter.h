@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Blocked Bloom filter: each key sets K bits inside one 512-bit block (a
+// cache line), so a probe costs a single cache miss. At BITS_PER_KEY bits
+// per key about 1% of absent keys get a "maybe"; a key that was added never
+// gets a "no".
+//
+// The bits are atomic words, so one thread at a time may add() while any
+// number of others probe without a lock. A probe racing an add() may miss
+// that key, never one whose add() finished before the probe started.
+class BloomFilter {
+public:
+    static constexpr size_t BITS_PER_KEY = 10;
+
+    explicit BloomFilter(size_t expected_keys)
+        : num_blocks_(std::max<size_t>(1, (expected_keys * BITS_PER_KEY + BLOCK_BITS - 1) / BLOCK_BITS))
+        , blocks_(new Block[num_blocks_]()) {}
+
+    BloomFilter(const BloomFilter&) = delete;
+    BloomFilter& operator=(const BloomFilter&) = delete;
+
+    // MurmurHash64A over little-endian words, so filters written to disk
+    // read back the same on any build
+    static uint64_t hash(std::string_view key) {
+        const uint64_t m = 0xc6a4a7935bd1e995ULL;
+        const int r = 47;
+        uint64_t h = 0x8445d61a4e774912ULL ^ (key.size() * m);
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(key.data());
+        size_t n = key.size();
+        for (; n >= 8; p += 8, n -= 8) {
+            uint64_t k = 0;
+            for (int i = 7; i >= 0; i--) k = (k << 8) | p[i];
+            k *= m;
+            k ^= k >> r;
+            k *= m;
+            h ^= k;
+            h *= m;
+        }
+        if (n > 0) {
+            for (size_t i = n; i-- > 0;) h ^= static_cast<uint64_t>(p[i]) << (8 * i);
+            h *= m;
+        }
+        h ^= h >> r;
+        h *= m;
+        h ^= h >> r;
+        return h;
+    }
+
+    void add(std::string_view key) { add_hash(hash(key)); }
+
+    void add_hash(uint64_t h) {
+        Block& block = block_for(h);
+        uint64_t g = spread(h);
+        for (int i = 0; i < K; i++) {
+            unsigned bit = static_cast<unsigned>(g >> (64 - 9 * (i + 1))) & 511;
+            std::atomic<uint64_t>& word = block.words[bit >> 6];
+            // Adds are serialized, so a plain read-modify-write is enough
+            word.store(word.load(std::memory_order_relaxed) | (uint64_t(1) << (bit & 63)),
+                       std::memory_order_release);
+        }
+    }
+
+    bool may_contain(std::string_view key) const { return may_contain_hash(hash(key)); }
+
+    bool may_contain_hash(uint64_t h) const {
+        const Block& block = block_for(h);
+        uint64_t g = spread(h);
+        for (int i = 0; i < K; i++) {
+            unsigned bit = static_cast<unsigned>(g >> (64 - 9 * (i + 1))) & 511;
+            if (!(block.words[bit >> 6].load(std::memory_order_acquire) & (uint64_t(1) << (bit & 63)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Keys it was sized for
+    size_t capacity() const { return num_blocks_ * BLOCK_BITS / BITS_PER_KEY; }
+
+    // Takes on other's bits word by word; both must be the same size. A key
+    // set in both stays visible to concurrent probes throughout.
+    void assign(const BloomFilter& other) {
+        for (size_t b = 0; b < num_blocks_; b++) {
+            for (int w = 0; w < WORDS_PER_BLOCK; w++) {
+                blocks_[b].words[w].store(other.blocks_[b].words[w].load(std::memory_order_relaxed),
+                                          std::memory_order_release);
+            }
+        }
+    }
+
+    bool same_size(const BloomFilter& other) const { return num_blocks_ == other.num_blocks_; }
+
+    // Appends [u32 block count][block words, little-endian]
+    void encode(std::string& out) const {
+        put_le(out, num_blocks_, 4);
+        for (size_t b = 0; b < num_blocks_; b++) {
+            for (int w = 0; w < WORDS_PER_BLOCK; w++) {
+                put_le(out, blocks_[b].words[w].load(std::memory_order_relaxed), 8);
+            }
+        }
+    }
+
+    // nullptr unless data is exactly one encoded filter
+    static std::unique_ptr<BloomFilter> decode(std::string_view data) {
+        if (data.size() < 4) return nullptr;
+        size_t blocks = static_cast<size_t>(get_le(data.data(), 4));
+        if (blocks == 0 || (data.size() - 4) / (WORDS_PER_BLOCK * 8) != blocks ||
+            (data.size() - 4) % (WORDS_PER_BLOCK * 8) != 0) {
+            return nullptr;
+        }
+        std::unique_ptr<BloomFilter> filter(new BloomFilter(blocks, 0));
+        const char* p = data.data() + 4;
+        for (size_t b = 0; b < blocks; b++) {
+            for (int w = 0; w < WORDS_PER_BLOCK; w++, p += 8) {
+                filter->blocks_[b].words[w].store(get_le(p, 8), std::memory_order_relaxed);
+            }
+        }
+        return filter;
+    }
+
+private:
+    static constexpr size_t BLOCK_BITS = 512;
+    static constexpr int WORDS_PER_BLOCK = BLOCK_BITS / 64;
+    static constexpr int K = 6;  // Bits per key; each takes 9 bits of spread()
+
+    struct alignas(64) Block {
+        std::atomic<uint64_t> words[WORDS_PER_BLOCK];
+    };
+
+    BloomFilter(size_t num_blocks, int) : num_blocks_(num_blocks), blocks_(new Block[num_blocks_]()) {}
+
+    // High half of the hash picks the block, a remix of it the bits
+    Block& block_for(uint64_t h) const {
+        return blocks_[static_cast<size_t>(((h >> 32) * num_blocks_) >> 32)];
+    }
+
+    static uint64_t spread(uint64_t h) {
+        return (h ^ (h >> 31)) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    static void put_le(std::string& out, uint64_t v, int bytes) {
+        for (int i = 0; i < bytes; i++) out.push_back(static_cast<char>(v >> (8 * i)));
+    }
+
+    static uint64_t get_le(const char* p, int bytes) {
+        uint64_t v = 0;
+        for (int i = bytes - 1; i >= 0; i--) v = (v << 8) | static_cast<unsigned char>(p[i]);
+        return v;
+    }
+
+    size_t num_blocks_;
+    std::unique_ptr<Block[]> blocks_;
+};
+
+// BloomFilter over a key set that changes, such as an in-memory index,
+// probed without the index's lock. The owner calls add() for each key it
+// inserts, under its lock, and rebuild() with its live keys whenever
+// needs_rebuild() says so: once the filter has taken in more keys than it
+// was sized for. Keys the owner deletes linger until then, costing only a
+// locked lookup for the occasional "maybe".
+//
+// Rebuilding at the same size rewrites the bits in place. Growing swaps in
+// a new filter; the old one may still be mid-probe, so it is kept until
+// destruction. Sizes at least double each time, so the old filters never
+// add up to more than the current one.
+class KeyFilter {
+public:
+    KeyFilter() {
+        filters_.push_back(std::make_unique<BloomFilter>(MIN_KEYS));
+        current_.store(filters_.back().get(), std::memory_order_release);
+    }
+
+    KeyFilter(const KeyFilter&) = delete;
+    KeyFilter& operator=(const KeyFilter&) = delete;
+
+    bool may_contain(std::string_view key) const {
+        return current_.load(std::memory_order_acquire)->may_contain(key);
+    }
+
+    void add(std::string_view key) {
+        filters_.back()->add(key);
+        added_++;
+    }
+
+    bool needs_rebuild() const { return added_ > filters_.back()->capacity(); }
+
+    // keys: the live keys, as a range of pairs keyed by .first
+    template <typename Index>
+    void rebuild(const Index& keys, size_t count) {
+        BloomFilter& current = *filters_.back();
+        auto fresh = std::make_unique<BloomFilter>(std::max(current.capacity(), count * 2));
+        for (const auto& entry : keys) {
+            fresh->add(entry.first);
+        }
+        if (fresh->same_size(current)) {
+            current.assign(*fresh);
+        } else {
+            filters_.push_back(std::move(fresh));
+            current_.store(filters_.back().get(), std::memory_order_release);
+        }
+        added_ = count;
+    }
+
+    // For when the owner drops every key
+    void clear() {
+        filters_.back()->assign(BloomFilter(filters_.back()->capacity()));
+        added_ = 0;
+    }
+
+private:
+    static constexpr size_t MIN_KEYS = 1024;
+
+    std::vector<std::unique_ptr<BloomFilter>> filters_;  // Current one last
+    std::atomic<const BloomFilter*> current_;
+    size_t added_ = 0;  // Keys added since the last rebuild, counting those it kept
+};
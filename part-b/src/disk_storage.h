@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "log_record.h"
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#else
+#include <climits>
+#endif
+
+// A queued change to one key, waiting for StorageEngine's writer thread
+struct WriteOp {
+    LogRecord::Type type;
+    std::string key;
+    std::string value;  // Empty for deletes
+};
+
+// Hash for maps keyed by std::string that can be searched with a
+// std::string_view (with std::equal_to<>), so looking up a key parsed out of
+// a request does not copy it into a std::string first
+struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+};
+
+template <typename T>
+using StringMap = std::unordered_map<std::string, T, StringHash, std::equal_to<>>;
+
+// On-disk engines StorageEngine can run on
+//   Log: Bitcask-style append-only segments with every key's location held
+//        in memory; a single disk read per GET, but the key set must fit in RAM
+//   LSM: log-structured merge tree; memory holds only the memtable and a
+//        sparse index per table, so the dataset can be far larger than RAM
+enum class DiskEngine {
+    Log,
+    LSM
+};
+
+// Durable key-value store under StorageEngine's cache and write queue.
+// Implementations are thread-safe; StorageEngine's writer thread is their
+// only writer apart from clear().
+class DiskStorage {
+public:
+    virtual ~DiskStorage() = default;
+
+    virtual bool get(std::string_view key, std::string& value) = 0;
+    virtual bool put(std::string_view key, std::string_view value) = 0;
+    // Applies the writes in order, as one append where the engine can
+    virtual bool write_batch(const std::vector<WriteOp>& ops) = 0;
+    virtual bool contains(std::string_view key) = 0;
+    virtual void remove(std::string_view key) = 0;
+    // Makes every write applied so far durable
+    virtual bool sync() = 0;
+    virtual void clear() = 0;
+
+protected:
+    // dir, or disk_storage/ next to the executable if dir is empty;
+    // created if missing
+    static std::filesystem::path storage_directory(const std::filesystem::path& base = {}) {
+        std::filesystem::path dir = base.empty() ? executable_directory() / "disk_storage" : base;
+        std::filesystem::create_directories(dir);
+        return dir;
+    }
+
+    static std::filesystem::path executable_directory() {
+        #ifdef __APPLE__
+            char path[1024];
+            uint32_t size = sizeof(path);
+            if (_NSGetExecutablePath(path, &size) == 0) {
+                return std::filesystem::path(path).parent_path();
+            }
+        #else
+            char result[PATH_MAX];
+            ssize_t count = readlink("/proc/self/exe", result, sizeof(result));
+            if (count != -1) {
+                // readlink does not NUL-terminate
+                return std::filesystem::path(std::string(result, count)).parent_path();
+            }
+        #endif
+        return std::filesystem::current_path();
+    }
+
+    static bool write_fully(int fd, const char* data, size_t n, uint64_t offset) {
+        while (n > 0) {
+            ssize_t w = pwrite(fd, data, n, offset);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += w;
+            n -= w;
+            offset += w;
+        }
+        return true;
+    }
+
+    static bool read_fully(int fd, char* data, size_t n, uint64_t offset) {
+        while (n > 0) {
+            ssize_t r = pread(fd, data, n, offset);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return false;
+            data += r;
+            n -= r;
+            offset += r;
+        }
+        return true;
+    }
+
+    // Reads which LogRecord::Format the log file fd of size bytes is in;
+    // false if it is none this build knows
+    static bool read_log_format(int fd, uint64_t size, LogRecord::Format& format) {
+        char header[LogRecord::FILE_HEADER_SIZE];
+        size_t n = static_cast<size_t>(std::min<uint64_t>(size, sizeof(header)));
+        return read_fully(fd, header, n, 0) && LogRecord::file_format(header, n, format);
+    }
+
+    static bool sync_fd(int fd) {
+#ifdef __APPLE__
+        // fsync on macOS does not flush the drive's write cache
+        return fcntl(fd, F_FULLFSYNC) == 0 || fsync(fd) == 0;
+#else
+        return fdatasync(fd) == 0;
+#endif
+    }
+
+    // Makes renames and unlinks inside dir durable
+    static bool sync_directory(const std::filesystem::path& dir) {
+        int fd = open(dir.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        bool ok = fsync(fd) == 0;
+        close(fd);
+        return ok;
+    }
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include "crc32c.h"
+
+// Binary record format shared by the log-structured disk files.
+//
+//   [crc:u32][type:u8][key_len:u32][value_len:u32][key][value]
+//
+// crc is the CRC-32C of everything after it, so a torn or corrupted record
+// is told apart from a valid one instead of being read as garbage. Integers
+// are little-endian regardless of host byte order, so files can be moved
+// between machines. Delete records (tombstones) carry an empty value.
+//
+// Log files (segments, write-ahead logs) start with a file header:
+//
+//   [magic:u64][version:u32][reserved:u32]
+//
+// Files written before checksums (Format::V1) have neither the header nor
+// the crc field; readers that meet one take the format as a parameter.
+struct LogRecord {
+    enum class Type : uint8_t {
+        Put = 1,
+        Delete = 2
+    };
+
+    enum class Format : uint32_t {
+        V1 = 1,  // [type][key_len][value_len][key][value], no file header
+        V2 = 2   // Checksummed records after a file header
+    };
+
+    static constexpr Format CURRENT_FORMAT = Format::V2;
+    static constexpr size_t HEADER_SIZE = 4 + 1 + 4 + 4;
+    static constexpr size_t FILE_HEADER_SIZE = 8 + 4 + 4;
+    static constexpr uint64_t FILE_MAGIC = 0x46474f4c42444c42ULL;  // "BLDBLOGF"
+    static constexpr uint32_t MAX_KEY_SIZE = 64 * 1024;
+    static constexpr uint32_t MAX_VALUE_SIZE = 512 * 1024 * 1024;
+
+    Type type;
+    std::string_view key;
+    std::string_view value;
+
+    // Whether a record with these sizes can be written. record_size() takes
+    // anything larger for garbage, so writers must check this first.
+    static bool fits(size_t key_len, size_t value_len) {
+        return key_len <= MAX_KEY_SIZE && value_len <= MAX_VALUE_SIZE;
+    }
+
+    static size_t encoded_size(size_t key_len, size_t value_len) {
+        return HEADER_SIZE + key_len + value_len;
+    }
+
+    static size_t header_size(Format format) {
+        return format == Format::V1 ? HEADER_SIZE - 4 : HEADER_SIZE;
+    }
+
+    // Offset of a file's first record
+    static uint64_t data_start(Format format) {
+        return format == Format::V1 ? 0 : FILE_HEADER_SIZE;
+    }
+
+    static void put_u32(char* p, uint32_t v) {
+        p[0] = static_cast<char>(v);
+        p[1] = static_cast<char>(v >> 8);
+        p[2] = static_cast<char>(v >> 16);
+        p[3] = static_cast<char>(v >> 24);
+    }
+
+    static uint32_t get_u32(const char* p) {
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        return static_cast<uint32_t>(u[0]) | (static_cast<uint32_t>(u[1]) << 8) |
+               (static_cast<uint32_t>(u[2]) << 16) | (static_cast<uint32_t>(u[3]) << 24);
+    }
+
+    static void put_u64(char* p, uint64_t v) {
+        put_u32(p, static_cast<uint32_t>(v));
+        put_u32(p + 4, static_cast<uint32_t>(v >> 32));
+    }
+
+    static uint64_t get_u64(const char* p) {
+        return static_cast<uint64_t>(get_u32(p)) | (static_cast<uint64_t>(get_u32(p + 4)) << 32);
+    }
+
+    // Appends the encoded record to out
+    static void encode(std::string& out, Type type, std::string_view key, std::string_view value) {
+        char header[HEADER_SIZE];
+        header[4] = static_cast<char>(type);
+        put_u32(header + 5, static_cast<uint32_t>(key.size()));
+        put_u32(header + 9, static_cast<uint32_t>(value.size()));
+        uint32_t crc = Crc32c::extend(Crc32c::value(header + 4, HEADER_SIZE - 4), key.data(), key.size());
+        put_u32(header, Crc32c::extend(crc, value.data(), value.size()));
+        out.append(header, HEADER_SIZE);
+        out.append(key.data(), key.size());
+        out.append(value.data(), value.size());
+    }
+
+    // Appends the header every new log file starts with
+    static void encode_file_header(std::string& out) {
+        char header[FILE_HEADER_SIZE] = {};
+        put_u64(header, FILE_MAGIC);
+        put_u32(header + 8, static_cast<uint32_t>(CURRENT_FORMAT));
+        out.append(header, FILE_HEADER_SIZE);
+    }
+
+    // Tells the format of a log file from its first n bytes, n being the
+    // file size or FILE_HEADER_SIZE, whichever is smaller. An empty file,
+    // or one cut short inside its header, reads as the current format with
+    // no records. False for anything else, such as a newer version.
+    static bool file_format(const char* data, size_t n, Format& format) {
+        uint8_t first = n > 0 ? static_cast<uint8_t>(data[0]) : 0;
+        if (first == static_cast<uint8_t>(Type::Put) || first == static_cast<uint8_t>(Type::Delete)) {
+            format = Format::V1;
+            return true;
+        }
+        std::string header;
+        encode_file_header(header);
+        format = CURRENT_FORMAT;
+        return header.compare(0, std::min(n, FILE_HEADER_SIZE), data, std::min(n, FILE_HEADER_SIZE)) == 0;
+    }
+
+    // Validates the header at data (at least header_size(format) bytes) and
+    // returns the full encoded size of the record, or 0 if the header is
+    // garbage. The checksum is not checked.
+    static size_t record_size(const char* data, Format format = CURRENT_FORMAT) {
+        size_t header = header_size(format);
+        const char* fields = data + header - 9;  // [type][key_len][value_len]
+        uint8_t type = static_cast<uint8_t>(fields[0]);
+        if (type != static_cast<uint8_t>(Type::Put) && type != static_cast<uint8_t>(Type::Delete)) {
+            return 0;
+        }
+        uint32_t key_len = get_u32(fields + 1);
+        uint32_t value_len = get_u32(fields + 5);
+        if (key_len > MAX_KEY_SIZE || value_len > MAX_VALUE_SIZE) return 0;
+        return header + key_len + value_len;
+    }
+
+    // Whether the record of total bytes at data matches its checksum
+    static bool checksum_ok(const char* data, size_t total) {
+        return get_u32(data) == Crc32c::value(data + 4, total - 4);
+    }
+
+    // Whether [offset, end) of fd starts with a whole record that passes its
+    // checksum but has a key or value over the size limits. A crash cannot
+    // leave one behind, so recovery must not cut it off as a torn tail;
+    // only a build without the write-path check could have written it.
+    // Always false for Format::V1, which has no checksum to go by.
+    static bool oversized_at(int fd, uint64_t offset, uint64_t end, Format format = CURRENT_FORMAT) {
+        char header[HEADER_SIZE];
+        if (format == Format::V1 || offset + HEADER_SIZE > end ||
+            pread(fd, header, HEADER_SIZE, static_cast<off_t>(offset)) != static_cast<ssize_t>(HEADER_SIZE)) {
+            return false;
+        }
+        uint8_t type = static_cast<uint8_t>(header[4]);
+        uint64_t key_len = get_u32(header + 5);
+        uint64_t value_len = get_u32(header + 9);
+        if ((type != static_cast<uint8_t>(Type::Put) && type != static_cast<uint8_t>(Type::Delete)) ||
+            fits(key_len, value_len) || HEADER_SIZE + key_len + value_len > end - offset) {
+            return false;
+        }
+        // Checksummed in chunks: the record may be several GB
+        uint32_t crc = Crc32c::value(header + 4, HEADER_SIZE - 4);
+        uint64_t record_end = offset + HEADER_SIZE + key_len + value_len;
+        std::string chunk(static_cast<size_t>(std::min<uint64_t>(key_len + value_len, 1 << 20)), '\0');
+        for (uint64_t pos = offset + HEADER_SIZE; pos < record_end;) {
+            size_t want = static_cast<size_t>(std::min<uint64_t>(chunk.size(), record_end - pos));
+            ssize_t r = pread(fd, &chunk[0], want, static_cast<off_t>(pos));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return false;
+            crc = Crc32c::extend(crc, chunk.data(), static_cast<size_t>(r));
+            pos += static_cast<uint64_t>(r);
+        }
+        return crc == get_u32(header);
+    }
+
+    // Like decode(), but leaves the checksum to the caller: for scans that
+    // only need the one record they are looking for
+    static size_t parse(const char* data, size_t n, LogRecord& record, Format format = CURRENT_FORMAT) {
+        size_t header = header_size(format);
+        if (n < header) return 0;
+        size_t total = record_size(data, format);
+        if (total == 0 || n < total) return 0;
+
+        uint32_t key_len = get_u32(data + header - 8);
+        record.type = static_cast<Type>(data[header - 9]);
+        record.key = std::string_view(data + header, key_len);
+        record.value = std::string_view(data + header + key_len, total - header - key_len);
+        return total;
+    }
+
+    // Decodes the record at the start of [data, data + n). Returns its encoded
+    // size, or 0 if the bytes hold only part of a record, are not a record or
+    // fail the checksum.
+    static size_t decode(const char* data, size_t n, LogRecord& record, Format format = CURRENT_FORMAT) {
+        size_t total = parse(data, n, record, format);
+        if (total == 0 || (format != Format::V1 && !checksum_ok(data, total))) return 0;
+        return total;
+    }
+};
+
+// Sequential scanner over the records of a log file in [start, end).
+//
+// Reads in large chunks so startup and compaction cost one syscall per chunk
+// rather than per record. Stops at the first record that is cut short,
+// malformed or fails its checksum; valid_end() then tells how far the file
+// is intact.
+class LogReader {
+public:
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+    LogReader(int fd, uint64_t start, uint64_t end, LogRecord::Format format = LogRecord::CURRENT_FORMAT)
+        : fd_(fd), format_(format), file_pos_(start), end_(end), base_(start), valid_end_(start) {}
+
+    // Returns the next record; its views stay valid until the following call.
+    bool next(LogRecord& record) {
+        while (true) {
+            size_t avail = buf_.size() - pos_;
+            size_t n = LogRecord::decode(buf_.data() + pos_, avail, record, format_);
+            if (n > 0) {
+                record_offset_ = base_ + pos_;
+                pos_ += n;
+                valid_end_ = base_ + pos_;
+                return true;
+            }
+
+            size_t want = CHUNK_SIZE;
+            if (avail >= LogRecord::header_size(format_)) {
+                size_t total = LogRecord::record_size(buf_.data() + pos_, format_);
+                // Garbage header, or a whole record that fails its checksum
+                if (total == 0 || total <= avail) return false;
+                want = std::max(want, total - avail);
+            }
+            if (file_pos_ >= end_) return false;  // Clean end or torn tail
+            if (!fill(want)) return false;
+        }
+    }
+
+    uint64_t record_offset() const { return record_offset_; }
+    uint64_t valid_end() const { return valid_end_; }
+
+private:
+    int fd_;
+    LogRecord::Format format_;
+    uint64_t file_pos_;   // Next file offset to read
+    uint64_t end_;
+    std::string buf_;
+    size_t pos_ = 0;      // Parse position in buf_
+    uint64_t base_;       // File offset of buf_[0]
+    uint64_t record_offset_ = 0;
+    uint64_t valid_end_;
+
+    bool fill(size_t want) {
+        // Drop consumed bytes, keep the partial record
+        buf_.erase(0, pos_);
+        base_ += pos_;
+        pos_ = 0;
+
+        size_t to_read = static_cast<size_t>(std::min<uint64_t>(want, end_ - file_pos_));
+        size_t old_size = buf_.size();
+        buf_.resize(old_size + to_read);
+        size_t done = 0;
+        while (done < to_read) {
+            ssize_t r = pread(fd_, &buf_[old_size + done], to_read - done, file_pos_ + done);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            done += static_cast<size_t>(r);
+        }
+        buf_.resize(old_size + done);
+        file_pos_ += done;
+        if (done < to_read) {
+            end_ = file_pos_;  // File is shorter than expected
+        }
+        return done > 0;
+    }
+};
@@ -0,0 +1,971 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bloom_filter.h"
+#include "crc32c.h"
+#include "disk_storage.h"
+#include "log_record.h"
+#include "mapped_file.h"
+
+// Bitcask-style log store: records are appended to numbered segment files
+// (disk_storage/NNNNNN.data), and an in-memory keydir maps each live key to
+// the segment, offset and size of its latest record, so a GET is one read.
+//
+// Every put/remove is a single append to the active segment, which is sealed
+// and replaced by a fresh one once it reaches segment_bytes. A background
+// thread then writes the sealed segment's hint file (NNNNNN.hint): each
+// record's key, size and offset without the value, so a restart loads the
+// keydir from the hints and only scans the active segment.
+//
+// Overwritten and deleted records become garbage; once garbage makes up more
+// than MERGE_GARBAGE_RATIO of the sealed segments, the same thread merges
+// them: their live records are rewritten, with fresh hints, into as few
+// segments as they fill. Writes carry on into the active segment meanwhile.
+//
+// A KeyFilter over the keydir answers GETs for absent keys without taking
+// the lock, except for the ~1% false positives.
+//
+// Recovery replays segments in number order, so later records win. Merge
+// outputs take the numbers of the segments they replace, which keeps them
+// ordered before everything written since; a MERGE file lists the swap so a
+// crash halfway through renaming the outputs into place is rolled forward.
+// Records and hint files are checksummed: a segment without a hint is
+// replayed up to its first bad record and cut there, a hint that fails its
+// checksum is ignored, and a GET whose record fails its checksum misses.
+// Segments from before checksums are rewritten in the current format once,
+// on the first start that finds them.
+class LogStorage : public DiskStorage {
+public:
+    static constexpr uint64_t DEFAULT_SEGMENT_BYTES = 64 * 1024 * 1024;
+
+private:
+    struct Location {
+        uint64_t offset;      // Start of the key's latest record
+        uint32_t value_size;
+        uint32_t segment;
+    };
+
+    struct Segment {
+        uint32_t id;
+        int fd;
+        uint64_t size = 0;
+        uint64_t live_bytes = 0;  // Bytes of records still referenced by the keydir
+        MappedFile map;           // Read path for fd; covers at least size when mapped
+
+        Segment(uint32_t id, int fd) : id(id), fd(fd) {}
+        ~Segment() {
+            map.unmap();
+            if (fd >= 0) close(fd);
+        }
+    };
+
+    // A merge output being written: a segment and its hint file
+    struct MergeOutput {
+        uint32_t id;
+        int fd;
+        uint64_t size = 0;
+        std::string hint;
+        uint64_t hint_entries = 0;
+
+        MergeOutput(uint32_t id, int fd) : id(id), fd(fd) {}
+    };
+
+    static constexpr uint64_t MIN_SEGMENT_BYTES = 64 * 1024;
+    static constexpr uint64_t MERGE_MIN_BYTES = 4 * 1024 * 1024;
+    static constexpr double MERGE_GARBAGE_RATIO = 0.5;
+    static constexpr size_t MERGE_WRITE_CHUNK = 1 << 20;
+    static constexpr size_t BATCH_WRITE_CHUNK = 1 << 20;
+    // Hint entry: [u8 type][u32 key_size][u32 value_size][u64 offset][key];
+    // the file ends with [u64 entry count][u32 CRC-32C of the entries][u64 HINT_MAGIC]
+    static constexpr size_t HINT_ENTRY_HEADER = 1 + 4 + 4 + 8;
+    static constexpr size_t HINT_FOOTER_SIZE = 8 + 4 + 8;
+    static constexpr uint64_t HINT_MAGIC = 0x32544e4842444c42ull;  // "BLDBHNT2"
+    static constexpr const char* MERGE_HEADER = "blinkdb-merge 1";
+
+    std::filesystem::path dir_;
+    uint64_t segment_bytes_;
+    std::mutex mutex_;
+    std::string batch_buffer_;  // Encoding space for write_batch(), guarded by mutex_
+    // Every segment by number, the active one included. The background
+    // worker reads sealed segments without the lock, so it holds them by
+    // shared_ptr.
+    std::map<uint32_t, std::shared_ptr<Segment>> segments_;
+    std::shared_ptr<Segment> active_;
+    uint32_t next_segment_ = 1;
+    StringMap<Location> index_;
+    KeyFilter key_filter_;            // Every key in index_, probed without the lock
+    uint64_t sealed_bytes_ = 0;       // Total size of the sealed segments
+    uint64_t sealed_live_bytes_ = 0;  // Of which still referenced by index_
+    uint64_t generation_ = 0;         // Bumped by clear() so a merge can detect it
+
+    std::thread worker_;
+    std::condition_variable work_cv_;                 // Work for background_worker()
+    std::vector<std::shared_ptr<Segment>> unhinted_;  // Sealed segments awaiting a hint
+    bool merge_requested_ = false;
+    bool stopping_ = false;
+
+    std::filesystem::path segment_path(uint32_t id, const char* extension) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%06u%s", id, extension);
+        return dir_ / name;
+    }
+
+    // Parses "NNNNNN<extension>"; false for anything else
+    static bool parse_segment_name(const std::string& name, const char* extension, uint32_t& id) {
+        size_t digits = name.size() - std::min(name.size(), strlen(extension));
+        if (digits == 0 || digits > 9 || name.compare(digits, std::string::npos, extension) != 0) {
+            return false;
+        }
+        id = 0;
+        for (size_t i = 0; i < digits; i++) {
+            if (name[i] < '0' || name[i] > '9') return false;
+            id = id * 10 + static_cast<uint32_t>(name[i] - '0');
+        }
+        return true;
+    }
+
+    Segment& segment_locked(uint32_t id) {
+        if (id == active_->id) return *active_;
+        return *segments_.find(id)->second;
+    }
+
+    // Points key at a new record, or drops it for a delete, keeping the
+    // segments' live byte counts in step
+    void apply_locked(LogRecord::Type type, std::string_view key, uint32_t value_size,
+                      uint32_t segment, uint64_t offset) {
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            Segment& old = segment_locked(it->second.segment);
+            uint64_t n = LogRecord::encoded_size(key.size(), it->second.value_size);
+            old.live_bytes -= n;
+            if (&old != active_.get()) sealed_live_bytes_ -= n;
+        }
+        if (type == LogRecord::Type::Put) {
+            Location loc{offset, value_size, segment};
+            if (it != index_.end()) {
+                it->second = loc;
+            } else {
+                index_.emplace(std::string(key), loc);
+                key_filter_.add(key);
+                if (key_filter_.needs_rebuild()) {
+                    key_filter_.rebuild(index_, index_.size());
+                }
+            }
+            Segment& seg = segment_locked(segment);
+            uint64_t n = LogRecord::encoded_size(key.size(), value_size);
+            seg.live_bytes += n;
+            if (&seg != active_.get()) sealed_live_bytes_ += n;
+        } else if (it != index_.end()) {
+            index_.erase(it);
+        }
+    }
+
+    void recount_sealed_locked() {
+        sealed_bytes_ = sealed_live_bytes_ = 0;
+        for (const auto& [id, seg] : segments_) {
+            if (seg != active_) {
+                sealed_bytes_ += seg->size;
+                sealed_live_bytes_ += seg->live_bytes;
+            }
+        }
+    }
+
+    std::shared_ptr<Segment> create_segment(uint32_t id) {
+        std::filesystem::path path = segment_path(id, ".data");
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        std::string header;
+        LogRecord::encode_file_header(header);
+        if (fd < 0 || !write_fully(fd, header.data(), header.size(), 0)) {
+            std::cerr << "LogStorage: failed to create " << path << std::endl;
+            if (fd >= 0) close(fd);
+            return nullptr;
+        }
+        auto seg = std::make_shared<Segment>(id, fd);
+        seg->size = header.size();
+        return seg;
+    }
+
+    // Seals the active segment and starts the next one. sync() only flushes
+    // the active segment, so the sealed one is made durable here.
+    bool rotate_locked() {
+        if (!sync_fd(active_->fd)) {
+            std::cerr << "LogStorage: failed to sync segment " << active_->id << std::endl;
+            return false;
+        }
+        std::shared_ptr<Segment> seg = create_segment(next_segment_);
+        if (!seg) return false;
+        next_segment_++;
+        sync_directory(dir_);
+        sealed_bytes_ += active_->size;
+        sealed_live_bytes_ += active_->live_bytes;
+        unhinted_.push_back(active_);
+        work_cv_.notify_one();
+        segments_.emplace(seg->id, seg);
+        active_ = seg;
+        return true;
+    }
+
+    // Appends to the active segment, rotating first if it is full. offset
+    // receives where the data starts in active_.
+    bool append_locked(const std::string& encoded, uint64_t& offset) {
+        if (!active_) return false;
+        if (active_->size >= segment_bytes_ && !rotate_locked()) return false;
+        if (!write_fully(active_->fd, encoded.data(), encoded.size(), active_->size)) {
+            return false;
+        }
+        offset = active_->size;
+        active_->size += encoded.size();
+        return true;
+    }
+
+    static void append_hint_entry(std::string& hint, LogRecord::Type type, std::string_view key,
+                                  uint32_t value_size, uint64_t offset) {
+        char header[HINT_ENTRY_HEADER];
+        header[0] = static_cast<char>(type);
+        LogRecord::put_u32(header + 1, static_cast<uint32_t>(key.size()));
+        LogRecord::put_u32(header + 5, value_size);
+        LogRecord::put_u64(header + 9, offset);
+        hint.append(header, sizeof(header));
+        hint.append(key);
+    }
+
+    // Adds the footer and writes the hint to path, durably
+    static bool write_hint_file(const std::string& path, std::string& hint, uint64_t entries) {
+        char footer[HINT_FOOTER_SIZE];
+        LogRecord::put_u64(footer, entries);
+        LogRecord::put_u32(footer + 8, Crc32c::value(hint.data(), hint.size()));
+        LogRecord::put_u64(footer + 12, HINT_MAGIC);
+        hint.append(footer, sizeof(footer));
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = write_fully(fd, hint.data(), hint.size(), 0) && sync_fd(fd);
+        close(fd);
+        return ok;
+    }
+
+    // Rebuilds the keydir entries of one segment from its hint file.
+    // Returns false, having applied nothing, if the hint is missing or bad.
+    bool load_hint(Segment& seg) {
+        int fd = open(segment_path(seg.id, ".hint").c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        std::string hint;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok) {
+            hint.resize(static_cast<size_t>(st.st_size));
+            ok = read_fully(fd, hint.data(), hint.size(), 0);
+        }
+        close(fd);
+        if (!ok || hint.size() < HINT_FOOTER_SIZE) return false;
+        size_t end = hint.size() - HINT_FOOTER_SIZE;
+        uint64_t entries = LogRecord::get_u64(&hint[end]);
+        if (LogRecord::get_u64(&hint[end + 12]) != HINT_MAGIC ||
+            LogRecord::get_u32(&hint[end + 8]) != Crc32c::value(hint.data(), end)) {
+            return false;
+        }
+
+        // Check the whole file before touching the keydir
+        size_t pos = 0;
+        for (uint64_t i = 0; i < entries; i++) {
+            if (end - pos < HINT_ENTRY_HEADER) return false;
+            uint8_t type = static_cast<uint8_t>(hint[pos]);
+            uint32_t key_size = LogRecord::get_u32(&hint[pos + 1]);
+            uint32_t value_size = LogRecord::get_u32(&hint[pos + 5]);
+            uint64_t offset = LogRecord::get_u64(&hint[pos + 9]);
+            pos += HINT_ENTRY_HEADER;
+            if ((type != static_cast<uint8_t>(LogRecord::Type::Put) &&
+                 type != static_cast<uint8_t>(LogRecord::Type::Delete)) ||
+                end - pos < key_size || offset < LogRecord::FILE_HEADER_SIZE || offset > seg.size ||
+                LogRecord::encoded_size(key_size, value_size) > seg.size - offset) {
+                return false;
+            }
+            pos += key_size;
+        }
+        if (pos != end) return false;
+
+        index_.reserve(index_.size() + entries);
+        pos = 0;
+        for (uint64_t i = 0; i < entries; i++) {
+            auto type = static_cast<LogRecord::Type>(hint[pos]);
+            uint32_t key_size = LogRecord::get_u32(&hint[pos + 1]);
+            uint32_t value_size = LogRecord::get_u32(&hint[pos + 5]);
+            uint64_t offset = LogRecord::get_u64(&hint[pos + 9]);
+            pos += HINT_ENTRY_HEADER;
+            apply_locked(type, std::string_view(&hint[pos], key_size), value_size, seg.id, offset);
+            pos += key_size;
+        }
+        return true;
+    }
+
+    // Replays a segment with no usable hint, dropping a partial or corrupt
+    // record a crash left at its end and everything after it. A whole
+    // record over the size limits stops startup instead: cutting it off
+    // would silently drop the acknowledged writes that follow it.
+    void scan_segment(Segment& seg) {
+        uint64_t size = seg.size;
+        LogRecord record;
+        uint64_t valid_end;
+        if (seg.map.cover(seg.fd, size)) {
+            // Decode straight out of the page cache, no copies
+            std::string_view log = seg.map.view(0, size);
+            uint64_t pos = LogRecord::FILE_HEADER_SIZE;
+            while (size_t n = LogRecord::decode(log.data() + pos, log.size() - pos, record)) {
+                apply_locked(record.type, record.key, static_cast<uint32_t>(record.value.size()), seg.id, pos);
+                pos += n;
+            }
+            valid_end = pos;
+        } else {
+            LogReader reader(seg.fd, LogRecord::FILE_HEADER_SIZE, size);
+            while (reader.next(record)) {
+                apply_locked(record.type, record.key, static_cast<uint32_t>(record.value.size()), seg.id,
+                             reader.record_offset());
+            }
+            valid_end = reader.valid_end();
+        }
+        if (valid_end < size && LogRecord::oversized_at(seg.fd, valid_end, size)) {
+            throw std::runtime_error("LogStorage: " + segment_path(seg.id, ".data").string() +
+                                     " holds a record over the size limits at offset " +
+                                     std::to_string(valid_end) + "; not truncating it");
+        }
+        if (valid_end < size) {
+            std::cerr << "LogStorage: truncating " << (size - valid_end) << " trailing bytes of "
+                      << segment_path(seg.id, ".data") << std::endl;
+            if (ftruncate(seg.fd, static_cast<off_t>(valid_end)) < 0) {
+                std::cerr << "LogStorage: failed to truncate segment" << std::endl;
+            }
+            seg.size = valid_end;
+        }
+    }
+
+    // Rewrites a segment from before checksums in the current format, up to
+    // a torn tail if it has one. Its hint goes first: a crash midway leaves
+    // either the old file, upgraded again on the next start, or the new one,
+    // which is scanned since it has no hint.
+    void upgrade_segment(Segment& seg) {
+        std::filesystem::path path = segment_path(seg.id, ".data");
+        std::filesystem::remove(segment_path(seg.id, ".hint"));
+        std::string tmp = path.string() + ".tmp";
+        int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("LogStorage: failed to create " + tmp);
+        }
+        std::string chunk;
+        LogRecord::encode_file_header(chunk);
+        uint64_t written = 0;
+        bool ok = true;
+        LogReader reader(seg.fd, 0, seg.size, LogRecord::Format::V1);
+        LogRecord record;
+        while (ok && reader.next(record)) {
+            LogRecord::encode(chunk, record.type, record.key, record.value);
+            if (chunk.size() >= MERGE_WRITE_CHUNK) {
+                ok = write_fully(fd, chunk.data(), chunk.size(), written);
+                written += chunk.size();
+                chunk.clear();
+            }
+        }
+        ok = ok && write_fully(fd, chunk.data(), chunk.size(), written) && sync_fd(fd) &&
+             rename(tmp.c_str(), path.c_str()) == 0;
+        if (!ok) {
+            close(fd);
+            unlink(tmp.c_str());
+            throw std::runtime_error("LogStorage: failed to upgrade " + path.string());
+        }
+        sync_directory(dir_);
+        close(seg.fd);
+        seg.fd = fd;
+        seg.size = written + chunk.size();
+    }
+
+    // Finishes a merge whose MERGE file was written before a crash: moves
+    // the outputs into place and deletes the inputs they replaced
+    void finish_interrupted_merge() {
+        std::filesystem::path marker = dir_ / "MERGE";
+        std::ifstream file(marker);
+        if (!file.is_open()) return;
+        std::string line;
+        std::vector<uint32_t> inputs;
+        std::vector<uint32_t> outputs;
+        if (!std::getline(file, line) || line != MERGE_HEADER) {
+            std::cerr << "LogStorage: ignoring unreadable " << marker << std::endl;
+            std::filesystem::remove(marker);
+            return;
+        }
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string kind;
+            uint32_t id;
+            fields >> kind;
+            while (fields >> id) {
+                (kind == "outputs" ? outputs : inputs).push_back(id);
+            }
+        }
+        file.close();
+        for (uint32_t id : outputs) {
+            for (const char* extension : {".data", ".hint"}) {
+                std::filesystem::path merged = segment_path(id, extension).string() + ".merge";
+                if (std::filesystem::exists(merged)) {
+                    std::filesystem::rename(merged, segment_path(id, extension));
+                }
+            }
+        }
+        for (uint32_t id : inputs) {
+            if (std::find(outputs.begin(), outputs.end(), id) == outputs.end()) {
+                std::filesystem::remove(segment_path(id, ".data"));
+                std::filesystem::remove(segment_path(id, ".hint"));
+            }
+        }
+        sync_directory(dir_);
+        std::filesystem::remove(marker);
+    }
+
+    void recover() {
+        finish_interrupted_merge();
+
+        std::vector<uint32_t> ids;
+        bool have_hint_for_last = false;
+        for (const auto& entry : std::filesystem::directory_iterator(dir_)) {
+            std::string name = entry.path().filename().string();
+            uint32_t id;
+            if (parse_segment_name(name, ".data", id)) {
+                ids.push_back(id);
+            } else if (entry.path().extension() == ".merge" || entry.path().extension() == ".tmp" ||
+                       name == "data.log.compact") {
+                // Left by a merge that never committed or a hint never renamed
+                std::filesystem::remove(entry.path());
+            }
+        }
+        std::filesystem::path legacy_log = dir_ / "data.log";
+        bool fresh = ids.empty() && !std::filesystem::exists(legacy_log);
+        if (ids.empty() && std::filesystem::exists(legacy_log)) {
+            // The single-file log holds Format::V1 records: it becomes segment 1,
+            // upgraded below like any segment from before checksums
+            std::filesystem::rename(legacy_log, segment_path(1, ".data"));
+            sync_directory(dir_);
+            ids.push_back(1);
+        }
+        std::sort(ids.begin(), ids.end());
+
+        std::vector<std::shared_ptr<Segment>> scanned;
+        size_t upgraded = 0;
+        for (uint32_t id : ids) {
+            std::filesystem::path path = segment_path(id, ".data");
+            int fd = open(path.c_str(), O_RDWR);
+            if (fd < 0) {
+                throw std::runtime_error("LogStorage: failed to open " + path.string());
+            }
+            auto seg = std::make_shared<Segment>(id, fd);
+            struct stat st;
+            if (fstat(fd, &st) < 0) {
+                throw std::runtime_error("LogStorage: failed to stat " + path.string());
+            }
+            seg->size = static_cast<uint64_t>(st.st_size);
+            LogRecord::Format format;
+            if (!read_log_format(fd, seg->size, format)) {
+                throw std::runtime_error("LogStorage: " + path.string() + " is not in a format this build reads");
+            }
+            if (format == LogRecord::Format::V1) {
+                upgrade_segment(*seg);
+                upgraded++;
+            } else if (seg->size < LogRecord::FILE_HEADER_SIZE) {
+                // Created just before a crash: give it its header back
+                std::string header;
+                LogRecord::encode_file_header(header);
+                if (ftruncate(fd, 0) < 0 || !write_fully(fd, header.data(), header.size(), 0)) {
+                    throw std::runtime_error("LogStorage: failed to repair " + path.string());
+                }
+                seg->size = header.size();
+            }
+            segments_.emplace(id, seg);
+            active_ = seg;  // So segment_locked() resolves every id seen so far
+            have_hint_for_last = load_hint(*seg);
+            if (!have_hint_for_last) {
+                std::filesystem::remove(segment_path(id, ".hint"));
+                scan_segment(*seg);
+                scanned.push_back(seg);
+            }
+            next_segment_ = id + 1;
+        }
+        if (upgraded > 0) {
+            std::cerr << "LogStorage: rewrote " << upgraded << " segments from before checksums" << std::endl;
+        }
+
+        // Keep appending to the newest segment unless it is full or is a
+        // merge output, whose hint would go stale
+        if (!active_ || have_hint_for_last || active_->size >= segment_bytes_) {
+            std::shared_ptr<Segment> seg = create_segment(next_segment_);
+            if (!seg) {
+                throw std::runtime_error("LogStorage: failed to create a segment in " + dir_.string());
+            }
+            next_segment_++;
+            sync_directory(dir_);
+            segments_.emplace(seg->id, seg);
+            active_ = seg;
+        }
+        // Sealed segments that had to be scanned get a hint for next time
+        for (const auto& seg : scanned) {
+            if (seg != active_) unhinted_.push_back(seg);
+        }
+        recount_sealed_locked();
+        if (fresh) {
+            import_legacy_text(dir_ / "data.txt");
+        }
+    }
+
+    // One-time migration from the old key=value text file
+    void import_legacy_text(const std::filesystem::path& legacy) {
+        std::ifstream file(legacy);
+        if (!file.is_open()) return;
+
+        std::string line;
+        std::string encoded;
+        while (std::getline(file, line)) {
+            size_t pos = line.find('=');
+            if (pos != std::string::npos) {
+                std::string_view key(line.data(), pos);
+                std::string_view value(line.data() + pos + 1, line.size() - pos - 1);
+                encoded.clear();
+                LogRecord::encode(encoded, LogRecord::Type::Put, key, value);
+                uint64_t offset;
+                if (!append_locked(encoded, offset)) return;
+                apply_locked(LogRecord::Type::Put, key, static_cast<uint32_t>(value.size()), active_->id, offset);
+            }
+        }
+        file.close();
+        std::filesystem::rename(legacy, legacy.string() + ".imported");
+    }
+
+    bool merge_due_locked() const {
+        return sealed_bytes_ >= MERGE_MIN_BYTES &&
+               static_cast<double>(sealed_bytes_ - sealed_live_bytes_) > MERGE_GARBAGE_RATIO * sealed_bytes_;
+    }
+
+    void maybe_request_merge_locked() {
+        if (!merge_requested_ && merge_due_locked()) {
+            merge_requested_ = true;
+            work_cv_.notify_one();
+        }
+    }
+
+    // Writes the hint of a segment that was just sealed. Runs on the worker,
+    // so no merge can replace the segment meanwhile; clear() can, which the
+    // check before the rename catches.
+    void write_hint(const std::shared_ptr<Segment>& seg) {
+        std::string hint;
+        uint64_t entries = 0;
+        LogReader reader(seg->fd, LogRecord::FILE_HEADER_SIZE, seg->size);
+        LogRecord record;
+        while (reader.next(record)) {
+            append_hint_entry(hint, record.type, record.key, static_cast<uint32_t>(record.value.size()),
+                              reader.record_offset());
+            entries++;
+        }
+        if (reader.valid_end() != seg->size) return;  // Unreadable; restarts keep scanning it
+
+        std::string tmp = segment_path(seg->id, ".hint").string() + ".tmp";
+        bool ok = write_hint_file(tmp, hint, entries);
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = segments_.find(seg->id);
+        if (!ok || it == segments_.end() || it->second != seg ||
+            rename(tmp.c_str(), segment_path(seg->id, ".hint").c_str()) < 0) {
+            unlink(tmp.c_str());
+        }
+    }
+
+    void background_worker() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            work_cv_.wait(lock, [this] { return stopping_ || merge_requested_ || !unhinted_.empty(); });
+            if (stopping_) break;
+            if (!unhinted_.empty()) {
+                std::shared_ptr<Segment> seg = std::move(unhinted_.back());
+                unhinted_.pop_back();
+                lock.unlock();
+                write_hint(seg);
+                seg.reset();  // Its last reference may be the only thing keeping the fd open
+                lock.lock();
+                continue;
+            }
+            lock.unlock();
+            bool ok = merge();
+            lock.lock();
+            if (!ok) {
+                // Don't spin on a full or failing disk
+                work_cv_.wait_for(lock, std::chrono::seconds(1), [this] { return stopping_; });
+            }
+            merge_requested_ = false;
+            // Writes that landed during the merge may already warrant another pass
+            maybe_request_merge_locked();
+        }
+    }
+
+    bool write_merge_marker(const std::vector<std::shared_ptr<Segment>>& inputs,
+                            const std::vector<MergeOutput>& outputs) {
+        std::string text = std::string(MERGE_HEADER) + "\ninputs";
+        for (const auto& seg : inputs) text += " " + std::to_string(seg->id);
+        text += "\noutputs";
+        for (const auto& out : outputs) text += " " + std::to_string(out.id);
+        text += "\n";
+
+        std::filesystem::path tmp = dir_ / "MERGE.tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = write_fully(fd, text.data(), text.size(), 0) && sync_fd(fd);
+        close(fd);
+        if (!ok || rename(tmp.c_str(), (dir_ / "MERGE").c_str()) < 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        // Committed: from here on the outputs must not be thrown away
+        sync_directory(dir_);
+        return true;
+    }
+
+    // Rewrites the live records of every sealed segment, reading each input
+    // front to back from a snapshot of the keydir taken without holding the
+    // lock. Records overwritten meanwhile are left where they are in the
+    // outputs and simply not referenced.
+    bool merge() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!merge_due_locked()) return true;
+        std::vector<std::shared_ptr<Segment>> inputs;
+        for (const auto& [id, seg] : segments_) {
+            if (seg != active_) inputs.push_back(seg);
+        }
+        std::vector<std::pair<std::string, Location>> snapshot;
+        for (const auto& [key, loc] : index_) {
+            if (loc.segment != active_->id) snapshot.emplace_back(key, loc);
+        }
+        uint64_t generation = generation_;
+        lock.unlock();
+
+        std::sort(snapshot.begin(), snapshot.end(), [](const auto& a, const auto& b) {
+            return a.second.segment != b.second.segment ? a.second.segment < b.second.segment
+                                                        : a.second.offset < b.second.offset;
+        });
+
+        // Outputs reuse the inputs' numbers in order, so there are never more
+        // of them than inputs; the last one takes whatever does not fit
+        std::vector<MergeOutput> outputs;
+        std::vector<Location> moved;
+        moved.reserve(snapshot.size());
+        auto abandon = [&]() {
+            for (const MergeOutput& out : outputs) {
+                close(out.fd);
+                unlink((segment_path(out.id, ".data").string() + ".merge").c_str());
+                unlink((segment_path(out.id, ".hint").string() + ".merge").c_str());
+            }
+            return false;
+        };
+        std::string chunk;
+        auto flush = [&]() {
+            MergeOutput& out = outputs.back();
+            if (!write_fully(out.fd, chunk.data(), chunk.size(), out.size)) return false;
+            out.size += chunk.size();
+            chunk.clear();
+            return true;
+        };
+
+        size_t input = 0;
+        for (const auto& [key, loc] : snapshot) {
+            if (outputs.empty() ||
+                (outputs.back().size + chunk.size() >= segment_bytes_ && outputs.size() < inputs.size())) {
+                if (!outputs.empty() && !flush()) return abandon();
+                uint32_t id = inputs[outputs.size()]->id;
+                std::string path = segment_path(id, ".data").string() + ".merge";
+                int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) {
+                    std::cerr << "LogStorage: failed to create " << path << std::endl;
+                    return abandon();
+                }
+                outputs.emplace_back(id, fd);
+                LogRecord::encode_file_header(chunk);
+            }
+            while (inputs[input]->id != loc.segment) input++;
+
+            MergeOutput& out = outputs.back();
+            size_t record_size = LogRecord::encoded_size(key.size(), loc.value_size);
+            size_t at = chunk.size();
+            chunk.resize(at + record_size);
+            if (!read_fully(inputs[input]->fd, &chunk[at], record_size, loc.offset)) {
+                std::cerr << "LogStorage: failed to read segment " << loc.segment << std::endl;
+                return abandon();
+            }
+            uint64_t offset = out.size + at;
+            moved.push_back(Location{offset, loc.value_size, out.id});
+
+            append_hint_entry(out.hint, LogRecord::Type::Put, key, loc.value_size, offset);
+            out.hint_entries++;
+
+            if (chunk.size() >= MERGE_WRITE_CHUNK && !flush()) return abandon();
+        }
+        if (!outputs.empty() && !flush()) return abandon();
+
+        for (MergeOutput& out : outputs) {
+            std::string path = segment_path(out.id, ".hint").string() + ".merge";
+            bool ok = write_hint_file(path, out.hint, out.hint_entries);
+            std::string().swap(out.hint);
+            if (!ok || !sync_fd(out.fd)) {
+                std::cerr << "LogStorage: failed to write merge output " << out.id << std::endl;
+                return abandon();
+            }
+        }
+
+        lock.lock();
+        if (generation != generation_) {
+            lock.unlock();
+            abandon();  // clear() emptied the store meanwhile
+            return true;
+        }
+        // From here on a crash finishes the merge on restart
+        if (!write_merge_marker(inputs, outputs)) {
+            std::cerr << "LogStorage: failed to write " << (dir_ / "MERGE") << std::endl;
+            lock.unlock();
+            return abandon();
+        }
+
+        for (const auto& seg : inputs) {
+            segments_.erase(seg->id);
+        }
+        for (const MergeOutput& out : outputs) {
+            auto seg = std::make_shared<Segment>(out.id, out.fd);
+            seg->size = out.size;
+            segments_.emplace(out.id, seg);
+        }
+        // Point the keydir at the copies of records nothing has overwritten since
+        for (size_t i = 0; i < snapshot.size(); i++) {
+            auto it = index_.find(snapshot[i].first);
+            if (it != index_.end() && it->second.segment == snapshot[i].second.segment &&
+                it->second.offset == snapshot[i].second.offset) {
+                it->second = moved[i];
+                segments_[moved[i].segment]->live_bytes +=
+                    LogRecord::encoded_size(snapshot[i].first.size(), moved[i].value_size);
+            }
+        }
+        std::error_code error;
+        int renamed = 0;
+        merge_install_step(renamed);
+        for (const MergeOutput& out : outputs) {
+            for (const char* extension : {".data", ".hint"}) {
+                std::filesystem::path path = segment_path(out.id, extension);
+                std::error_code ec;
+                std::filesystem::rename(path.string() + ".merge", path, ec);
+                if (ec) error = ec;
+                merge_install_step(++renamed);
+            }
+        }
+        for (const auto& seg : inputs) {
+            if (segments_.find(seg->id) == segments_.end()) {
+                std::error_code ec;
+                std::filesystem::remove(segment_path(seg->id, ".data"), ec);
+                std::filesystem::remove(segment_path(seg->id, ".hint"), ec);
+            }
+        }
+        recount_sealed_locked();
+        if (error) {
+            // Leave MERGE in place: the next restart retries the renames
+            std::cerr << "LogStorage: failed to install merge: " << error.message() << std::endl;
+            return false;
+        }
+        sync_directory(dir_);
+        unlink((dir_ / "MERGE").c_str());
+        return true;
+    }
+
+public:
+    // dir: where the segments live; empty for disk_storage/ next to the
+    // executable
+    explicit LogStorage(uint64_t segment_bytes = DEFAULT_SEGMENT_BYTES, const std::filesystem::path& dir = {})
+        : dir_(storage_directory(dir))
+        , segment_bytes_(std::max(segment_bytes, MIN_SEGMENT_BYTES)) {
+        recover();
+        worker_ = std::thread(&LogStorage::background_worker, this);
+    }
+
+    ~LogStorage() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_cv_.notify_one();
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+    }
+
+    bool get(std::string_view key, std::string& value) override {
+        if (!key_filter_.may_contain(key)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            return false;
+        }
+        const Location& loc = it->second;
+        Segment& seg = segment_locked(loc.segment);
+        size_t size = LogRecord::encoded_size(key.size(), loc.value_size);
+        std::string buffer;  // Only when the segment can't be mapped
+        std::string_view bytes;
+        if (seg.map.cover(seg.fd, seg.size)) {
+            bytes = seg.map.view(loc.offset, size);
+        } else {
+            buffer.resize(size);
+            if (!read_fully(seg.fd, buffer.data(), size, loc.offset)) {
+                return false;
+            }
+            bytes = buffer;
+        }
+        LogRecord record;
+        if (LogRecord::decode(bytes.data(), bytes.size(), record) != size || record.key != key) {
+            std::cerr << "LogStorage: corrupt record for key " << key << " in segment " << loc.segment
+                      << " at offset " << loc.offset << std::endl;
+            return false;
+        }
+        value.assign(record.value.data(), record.value.size());
+        return true;
+    }
+
+    bool put(std::string_view key, std::string_view value) override {
+        if (!LogRecord::fits(key.size(), value.size())) {
+            return false;
+        }
+        std::string encoded;
+        LogRecord::encode(encoded, LogRecord::Type::Put, key, value);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t offset;
+        if (!append_locked(encoded, offset)) {
+            return false;
+        }
+        apply_locked(LogRecord::Type::Put, key, static_cast<uint32_t>(value.size()), active_->id, offset);
+        maybe_request_merge_locked();
+        return true;
+    }
+
+    // Appends a batch of writes in order, one pwrite per ~1MB of records and
+    // a single lock hold for the whole batch. A batch with a key or value
+    // over the size limits is rejected whole.
+    bool write_batch(const std::vector<WriteOp>& ops) override {
+        for (const WriteOp& op : ops) {
+            if (!LogRecord::fits(op.key.size(), op.value.size())) {
+                return false;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t first = 0;
+        while (first < ops.size()) {
+            batch_buffer_.clear();
+            size_t last = first;
+            for (; last < ops.size() && batch_buffer_.size() < BATCH_WRITE_CHUNK; ++last) {
+                LogRecord::encode(batch_buffer_, ops[last].type, ops[last].key, ops[last].value);
+            }
+            uint64_t offset;
+            if (!append_locked(batch_buffer_, offset)) {
+                return false;
+            }
+            for (size_t i = first; i < last; ++i) {
+                apply_locked(ops[i].type, ops[i].key, static_cast<uint32_t>(ops[i].value.size()), active_->id,
+                             offset);
+                offset += LogRecord::encoded_size(ops[i].key.size(), ops[i].value.size());
+            }
+            first = last;
+        }
+        if (batch_buffer_.capacity() > 4 * BATCH_WRITE_CHUNK) {
+            std::string().swap(batch_buffer_);  // One huge value should not pin its buffer
+        }
+        maybe_request_merge_locked();
+        return true;
+    }
+
+    bool contains(std::string_view key) override {
+        if (!key_filter_.may_contain(key)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        return index_.find(key) != index_.end();
+    }
+
+    void remove(std::string_view key) override {
+        if (!LogRecord::fits(key.size(), 0)) {
+            return;
+        }
+        std::string encoded;
+        LogRecord::encode(encoded, LogRecord::Type::Delete, key, {});
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (index_.find(key) == index_.end()) {
+            return;
+        }
+        uint64_t offset;
+        if (!append_locked(encoded, offset)) {
+            return;
+        }
+        apply_locked(LogRecord::Type::Delete, key, 0, active_->id, offset);
+        maybe_request_merge_locked();
+    }
+
+    // Makes every record appended so far durable. Sealed segments were synced
+    // when they were rotated out. Works on a duplicate of the descriptor so
+    // the flush runs without the lock even if the segment rotates meanwhile.
+    bool sync() override {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!active_) return false;
+            fd = dup(active_->fd);
+        }
+        if (fd < 0) return false;
+        bool ok = sync_fd(fd);
+        close(fd);
+        return ok;
+    }
+
+    void clear() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        generation_++;
+        index_.clear();
+        key_filter_.clear();
+        unhinted_.clear();
+        // Nothing but the file header on disk: keep the segment as it is
+        if (active_ && active_->size == LogRecord::data_start(LogRecord::CURRENT_FORMAT) && segments_.size() == 1) {
+            return;
+        }
+        // A running merge still holds the sealed segments it reads
+        for (const auto& [id, seg] : segments_) {
+            unlink(segment_path(id, ".data").c_str());
+            unlink(segment_path(id, ".hint").c_str());
+        }
+        segments_.clear();
+        active_ = create_segment(next_segment_);
+        if (active_) {
+            next_segment_++;
+            segments_.emplace(active_->id, active_);
+        }
+        sync_directory(dir_);
+        recount_sealed_locked();
+    }
+
+protected:
+    // Called while a merge installs its outputs: once the MERGE file is
+    // written (renamed == 0), then after each output file is renamed into
+    // place. Lets tests stop the process at each point a crash can hit.
+    virtual void merge_install_step(int renamed) { (void)renamed; }
+};
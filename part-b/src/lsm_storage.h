@@ -0,0 +1,1073 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bloom_filter.h"
+#include "crc32c.h"
+#include "disk_storage.h"
+#include "log_record.h"
+
+// Log-structured merge tree (disk_storage/lsm/).
+//
+// Writes go to a write-ahead log (NNNNNN.wal) and a sorted in-memory
+// memtable. A full memtable is frozen and a background thread writes it out
+// as an immutable sorted table (NNNNNN.sst) in level 0, then deletes its log.
+// Level 0 tables may overlap; levels 1 and up each hold one sorted run split
+// into non-overlapping tables, and level N+1 may grow to ten times level N.
+// When level 0 has L0_COMPACTION_TRIGGER tables, or a deeper level outgrows
+// its limit, the same thread merges tables into the next level (leveled
+// compaction), so each byte is rewritten about ten times per level it
+// descends. MANIFEST names the live tables; it is replaced atomically after
+// every flush and compaction.
+//
+// Memory holds the memtables and, per table, one index entry per block and
+// a Bloom filter of its keys (about 10 bits each), so the dataset can be
+// many times larger than RAM. A GET checks the memtables, then each level 0
+// table newest first, then at most one table per deeper level, reading one
+// block from each table whose key range and filter admit the key; a key
+// that exists nowhere costs no disk reads about 99% of the time.
+class LsmStorage : public DiskStorage {
+public:
+    static constexpr size_t DEFAULT_MEMTABLE_BYTES = 4 * 1024 * 1024;
+
+    // Memtables are frozen at memtable_bytes; tables are cut at half that,
+    // and level 1 may hold 2.5 times that (10 MB by default). Files go in
+    // dir/lsm, with dir defaulting to disk_storage/ next to the executable.
+    explicit LsmStorage(size_t memtable_bytes = DEFAULT_MEMTABLE_BYTES, const std::filesystem::path& dir = {})
+        : memtable_bytes_(std::max<size_t>(memtable_bytes, MIN_MEMTABLE_BYTES))
+        , table_bytes_(memtable_bytes_ / 2)
+        , level1_bytes_(memtable_bytes_ * 5 / 2) {
+        dir_ = storage_directory(dir) / "lsm";
+        std::filesystem::create_directories(dir_);
+        recover();
+        worker_ = std::thread(&LsmStorage::background_worker, this);
+    }
+
+    ~LsmStorage() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_cv_.notify_one();
+        room_cv_.notify_all();
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+        // A frozen memtable not yet written out is replayed from its log
+        if (wal_fd_ >= 0) {
+            close(wal_fd_);
+        }
+    }
+
+    bool get(std::string_view key, std::string& value) override {
+        std::shared_ptr<const Memtable> imm;
+        std::shared_ptr<const Version> version;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Lookup found = mem_->get(key, value);
+            if (found != Lookup::Missing) {
+                return found == Lookup::Found;
+            }
+            imm = imm_;
+            version = version_;
+        }
+        if (imm) {
+            Lookup found = imm->get(key, value);
+            if (found != Lookup::Missing) {
+                return found == Lookup::Found;
+            }
+        }
+        uint64_t hash = BloomFilter::hash(key);
+        const auto& level0 = version->levels[0];
+        for (auto it = level0.rbegin(); it != level0.rend(); ++it) {
+            Lookup found = (*it)->get(key, hash, value);
+            if (found != Lookup::Missing) {
+                return found == Lookup::Found;
+            }
+        }
+        for (int level = 1; level < NUM_LEVELS; level++) {
+            const auto& tables = version->levels[level];
+            // The only table that can hold key: the first ending at or after it
+            auto it = std::lower_bound(tables.begin(), tables.end(), key,
+                [](const std::shared_ptr<Table>& t, std::string_view k) { return t->largest() < k; });
+            if (it == tables.end()) continue;
+            Lookup found = (*it)->get(key, hash, value);
+            if (found != Lookup::Missing) {
+                return found == Lookup::Found;
+            }
+        }
+        return false;
+    }
+
+    bool put(std::string_view key, std::string_view value) override {
+        return write_batch({WriteOp{LogRecord::Type::Put, std::string(key), std::string(value)}});
+    }
+
+    // Logs a batch in ~1MB appends, then applies it to the memtable. Blocks
+    // while the memtable is full and the previous one is still being written
+    // out, which holds back StorageEngine's queue and, through its backlog
+    // limit, the clients. A batch with a key or value over the size limits
+    // is rejected whole: replay would stop at such a record, and a table
+    // holding one could not be searched past it.
+    bool write_batch(const std::vector<WriteOp>& ops) override {
+        for (const WriteOp& op : ops) {
+            if (!LogRecord::fits(op.key.size(), op.value.size())) {
+                return false;
+            }
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t first = 0;
+        while (first < ops.size()) {
+            batch_buffer_.clear();
+            size_t last = first;
+            for (; last < ops.size() && batch_buffer_.size() < BATCH_WRITE_CHUNK; ++last) {
+                LogRecord::encode(batch_buffer_, ops[last].type, ops[last].key, ops[last].value);
+            }
+            if (wal_fd_ < 0 || !write_fully(wal_fd_, batch_buffer_.data(), batch_buffer_.size(), wal_size_)) {
+                return false;
+            }
+            wal_size_ += batch_buffer_.size();
+            for (size_t i = first; i < last; ++i) {
+                mem_->apply(ops[i].type, ops[i].key, ops[i].value);
+            }
+            first = last;
+        }
+        if (batch_buffer_.capacity() > 4 * BATCH_WRITE_CHUNK) {
+            std::string().swap(batch_buffer_);  // One huge value should not pin its buffer
+        }
+        return make_room_locked(lock);
+    }
+
+    bool contains(std::string_view key) override {
+        std::string value;
+        return get(key, value);
+    }
+
+    void remove(std::string_view key) override {
+        write_batch({WriteOp{LogRecord::Type::Delete, std::string(key), std::string()}});
+    }
+
+    // Syncs the current log; frozen logs are synced when frozen and tables
+    // when written
+    bool sync() override {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (wal_fd_ < 0) return false;
+            fd = dup(wal_fd_);
+        }
+        if (fd < 0) return false;
+        bool ok = sync_fd(fd);
+        close(fd);
+        return ok;
+    }
+
+    void clear() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Background work in progress notices and throws its output away
+        generation_++;
+        std::shared_ptr<const Version> old = version_;
+        version_ = std::make_shared<Version>();
+        if (imm_) {
+            std::filesystem::remove(file_path(imm_->wal_number, ".wal"));
+            imm_.reset();
+        }
+        mem_ = std::make_shared<Memtable>(mem_->wal_number);
+        if (wal_fd_ >= 0 && ftruncate(wal_fd_, LogRecord::FILE_HEADER_SIZE) < 0) {
+            std::cerr << "LsmStorage: failed to truncate log" << std::endl;
+        }
+        wal_size_ = LogRecord::FILE_HEADER_SIZE;
+        if (!write_manifest_locked(*version_)) {
+            std::cerr << "LsmStorage: failed to write manifest" << std::endl;
+        }
+        for (const auto& tables : old->levels) {
+            for (const auto& table : tables) {
+                std::filesystem::remove(file_path(table->number(), ".sst"));
+            }
+        }
+        room_cv_.notify_all();
+    }
+
+    // Bytes of tables per level, for tests and tuning
+    std::vector<uint64_t> level_bytes() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<uint64_t> sizes;
+        for (const auto& tables : version_->levels) {
+            sizes.push_back(total_bytes(tables));
+        }
+        return sizes;
+    }
+
+private:
+    static constexpr int NUM_LEVELS = 7;
+    static constexpr size_t L0_COMPACTION_TRIGGER = 4;
+    // Writers wait once compaction falls this far behind, so level sizes
+    // (and with them space and read amplification) stay bounded
+    static constexpr size_t L0_STOP_TRIGGER = 12;
+    static constexpr uint64_t LEVEL_STOP_FACTOR = 4;
+    static constexpr size_t MIN_MEMTABLE_BYTES = 64 * 1024;
+    // Bookkeeping charged per memtable entry on top of its key and value
+    static constexpr size_t MEMTABLE_ENTRY_OVERHEAD = 64;
+    static constexpr size_t BATCH_WRITE_CHUNK = 1 << 20;
+    static constexpr const char* MANIFEST_HEADER = "blinkdb-lsm 1";
+
+    enum class Lookup {
+        Found,
+        Deleted,  // A tombstone hides any older value
+        Missing
+    };
+
+    struct Memtable {
+        struct Entry {
+            LogRecord::Type type;
+            std::string value;
+        };
+
+        explicit Memtable(uint64_t wal) : wal_number(wal) {}
+
+        std::map<std::string, Entry, std::less<>> entries;
+        size_t bytes = 0;
+        uint64_t wal_number;  // Log holding exactly these entries
+
+        void apply(LogRecord::Type type, std::string_view key, std::string_view value) {
+            auto it = entries.find(key);
+            if (it == entries.end()) {
+                entries.emplace(std::string(key), Entry{type, std::string(value)});
+                bytes += key.size() + value.size() + MEMTABLE_ENTRY_OVERHEAD;
+            } else {
+                bytes = bytes - it->second.value.size() + value.size();
+                it->second.type = type;
+                it->second.value = value;
+            }
+        }
+
+        Lookup get(std::string_view key, std::string& value) const {
+            auto it = entries.find(key);
+            if (it == entries.end()) return Lookup::Missing;
+            if (it->second.type == LogRecord::Type::Delete) return Lookup::Deleted;
+            value.assign(it->second.value);
+            return Lookup::Found;
+        }
+    };
+
+    // Immutable sorted table (SSTable):
+    //
+    //   [data blocks][index][footer]
+    //
+    // Data blocks are runs of LogRecords in key order, cut once they pass
+    // BLOCK_SIZE, so a table's data section reads like a log. The index
+    // holds each block's first key, offset and size, then the table's last
+    // key, then a BloomFilter of every key in the table, tombstones
+    // included; it is the only part kept in memory. The footer locates it
+    // and checksums it:
+    //   [index_offset:u64][index_size:u64][entries:u64][index_crc:u32][0:u32][magic:u64]
+    // Each record carries its own checksum, checked when a lookup finds it
+    // and when compaction reads it.
+    class Table {
+    public:
+        static constexpr size_t BLOCK_SIZE = 4096;
+        static constexpr size_t FOOTER_SIZE = 40;
+        static constexpr uint64_t MAGIC = 0x3354535342444c42ULL;  // "BLDBSST3"
+        // Older tables hold Format::V1 records and a 32-byte footer with no
+        // index checksum: [index_offset][index_size][entries][magic]
+        static constexpr size_t OLD_FOOTER_SIZE = 32;
+        static constexpr uint64_t MAGIC_NO_CRC = 0x3254535342444c42ULL;     // "BLDBSST2"
+        static constexpr uint64_t MAGIC_NO_FILTER = 0x3154535342444c42ULL;  // "BLDBSST1", before filters too
+
+        // nullptr if the file is missing or not a complete table
+        static std::shared_ptr<Table> open(const std::filesystem::path& path, uint64_t number) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return nullptr;
+            auto table = std::shared_ptr<Table>(new Table(fd, number));
+            return table->load_index() ? table : nullptr;
+        }
+
+        ~Table() {
+            close(fd_);
+        }
+
+        Table(const Table&) = delete;
+        Table& operator=(const Table&) = delete;
+
+        uint64_t number() const { return number_; }
+        uint64_t file_size() const { return file_size_; }
+        uint64_t data_size() const { return data_size_; }
+        LogRecord::Format format() const { return format_; }
+        int fd() const { return fd_; }
+        const std::string& smallest() const { return blocks_.front().first_key; }
+        const std::string& largest() const { return largest_; }
+
+        bool overlaps(std::string_view lo, std::string_view hi) const {
+            return !(largest_ < lo || hi < smallest());
+        }
+
+        // hash: BloomFilter::hash(key)
+        Lookup get(std::string_view key, uint64_t hash, std::string& value) const {
+            if (key < smallest() || largest_ < key) return Lookup::Missing;
+            if (filter_ && !filter_->may_contain_hash(hash)) return Lookup::Missing;
+            // The last block starting at or before key
+            auto it = std::upper_bound(blocks_.begin(), blocks_.end(), key,
+                [](std::string_view k, const Block& b) { return k < b.first_key; });
+            --it;
+            thread_local std::string buffer;
+            buffer.resize(it->size);
+            if (!read_fully(fd_, buffer.data(), it->size, it->offset)) {
+                return Lookup::Missing;
+            }
+            const char* p = buffer.data();
+            size_t left = buffer.size();
+            LogRecord record;
+            while (size_t n = LogRecord::parse(p, left, record, format_)) {
+                if (record.key == key) {
+                    if (format_ != LogRecord::Format::V1 && !LogRecord::checksum_ok(p, n)) {
+                        std::cerr << "LsmStorage: corrupt record in table " << number_ << std::endl;
+                        return Lookup::Missing;
+                    }
+                    if (record.type == LogRecord::Type::Delete) return Lookup::Deleted;
+                    value.assign(record.value);
+                    return Lookup::Found;
+                }
+                if (key < record.key) break;
+                p += n;
+                left -= n;
+            }
+            return Lookup::Missing;
+        }
+
+    private:
+        struct Block {
+            std::string first_key;
+            uint64_t offset;
+            uint32_t size;
+        };
+
+        Table(int fd, uint64_t number) : fd_(fd), number_(number) {}
+
+        bool load_index() {
+            struct stat st;
+            if (fstat(fd_, &st) < 0 || static_cast<uint64_t>(st.st_size) < OLD_FOOTER_SIZE) return false;
+            file_size_ = static_cast<uint64_t>(st.st_size);
+            // The last FOOTER_SIZE bytes, right-aligned if the file is smaller
+            char footer[FOOTER_SIZE];
+            size_t footer_size = std::min<uint64_t>(FOOTER_SIZE, file_size_);
+            if (!read_fully(fd_, footer + FOOTER_SIZE - footer_size, footer_size, file_size_ - footer_size)) {
+                return false;
+            }
+            uint64_t magic = LogRecord::get_u64(footer + FOOTER_SIZE - 8);
+            if (magic == MAGIC && footer_size == FOOTER_SIZE) {
+                format_ = LogRecord::CURRENT_FORMAT;
+            } else if (magic == MAGIC_NO_CRC || magic == MAGIC_NO_FILTER) {
+                format_ = LogRecord::Format::V1;
+                footer_size = OLD_FOOTER_SIZE;
+            } else {
+                return false;
+            }
+            const char* fields = footer + FOOTER_SIZE - footer_size;
+            uint64_t index_offset = LogRecord::get_u64(fields);
+            uint64_t index_size = LogRecord::get_u64(fields + 8);
+            if (index_offset + index_size + footer_size != file_size_) {
+                return false;
+            }
+            std::string index(index_size, '\0');
+            if (!read_fully(fd_, index.data(), index.size(), index_offset)) return false;
+            if (magic == MAGIC && LogRecord::get_u32(fields + 24) != Crc32c::value(index.data(), index.size())) {
+                return false;
+            }
+
+            const char* p = index.data();
+            const char* end = p + index.size();
+            auto take_u32 = [&](uint32_t& v) {
+                if (end - p < 4) return false;
+                v = LogRecord::get_u32(p);
+                p += 4;
+                return true;
+            };
+            auto take_key = [&](std::string& key) {
+                uint32_t n;
+                if (!take_u32(n) || static_cast<size_t>(end - p) < n) return false;
+                key.assign(p, n);
+                p += n;
+                return true;
+            };
+            uint32_t count;
+            if (!take_u32(count) || count == 0) return false;
+            blocks_.resize(count);
+            for (Block& block : blocks_) {
+                if (!take_key(block.first_key) || end - p < 12) return false;
+                block.offset = LogRecord::get_u64(p);
+                block.size = LogRecord::get_u32(p + 8);
+                p += 12;
+                if (block.offset + block.size > index_offset) return false;
+            }
+            data_size_ = index_offset;
+            if (!take_key(largest_)) return false;
+            if (magic == MAGIC_NO_FILTER) return p == end;
+            filter_ = BloomFilter::decode(std::string_view(p, end - p));
+            return filter_ != nullptr;
+        }
+
+        int fd_;
+        uint64_t number_;
+        uint64_t file_size_ = 0;
+        uint64_t data_size_ = 0;
+        std::vector<Block> blocks_;
+        std::string largest_;
+        std::unique_ptr<BloomFilter> filter_;
+        LogRecord::Format format_ = LogRecord::CURRENT_FORMAT;  // Of the records in the data blocks
+    };
+
+    // Writes a table from records added in key order
+    class TableBuilder {
+    public:
+        explicit TableBuilder(const std::filesystem::path& path) : path_(path) {
+            fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            ok_ = fd_ >= 0;
+        }
+
+        ~TableBuilder() {
+            if (fd_ >= 0) {
+                abandon();
+            }
+        }
+
+        TableBuilder(const TableBuilder&) = delete;
+        TableBuilder& operator=(const TableBuilder&) = delete;
+
+        uint64_t size() const { return written_ + buffer_.size(); }
+        uint64_t entries() const { return entries_; }
+
+        void add(LogRecord::Type type, std::string_view key, std::string_view value) {
+            if (size() - block_start_ == 0) {
+                LogRecord::put_u32(scratch_, static_cast<uint32_t>(key.size()));
+                index_.append(scratch_, 4);
+                index_.append(key.data(), key.size());
+                block_count_++;
+            }
+            LogRecord::encode(buffer_, type, key, value);
+            hashes_.push_back(BloomFilter::hash(key));
+            last_key_.assign(key.data(), key.size());
+            entries_++;
+            if (size() - block_start_ >= Table::BLOCK_SIZE) {
+                end_block();
+            }
+            if (buffer_.size() >= WRITE_CHUNK) {
+                flush_buffer();
+            }
+        }
+
+        // Writes the index and footer and syncs the file. Needs at least
+        // one record.
+        bool finish() {
+            if (size() > block_start_) {
+                end_block();
+            }
+            uint64_t index_offset = size();
+            std::string index;
+            LogRecord::put_u32(scratch_, block_count_);
+            index.append(scratch_, 4);
+            index += index_;
+            LogRecord::put_u32(scratch_, static_cast<uint32_t>(last_key_.size()));
+            index.append(scratch_, 4);
+            index += last_key_;
+            BloomFilter filter(hashes_.size());
+            for (uint64_t hash : hashes_) {
+                filter.add_hash(hash);
+            }
+            filter.encode(index);
+            buffer_ += index;
+
+            char footer[Table::FOOTER_SIZE];
+            LogRecord::put_u64(footer, index_offset);
+            LogRecord::put_u64(footer + 8, index.size());
+            LogRecord::put_u64(footer + 16, entries_);
+            LogRecord::put_u32(footer + 24, Crc32c::value(index.data(), index.size()));
+            LogRecord::put_u32(footer + 28, 0);
+            LogRecord::put_u64(footer + 32, Table::MAGIC);
+            buffer_.append(footer, sizeof(footer));
+            flush_buffer();
+            ok_ = ok_ && entries_ > 0 && fsync(fd_) == 0;
+            close(fd_);
+            fd_ = -1;
+            if (!ok_) {
+                std::filesystem::remove(path_);
+            }
+            return ok_;
+        }
+
+        void abandon() {
+            close(fd_);
+            fd_ = -1;
+            std::filesystem::remove(path_);
+        }
+
+    private:
+        static constexpr size_t WRITE_CHUNK = 1 << 20;
+
+        void end_block() {
+            uint64_t end = size();
+            char entry[12];
+            LogRecord::put_u64(entry, block_start_);
+            LogRecord::put_u32(entry + 8, static_cast<uint32_t>(end - block_start_));
+            index_.append(entry, sizeof(entry));
+            block_start_ = end;
+        }
+
+        void flush_buffer() {
+            ok_ = ok_ && write_fully(fd_, buffer_.data(), buffer_.size(), written_);
+            written_ += buffer_.size();
+            buffer_.clear();
+        }
+
+        std::filesystem::path path_;
+        int fd_;
+        bool ok_;
+        std::string buffer_;     // Encoded bytes not yet written
+        uint64_t written_ = 0;   // Bytes written before buffer_
+        uint64_t block_start_ = 0;
+        uint32_t block_count_ = 0;
+        uint64_t entries_ = 0;
+        std::string index_;      // Index entries of the finished blocks
+        std::vector<uint64_t> hashes_;  // Of every key added, for the filter
+        std::string last_key_;
+        char scratch_[4];
+    };
+
+    // The tables making up the tree at one point in time. Never modified
+    // once published; readers hold on to the one they started with.
+    struct Version {
+        // Level 0 oldest first; deeper levels in key order
+        std::vector<std::shared_ptr<Table>> levels[NUM_LEVELS];
+    };
+
+    // Records of one or more tables in key order, fed to a merge
+    class TableScanner {
+    public:
+        explicit TableScanner(std::vector<std::shared_ptr<Table>> tables) : tables_(std::move(tables)) {
+            advance();
+        }
+
+        bool valid() const { return valid_; }
+        bool failed() const { return failed_; }
+        // Views stay valid until the next advance()
+        const LogRecord& record() const { return record_; }
+
+        void advance() {
+            while (true) {
+                if (reader_ && reader_->next(record_)) {
+                    valid_ = true;
+                    return;
+                }
+                if (reader_ && reader_->valid_end() != tables_[next_ - 1]->data_size()) {
+                    failed_ = true;  // Damaged table: don't merge what is left of it
+                }
+                if (failed_ || next_ == tables_.size()) {
+                    valid_ = false;
+                    return;
+                }
+                const Table& table = *tables_[next_++];
+                reader_ = std::make_unique<LogReader>(table.fd(), 0, table.data_size(), table.format());
+            }
+        }
+
+    private:
+        std::vector<std::shared_ptr<Table>> tables_;
+        size_t next_ = 0;
+        std::unique_ptr<LogReader> reader_;
+        LogRecord record_{};
+        bool valid_ = false;
+        bool failed_ = false;
+    };
+
+    std::filesystem::path dir_;
+    size_t memtable_bytes_;
+    size_t table_bytes_;
+    uint64_t level1_bytes_;
+
+    std::mutex mutex_;
+    std::shared_ptr<Memtable> mem_;
+    std::shared_ptr<const Memtable> imm_;  // Frozen, being written to level 0
+    std::shared_ptr<const Version> version_;
+    int wal_fd_ = -1;                      // Log of mem_
+    uint64_t wal_size_ = 0;
+    uint64_t next_file_ = 1;
+    uint64_t generation_ = 0;              // Bumped by clear()
+    std::string batch_buffer_;             // Encoding space for write_batch()
+    // Where the next compaction of each level starts, so every key range
+    // takes its turn
+    std::string compact_pointer_[NUM_LEVELS];
+
+    std::thread worker_;
+    std::condition_variable work_cv_;     // Work for background_worker()
+    std::condition_variable room_cv_;     // imm_ written out or a compaction done
+    bool stopping_ = false;
+
+    std::filesystem::path file_path(uint64_t number, const char* extension) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%06llu%s", static_cast<unsigned long long>(number), extension);
+        return dir_ / name;
+    }
+
+    static uint64_t total_bytes(const std::vector<std::shared_ptr<Table>>& tables) {
+        uint64_t total = 0;
+        for (const auto& table : tables) {
+            total += table->file_size();
+        }
+        return total;
+    }
+
+    uint64_t max_bytes_for_level(int level) const {
+        uint64_t bytes = level1_bytes_;
+        for (int i = 1; i < level; i++) {
+            bytes *= 10;
+        }
+        return bytes;
+    }
+
+    // MANIFEST: a header line, then "next_file N", "log N" (the oldest log
+    // still needed) and one "table LEVEL NUMBER" line per live table.
+    // Written to a temporary file and renamed over the old one.
+    bool write_manifest_locked(const Version& version) {
+        std::string text = MANIFEST_HEADER;
+        text += "\nnext_file " + std::to_string(next_file_);
+        text += "\nlog " + std::to_string(imm_ ? imm_->wal_number : mem_->wal_number) + "\n";
+        for (int level = 0; level < NUM_LEVELS; level++) {
+            for (const auto& table : version.levels[level]) {
+                text += "table " + std::to_string(level) + " " + std::to_string(table->number()) + "\n";
+            }
+        }
+        std::filesystem::path tmp = dir_ / "MANIFEST.tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = write_fully(fd, text.data(), text.size(), 0) && fsync(fd) == 0;
+        close(fd);
+        ok = ok && rename(tmp.c_str(), (dir_ / "MANIFEST").c_str()) == 0;
+        return ok && sync_directory(dir_);
+    }
+
+    // Loads the tables MANIFEST names, replays the logs of memtables that
+    // were never written out and writes them to level 0, and deletes files
+    // a crash left behind
+    void recover() {
+        auto version = std::make_shared<Version>();
+        uint64_t min_log = 0;
+        std::ifstream manifest(dir_ / "MANIFEST");
+        std::string line;
+        bool have_manifest = manifest.is_open() && std::getline(manifest, line) && line == MANIFEST_HEADER;
+        if (!have_manifest && manifest.is_open()) {
+            std::cerr << "LsmStorage: unrecognised " << (dir_ / "MANIFEST") << ", ignoring it" << std::endl;
+        }
+        if (have_manifest) {
+            while (std::getline(manifest, line)) {
+                char kind[16];
+                unsigned long long a = 0, b = 0;
+                int fields = sscanf(line.c_str(), "%15s %llu %llu", kind, &a, &b);
+                if (fields == 2 && strcmp(kind, "next_file") == 0) {
+                    next_file_ = a;
+                } else if (fields == 2 && strcmp(kind, "log") == 0) {
+                    min_log = a;
+                } else if (fields == 3 && strcmp(kind, "table") == 0 && a < NUM_LEVELS) {
+                    auto table = Table::open(file_path(b, ".sst"), b);
+                    if (table) {
+                        version->levels[a].push_back(table);
+                    } else {
+                        std::cerr << "LsmStorage: table " << file_path(b, ".sst")
+                                  << " is missing or damaged, skipping it" << std::endl;
+                    }
+                }
+            }
+        }
+        std::sort(version->levels[0].begin(), version->levels[0].end(),
+            [](const auto& x, const auto& y) { return x->number() < y->number(); });
+        for (int level = 1; level < NUM_LEVELS; level++) {
+            sort_level(version->levels[level]);
+        }
+
+        // Sort out the files on disk: logs to replay, leftovers to delete
+        std::vector<uint64_t> live_tables;
+        for (const auto& tables : version->levels) {
+            for (const auto& table : tables) {
+                live_tables.push_back(table->number());
+            }
+        }
+        std::vector<uint64_t> logs;
+        for (const auto& entry : std::filesystem::directory_iterator(dir_)) {
+            std::string ext = entry.path().extension().string();
+            uint64_t number = std::strtoull(entry.path().stem().c_str(), nullptr, 10);
+            next_file_ = std::max(next_file_, number + 1);
+            // Without a manifest nothing is known to be stale but temporaries
+            bool stale = ext == ".tmp" ||
+                         (have_manifest && ext == ".sst" &&
+                          std::find(live_tables.begin(), live_tables.end(), number) == live_tables.end()) ||
+                         (ext == ".wal" && number < min_log);
+            if (stale) {
+                std::filesystem::remove(entry.path());
+            } else if (ext == ".wal") {
+                logs.push_back(number);
+            }
+        }
+        std::sort(logs.begin(), logs.end());
+
+        mem_ = std::make_shared<Memtable>(0);
+        for (uint64_t number : logs) {
+            replay_log(file_path(number, ".wal"));
+        }
+        std::shared_ptr<Memtable> replayed = mem_;
+        bool recovered = true;
+        if (!replayed->entries.empty()) {
+            uint64_t number = next_file_++;
+            if (auto table = write_table(*replayed, number)) {
+                version->levels[0].push_back(table);
+            } else {
+                recovered = false;
+            }
+        }
+
+        mem_ = std::make_shared<Memtable>(next_file_++);
+        wal_fd_ = create_log(mem_->wal_number);
+        wal_size_ = LogRecord::FILE_HEADER_SIZE;
+        version_ = version;
+        if (!recovered) {
+            // Keep the old manifest and logs so the logs are replayed again
+            // next time; until then the replayed writes are served from here
+            std::cerr << "LsmStorage: failed to write the recovered memtable" << std::endl;
+            replayed->wal_number = logs.front();
+            imm_ = replayed;
+            return;
+        }
+        if (write_manifest_locked(*version_)) {
+            for (uint64_t number : logs) {
+                std::filesystem::remove(file_path(number, ".wal"));
+            }
+        } else {
+            std::cerr << "LsmStorage: failed to write manifest" << std::endl;
+        }
+    }
+
+    // Starts an empty log; -1 on failure
+    int create_log(uint64_t number) {
+        std::filesystem::path path = file_path(number, ".wal");
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        std::string header;
+        LogRecord::encode_file_header(header);
+        if (fd < 0 || !write_fully(fd, header.data(), header.size(), 0)) {
+            std::cerr << "LsmStorage: failed to open " << path << std::endl;
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Applies a log's records to mem_, up to a torn or corrupt tail if there
+    // is one. Logs from before checksums are still read. One this build
+    // can't read, or one holding a whole record over the size limits,
+    // stops startup rather than being deleted with writes unreplayed.
+    void replay_log(const std::filesystem::path& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        LogRecord::Format format;
+        if (fstat(fd, &st) == 0) {
+            uint64_t size = static_cast<uint64_t>(st.st_size);
+            if (!read_log_format(fd, size, format)) {
+                close(fd);
+                throw std::runtime_error("LsmStorage: " + path.string() + " is not in a format this build reads");
+            }
+            LogReader reader(fd, LogRecord::data_start(format), size, format);
+            LogRecord record;
+            while (reader.next(record)) {
+                mem_->apply(record.type, record.key, record.value);
+            }
+            if (LogRecord::oversized_at(fd, reader.valid_end(), size, format)) {
+                close(fd);
+                throw std::runtime_error("LsmStorage: " + path.string() +
+                                         " holds a record over the size limits at offset " +
+                                         std::to_string(reader.valid_end()) + "; not replaying past it");
+            }
+            if (reader.valid_end() < size && reader.valid_end() > LogRecord::data_start(format)) {
+                std::cerr << "LsmStorage: ignoring " << (size - reader.valid_end()) << " trailing bytes of "
+                          << path << std::endl;
+            }
+        }
+        close(fd);
+    }
+
+    std::shared_ptr<Table> write_table(const Memtable& memtable, uint64_t number) {
+        std::filesystem::path path = file_path(number, ".sst");
+        TableBuilder builder(path);
+        for (const auto& [key, entry] : memtable.entries) {
+            builder.add(entry.type, key, entry.value);
+        }
+        if (!builder.finish()) return nullptr;
+        return Table::open(path, number);
+    }
+
+    // Freezes a full memtable and starts a new log, first waiting for the
+    // previous frozen memtable to be written out
+    bool make_room_locked(std::unique_lock<std::mutex>& lock) {
+        if (mem_->bytes < memtable_bytes_) return true;
+        room_cv_.wait(lock, [this] { return stopping_ || (!imm_ && !write_stalled_locked()); });
+        if (stopping_ || mem_->bytes < memtable_bytes_) return true;
+
+        uint64_t number = next_file_++;
+        int fd = create_log(number);
+        if (fd < 0) {
+            return false;
+        }
+        // sync() only covers the current log, so the frozen one is synced now
+        sync_fd(wal_fd_);
+        close(wal_fd_);
+        wal_fd_ = fd;
+        wal_size_ = LogRecord::FILE_HEADER_SIZE;
+        imm_ = mem_;
+        mem_ = std::make_shared<Memtable>(number);
+        work_cv_.notify_one();
+        return true;
+    }
+
+    bool write_stalled_locked() const {
+        if (version_->levels[0].size() >= L0_STOP_TRIGGER) return true;
+        for (int level = 1; level < NUM_LEVELS - 1; level++) {
+            if (total_bytes(version_->levels[level]) > LEVEL_STOP_FACTOR * max_bytes_for_level(level)) return true;
+        }
+        return false;
+    }
+
+    bool compaction_due_locked() const {
+        if (version_->levels[0].size() >= L0_COMPACTION_TRIGGER) return true;
+        for (int level = 1; level < NUM_LEVELS - 1; level++) {
+            if (total_bytes(version_->levels[level]) > max_bytes_for_level(level)) return true;
+        }
+        return false;
+    }
+
+    void background_worker() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            work_cv_.wait(lock, [this] { return stopping_ || imm_ || compaction_due_locked(); });
+            if (stopping_) break;
+            bool ok = imm_ ? flush_memtable(lock) : compact(lock);
+            if (!ok) {
+                // Disk full or similar: retry later rather than spin
+                work_cv_.wait_for(lock, std::chrono::seconds(1), [this] { return stopping_; });
+            }
+        }
+    }
+
+    // Writes imm_ to a new level 0 table. Called and returns with lock held.
+    bool flush_memtable(std::unique_lock<std::mutex>& lock) {
+        std::shared_ptr<const Memtable> imm = imm_;
+        uint64_t number = next_file_++;
+        uint64_t generation = generation_;
+        lock.unlock();
+        std::shared_ptr<Table> table = write_table(*imm, number);
+        lock.lock();
+
+        if (generation != generation_) {
+            std::filesystem::remove(file_path(number, ".sst"));
+            return true;
+        }
+        if (!table) {
+            std::cerr << "LsmStorage: failed to write " << file_path(number, ".sst") << std::endl;
+            return false;
+        }
+        auto version = std::make_shared<Version>(*version_);
+        version->levels[0].push_back(table);
+        imm_.reset();  // The manifest's oldest log is now mem_'s
+        if (!write_manifest_locked(*version)) {
+            imm_ = imm;
+            std::filesystem::remove(file_path(number, ".sst"));
+            std::cerr << "LsmStorage: failed to write manifest" << std::endl;
+            return false;
+        }
+        version_ = version;
+        std::filesystem::remove(file_path(imm->wal_number, ".wal"));
+        room_cv_.notify_all();
+        return true;
+    }
+
+    // Merges tables from the level most in need into the next one. Called
+    // and returns with lock held; the merge itself runs unlocked.
+    bool compact(std::unique_lock<std::mutex>& lock) {
+        std::shared_ptr<const Version> base = version_;
+        int level = 0;
+        std::vector<std::shared_ptr<Table>> inputs;
+        if (base->levels[0].size() >= L0_COMPACTION_TRIGGER) {
+            inputs = base->levels[0];
+        } else {
+            for (level = 1; level < NUM_LEVELS - 1; level++) {
+                if (total_bytes(base->levels[level]) > max_bytes_for_level(level)) break;
+            }
+            if (level == NUM_LEVELS - 1) return true;
+            const auto& tables = base->levels[level];
+            auto it = std::find_if(tables.begin(), tables.end(),
+                [&](const auto& t) { return compact_pointer_[level] < t->smallest(); });
+            inputs.push_back(it != tables.end() ? *it : tables.front());
+        }
+
+        std::string lo = inputs.front()->smallest();
+        std::string hi = inputs.front()->largest();
+        for (const auto& table : inputs) {
+            lo = std::min(lo, table->smallest());
+            hi = std::max(hi, table->largest());
+        }
+        std::vector<std::shared_ptr<Table>> overlaps;
+        for (const auto& table : base->levels[level + 1]) {
+            if (table->overlaps(lo, hi)) {
+                overlaps.push_back(table);
+            }
+        }
+        compact_pointer_[level] = hi;
+
+        if (level > 0 && overlaps.empty()) {
+            // Nothing to merge with: move the table down without rewriting it
+            auto version = std::make_shared<Version>(*base);
+            remove_tables(version->levels[level], inputs);
+            version->levels[level + 1].push_back(inputs.front());
+            sort_level(version->levels[level + 1]);
+            if (!write_manifest_locked(*version)) return false;
+            version_ = version;
+            room_cv_.notify_all();
+            return true;
+        }
+
+        // Tombstones only need to outlive the data they hide
+        bool drop_tombstones = true;
+        for (int deeper = level + 2; deeper < NUM_LEVELS; deeper++) {
+            drop_tombstones = drop_tombstones && base->levels[deeper].empty();
+        }
+        uint64_t generation = generation_;
+        lock.unlock();
+
+        // Newest source first: level 0 tables newest first, then the rest
+        std::vector<TableScanner> sources;
+        if (level == 0) {
+            for (auto it = inputs.rbegin(); it != inputs.rend(); ++it) {
+                sources.emplace_back(std::vector<std::shared_ptr<Table>>{*it});
+            }
+        } else {
+            sources.emplace_back(inputs);
+        }
+        sources.emplace_back(overlaps);
+
+        std::vector<std::shared_ptr<Table>> outputs;
+        std::vector<uint64_t> output_numbers;
+        std::unique_ptr<TableBuilder> builder;
+        bool ok = true;
+        auto finish_output = [&]() {
+            if (builder && builder->entries() > 0) {
+                uint64_t number = output_numbers.back();
+                std::shared_ptr<Table> table;
+                if (builder->finish()) {
+                    table = Table::open(file_path(number, ".sst"), number);
+                }
+                if (table) {
+                    outputs.push_back(table);
+                } else {
+                    ok = false;
+                }
+            }
+            builder.reset();
+        };
+
+        while (ok) {
+            TableScanner* newest = nullptr;
+            for (TableScanner& source : sources) {
+                if (source.valid() && (!newest || source.record().key < newest->record().key)) {
+                    newest = &source;
+                }
+            }
+            if (!newest) break;
+            const LogRecord& record = newest->record();
+            if (record.type == LogRecord::Type::Put || !drop_tombstones) {
+                if (!builder) {
+                    lock.lock();
+                    output_numbers.push_back(next_file_++);
+                    lock.unlock();
+                    builder = std::make_unique<TableBuilder>(file_path(output_numbers.back(), ".sst"));
+                }
+                builder->add(record.type, record.key, record.value);
+                if (builder->size() >= table_bytes_) {
+                    finish_output();
+                }
+            }
+            // Older versions of the key are superseded
+            for (TableScanner& source : sources) {
+                if (&source != newest && source.valid() && source.record().key == record.key) {
+                    source.advance();
+                }
+            }
+            newest->advance();
+        }
+        finish_output();
+        for (const TableScanner& source : sources) {
+            ok = ok && !source.failed();
+        }
+
+        lock.lock();
+        auto discard = [&]() {
+            outputs.clear();
+            for (uint64_t number : output_numbers) {
+                std::filesystem::remove(file_path(number, ".sst"));
+            }
+        };
+        if (generation != generation_) {
+            discard();
+            return true;
+        }
+        if (!ok) {
+            std::cerr << "LsmStorage: compaction of level " << level << " failed" << std::endl;
+            discard();
+            return false;
+        }
+        // Start from the current version: flushes may have added to level 0
+        auto version = std::make_shared<Version>(*version_);
+        auto& to = version->levels[level + 1];
+        remove_tables(version->levels[level], inputs);
+        remove_tables(to, overlaps);
+        to.insert(to.end(), outputs.begin(), outputs.end());
+        sort_level(to);
+        if (!write_manifest_locked(*version)) {
+            discard();
+            return false;
+        }
+        version_ = version;
+        room_cv_.notify_all();
+        for (const auto& tables : {inputs, overlaps}) {
+            for (const auto& table : tables) {
+                // Readers still holding the old version keep the file open
+                std::filesystem::remove(file_path(table->number(), ".sst"));
+            }
+        }
+        return true;
+    }
+
+    static void remove_tables(std::vector<std::shared_ptr<Table>>& tables,
+                              const std::vector<std::shared_ptr<Table>>& gone) {
+        tables.erase(std::remove_if(tables.begin(), tables.end(), [&](const auto& t) {
+            return std::find(gone.begin(), gone.end(), t) != gone.end();
+        }), tables.end());
+    }
+
+    static void sort_level(std::vector<std::shared_ptr<Table>>& tables) {
+        std::sort(tables.begin(), tables.end(),
+            [](const auto& x, const auto& y) { return x->smallest() < y->smallest(); });
+    }
+};
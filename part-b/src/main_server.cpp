@@ -1,6 +1,10 @@
 #include "network_server.h"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <signal.h>
+#include <string>
+#include <thread>
 
 Server* g_server = nullptr;
 
@@ -11,13 +15,98 @@ void signal_handler(int signum) {
     }
 }
 
-int main() {
+void print_usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [--threads N] [--fsync always|never|MS] [--write-backlog MB]"
+              << " [--maxmemory MB] [--maxmemory-policy lru|s3fifo|clock] [--engine log|lsm]\n"
+              << "  --threads N   number of reactor threads (0 = one per core, default 1)\n"
+              << "  --fsync P     always: reply to writes once they are on disk\n"
+              << "                never: leave flushing to the OS\n"
+              << "                MS: fsync in the background every MS milliseconds (default 1000)\n"
+              << "  --write-backlog MB  stop reading clients while this many MB of writes\n"
+              << "                wait for the disk; resume at half (default 64)\n"
+              << "  --maxmemory MB  memory budget for cached keys and values, overhead\n"
+              << "                included; 0 disables the cache (default 256)\n"
+              << "  --maxmemory-policy P  what the cache evicts: lru (default); s3fifo,\n"
+              << "                which keeps scans and bulk loads from flushing hot keys;\n"
+              << "                or clock, approximate LRU whose hits take no write lock\n"
+              << "  --engine E    on-disk format: log (default), append-only segments with\n"
+              << "                every key indexed in memory; or lsm, a log-structured\n"
+              << "                merge tree for datasets larger than memory\n";
+}
+
+int main(int argc, char* argv[]) {
+    size_t num_reactors = 1;
+    FsyncPolicy fsync_policy = FsyncPolicy::Interval;
+    unsigned fsync_interval_ms = 1000;
+    size_t write_backlog = StorageEngine::DEFAULT_BACKLOG_HIGH_WATER;
+    size_t max_memory = StorageEngine::DEFAULT_CACHE_BYTES;
+    EvictionPolicy eviction = EvictionPolicy::LRU;
+    DiskEngine disk_engine = DiskEngine::Log;
+
     try {
-        g_server = new Server();
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                num_reactors = std::stoul(argv[++i]);
+                if (num_reactors == 0) {
+                    num_reactors = std::max(1u, std::thread::hardware_concurrency());
+                }
+            } else if (strcmp(argv[i], "--fsync") == 0 && i + 1 < argc) {
+                const char* policy = argv[++i];
+                if (strcmp(policy, "always") == 0) {
+                    fsync_policy = FsyncPolicy::Always;
+                } else if (strcmp(policy, "never") == 0) {
+                    fsync_policy = FsyncPolicy::Never;
+                } else {
+                    fsync_interval_ms = std::stoul(policy);
+                    if (fsync_interval_ms == 0) {
+                        print_usage(argv[0]);
+                        return 1;
+                    }
+                }
+            } else if (strcmp(argv[i], "--write-backlog") == 0 && i + 1 < argc) {
+                write_backlog = std::stoul(argv[++i]) * 1024 * 1024;
+                if (write_backlog == 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc) {
+                max_memory = std::stoul(argv[++i]) * 1024 * 1024;
+            } else if (strcmp(argv[i], "--maxmemory-policy") == 0 && i + 1 < argc) {
+                const char* policy = argv[++i];
+                if (strcmp(policy, "lru") == 0) {
+                    eviction = EvictionPolicy::LRU;
+                } else if (strcmp(policy, "s3fifo") == 0) {
+                    eviction = EvictionPolicy::S3FIFO;
+                } else if (strcmp(policy, "clock") == 0) {
+                    eviction = EvictionPolicy::CLOCK;
+                } else {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+                const char* engine = argv[++i];
+                if (strcmp(engine, "log") == 0) {
+                    disk_engine = DiskEngine::Log;
+                } else if (strcmp(engine, "lsm") == 0) {
+                    disk_engine = DiskEngine::LSM;
+                } else {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        g_server = new Server(num_reactors, fsync_policy, fsync_interval_ms, write_backlog, max_memory, eviction,
+                              disk_engine);
         
         // Set up signal handlers
         signal(SIGINT, signal_handler);
         signal(SIGTERM, signal_handler);
+        // Writes to a peer that went away must fail with EPIPE, not kill us
+        signal(SIGPIPE, SIG_IGN);
         
         std::cout << "Starting BLINK DB server on port 9001..." << std::endl;
         g_server->run();
@@ -28,4 +117,4 @@ int main() {
     
     delete g_server;
     return 0;
-} 
\ No newline at end of file
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <sys/mman.h>
+
+// Read-only shared mapping of an append-only file.
+//
+// The mapping reaches well past the current end of file so that later appends
+// are covered without remapping; a MAP_SHARED mapping sees pwrite()s to the
+// same file through the page cache. Pages past EOF must never be touched
+// (that raises SIGBUS), so callers only view ranges they know were written.
+// mmap can fail, e.g. when address space runs out, so callers keep a pread
+// fallback.
+class MappedFile {
+public:
+    static constexpr uint64_t MIN_MAP_SIZE = 64ull << 20;
+
+    MappedFile() = default;
+    ~MappedFile() { unmap(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Ensures [0, size) of fd can be viewed, remapping with headroom when the
+    // file has outgrown the current mapping. Returns false if it can't be mapped.
+    bool cover(int fd, uint64_t size) {
+        if (covers(size)) return true;
+        unmap();
+        if (fd < 0 || size == 0) return false;
+
+        uint64_t length = std::max(MIN_MAP_SIZE, size * 2);
+        void* p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) return false;
+        data_ = static_cast<const char*>(p);
+        length_ = length;
+        return true;
+    }
+
+    bool covers(uint64_t size) const {
+        return data_ != nullptr && size <= length_;
+    }
+
+    void unmap() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), length_);
+            data_ = nullptr;
+            length_ = 0;
+        }
+    }
+
+    // The range must lie inside both the mapping and the written file
+    std::string_view view(uint64_t offset, size_t n) const {
+        return std::string_view(data_ + offset, n);
+    }
+
+private:
+    const char* data_ = nullptr;
+    uint64_t length_ = 0;
+};
@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <stdexcept>
 #include <sstream>
+#include <vector>
 
 class NetworkClient {
 private:
@@ -71,8 +72,21 @@ public:
     }
 
     std::string send_command(const std::string& command) {
+        // Split into arguments; the server dispatches on the argument vector
+        std::vector<std::string> args;
+        std::istringstream iss(command);
+        std::string arg;
+        while (iss >> arg) {
+            args.push_back(arg);
+        }
+
         // Format command in RESP protocol
-        std::string resp_command = "*1\r\n$" + std::to_string(command.length()) + "\r\n" + command + "\r\n";
+        std::string resp_command = "*";
+        resp_command += std::to_string(args.size()) + "\r\n";
+        for (const auto& a : args) {
+            resp_command += '$';
+            resp_command += std::to_string(a.length()) + "\r\n" + a + "\r\n";
+        }
         
         if (send(sock, resp_command.c_str(), resp_command.length(), 0) < 0) {
             throw std::runtime_error("Send failed");
@@ -97,7 +111,9 @@ int main(int argc, char* argv[]) {
         
         while (true) {
             std::cout << "User> ";
-            std::getline(std::cin, command);
+            if (!std::getline(std::cin, command)) {
+                break;
+            }
             
             if (command == "EXIT") {
                 break;
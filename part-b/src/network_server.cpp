@@ -1,12 +1,11 @@
 #include "network_server.h"
 #include <iostream>
-#include <sstream>
+#include <thread>
 #include <vector>
 #include <cstring>
 #include <fcntl.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
-#include <sys/event.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
@@ -14,18 +13,35 @@
 #define TCP_NODELAY 1
 #endif
 
-Server::Server() : storage(std::make_unique<StorageEngine>()) {
-    setup_server();
-    setup_kqueue();
+Server::Server(size_t num_reactors, FsyncPolicy fsync_policy, unsigned fsync_interval_ms,
+               size_t write_backlog, size_t max_memory, EvictionPolicy eviction, DiskEngine disk_engine)
+    : storage(std::make_unique<StorageEngine>(max_memory, fsync_policy, fsync_interval_ms, eviction, disk_engine)) {
+    storage->set_write_backlog_limits(write_backlog, write_backlog / 2);
+    if (num_reactors == 0) {
+        num_reactors = 1;
+    }
+    // With several reactors every one binds its own socket to the same port and
+    // the kernel load-balances incoming connections across them.
+    bool reuse_port = num_reactors > 1;
+    for (size_t i = 0; i < num_reactors; i++) {
+        auto reactor = std::make_unique<Reactor>();
+        reactor->server_fd = setup_server(reuse_port);
+        reactors.push_back(std::move(reactor));
+        reactors.back()->poller.add(reactors.back()->server_fd);
+    }
+    std::cout << "Server listening on port " << PORT << " with " << num_reactors
+              << (num_reactors == 1 ? " reactor" : " reactors") << std::endl;
 }
 
 Server::~Server() {
-    stop();
+    for (auto& reactor : reactors) {
+        close_reactor(*reactor);
+    }
 }
 
-void Server::setup_server() {
+int Server::setup_server(bool reuse_port) {
     // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) {
         throw std::runtime_error("Failed to create socket: " + std::string(strerror(errno)));
     }
@@ -35,6 +51,9 @@ void Server::setup_server() {
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         throw std::runtime_error("Failed to set socket options: " + std::string(strerror(errno)));
     }
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        throw std::runtime_error("Failed to set SO_REUSEPORT: " + std::string(strerror(errno)));
+    }
 
     // Set up address structure
     struct sockaddr_in address;
@@ -64,24 +83,9 @@ void Server::setup_server() {
         throw std::runtime_error("Failed to listen on socket: " + std::string(strerror(errno)));
     }
 
-    std::cout << "Server listening on port " << PORT << std::endl;
-
     // Set server socket to non-blocking
     set_nonblocking(server_fd);
-}
-
-void Server::setup_kqueue() {
-    kq = kqueue();
-    if (kq < 0) {
-        throw std::runtime_error("Failed to create kqueue");
-    }
-
-    // Add server socket to kqueue
-    struct kevent ev;
-    EV_SET(&ev, server_fd, EVFILT_READ, EV_ADD, 0, 0, nullptr);
-    if (kevent(kq, &ev, 1, nullptr, 0, nullptr) < 0) {
-        throw std::runtime_error("Failed to add server socket to kqueue");
-    }
+    return server_fd;
 }
 
 void Server::set_nonblocking(int fd) {
@@ -94,307 +98,401 @@ void Server::set_nonblocking(int fd) {
     }
 }
 
-void Server::handle_new_connection() {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    
-    int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-    if (client_fd < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            std::cerr << "Failed to accept connection" << std::endl;
+void Server::handle_new_connection(Reactor& reactor) {
+    // The listening socket is edge-triggered, so accept until the backlog is empty
+    while (true) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept(reactor.server_fd, (struct sockaddr*)&client_addr, &client_len);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "Failed to accept connection" << std::endl;
+            }
+            return;
         }
-        return;
-    }
 
-    // Set TCP_NODELAY to disable Nagle's algorithm
-    int flag = 1;
-    if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0) {
-        std::cerr << "Failed to set TCP_NODELAY" << std::endl;
-    }
+        // Set TCP_NODELAY to disable Nagle's algorithm
+        int flag = 1;
+        if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0) {
+            std::cerr << "Failed to set TCP_NODELAY" << std::endl;
+        }
 
-    // Set send buffer size to 64KB
-    int sendbuf = 65536;
-    if (setsockopt(client_fd, SOL_SOCKET, SO_SNDBUF, &sendbuf, sizeof(sendbuf)) < 0) {
-        std::cerr << "Failed to set send buffer size" << std::endl;
-    }
+        // Set send buffer size to 64KB
+        int sendbuf = 65536;
+        if (setsockopt(client_fd, SOL_SOCKET, SO_SNDBUF, &sendbuf, sizeof(sendbuf)) < 0) {
+            std::cerr << "Failed to set send buffer size" << std::endl;
+        }
 
-    // Set client socket to non-blocking
-    set_nonblocking(client_fd);
+        // Set client socket to non-blocking
+        set_nonblocking(client_fd);
 
-    // Add client socket to kqueue for reading
-    struct kevent ev;
-    EV_SET(&ev, client_fd, EVFILT_READ, EV_ADD, 0, 0, nullptr);
-    if (kevent(kq, &ev, 1, nullptr, 0, nullptr) < 0) {
-        std::cerr << "Failed to add client to kqueue" << std::endl;
-        close(client_fd);
-        return;
-    }
+        // Register client socket with the poller for reading
+        try {
+            reactor.poller.add(client_fd);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            close(client_fd);
+            continue;
+        }
 
-    // Initialize client buffer
-    client_buffers[client_fd] = "";
+        // Initialize per-connection state
+        reactor.clients[client_fd];
+    }
 }
 
-void Server::handle_client_data(int client_fd) {
-    char buffer[4096];
-    ssize_t bytes_read;
-
-    while ((bytes_read = read(client_fd, buffer, sizeof(buffer))) > 0) {
-        client_buffers[client_fd].append(buffer, bytes_read);
-        
-        // Process complete commands
-        while (true) {
-            // Find the first complete command
-            size_t pos = client_buffers[client_fd].find("\r\n");
-            if (pos == std::string::npos) break;
-            
-            std::string line = client_buffers[client_fd].substr(0, pos);
-            client_buffers[client_fd] = client_buffers[client_fd].substr(pos + 2);
-            
-            // Handle RESP protocol
-            if (line.empty()) continue;
-            
-            if (line[0] == '*') {
-                // Array (multi-bulk) format
-                int num_args = std::stoi(line.substr(1));
-                std::vector<std::string> args;
-                bool complete = true;
-                
-                for (int i = 0; i < num_args && complete; i++) {
-                    // Each argument should be a bulk string
-                    pos = client_buffers[client_fd].find("\r\n");
-                    if (pos == std::string::npos) {
-                        complete = false;
-                        break;
-                    }
-                    
-                    line = client_buffers[client_fd].substr(0, pos);
-                    client_buffers[client_fd] = client_buffers[client_fd].substr(pos + 2);
-                    
-                    if (line[0] != '$') {
-                        complete = false;
-                        break;
-                    }
-                    
-                    int len = std::stoi(line.substr(1));
-                    if (len < 0) {
-                        args.push_back("");
-                        continue;
-                    }
-                    
-                    if (client_buffers[client_fd].length() < size_t(len + 2)) {
-                        complete = false;
-                        break;
-                    }
-                    
-                    args.push_back(client_buffers[client_fd].substr(0, len));
-                    client_buffers[client_fd] = client_buffers[client_fd].substr(len + 2);
-                }
-                
-                if (!complete) break;
-                
-                // Process the command
-                if (!args.empty()) {
-                    std::string command = args[0];
-                    for (size_t i = 1; i < args.size(); i++) {
-                        command += " " + args[i];
-                    }
-                    std::string response = process_command(command);
-                    
-                    // Send response
-                    size_t total_sent = 0;
-                    while (total_sent < response.length()) {
-                        ssize_t sent = write(client_fd, 
-                                          response.c_str() + total_sent,
-                                          response.length() - total_sent);
-                        
-                        if (sent < 0) {
-                            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                                continue;
-                            }
-                            close(client_fd);
-                            client_buffers.erase(client_fd);
-                            return;
-                        }
-                        
-                        total_sent += sent;
-                    }
-                }
-            } else {
-                // Simple string format (for backward compatibility)
-                std::string response = process_command(line);
-                
-                // Send response
-                size_t total_sent = 0;
-                while (total_sent < response.length()) {
-                    ssize_t sent = write(client_fd, 
-                                      response.c_str() + total_sent,
-                                      response.length() - total_sent);
-                    
-                    if (sent < 0) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            continue;
-                        }
-                        close(client_fd);
-                        client_buffers.erase(client_fd);
-                        return;
-                    }
-                    
-                    total_sent += sent;
-                }
+void Server::handle_client_data(Reactor& reactor, int client_fd) {
+    auto it = reactor.clients.find(client_fd);
+    if (it == reactor.clients.end()) return;
+    Connection& conn = it->second;
+    bool wrote = false;
+
+    while (true) {
+        if (storage->write_backlogged()) {
+            // The disk writer is behind. Leave requests in the socket, where
+            // TCP flow control pushes back on the client, instead of queueing
+            // more writes in memory.
+            if (!conn.write_stalled) {
+                conn.write_stalled = true;
+                reactor.stalled.push_back(client_fd);
             }
+            break;
+        }
+        if (conn.output.size() >= OUTPUT_HIGH_WATER) {
+            // The client is not reading its replies; stop reading its requests
+            // until the backlog drains (see handle_client_write)
+            conn.read_paused = true;
+            break;
+        }
+
+        // Read straight into the connection's parse buffer
+        char* buffer = conn.parser.prepare(READ_CHUNK_SIZE);
+        ssize_t bytes_read = read(client_fd, buffer, READ_CHUNK_SIZE);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_client(reactor, client_fd);
+                return;
+            }
+            break;
+        }
+        if (bytes_read == 0) {
+            close_client(reactor, client_fd);
+            return;
+        }
+        conn.parser.commit(bytes_read);
+
+        // Process complete commands, queueing their replies
+        RespParser::Status status;
+        while ((status = conn.parser.next(reactor.args)) == RespParser::Status::Ok) {
+            wrote |= process_command(reactor.args, conn.output);
+        }
+
+        if (status == RespParser::Status::Error) {
+            if (wrote && !storage->wait_durable(storage->write_position())) {
+                close_client(reactor, client_fd);
+                return;
+            }
+            conn.output += "-ERR ";
+            conn.output += conn.parser.error();
+            conn.output += "\r\n";
+            conn.output.flush(client_fd);
+            close_client(reactor, client_fd);
+            return;
         }
     }
 
-    if (bytes_read == 0 || (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-        close(client_fd);
-        client_buffers.erase(client_fd);
+    // Under FsyncPolicy::Always no reply may reach the client before its
+    // write is durable. Waiting once per read batch lets every pipelined write
+    // share one fsync, and writes from other reactors join the same group.
+    // If the fsync failed the replies are withheld and the connection is
+    // dropped, so the client cannot take those writes as durable.
+    if (wrote && !storage->wait_durable(storage->write_position())) {
+        close_client(reactor, client_fd);
         return;
     }
+
+    // One writev for everything this read batch produced
+    flush_client(reactor, client_fd, conn);
 }
 
-std::string Server::process_command(const std::string& command) {
-    std::istringstream iss(command);
-    std::string cmd;
-    iss >> cmd;
-    
-    // Convert command to uppercase for case-insensitive comparison
-    std::string upper_cmd = cmd;
-    for (char& c : upper_cmd) {
-        c = std::toupper(c);
-    }
-    
-    if (upper_cmd == "PING") {
-        return "+PONG\r\n";
-    }
-    else if (upper_cmd == "SET") {
-        std::string key, value;
-        iss >> key >> value;
-        if (key.empty() || value.empty()) {
-            return "-ERR wrong number of arguments for 'set' command\r\n";
-        }
-        if (storage->set(key, value)) {
-            return "+OK\r\n";
-        }
-        return "-ERR invalid key or value\r\n";
+void Server::handle_client_write(Reactor& reactor, int client_fd) {
+    auto it = reactor.clients.find(client_fd);
+    if (it == reactor.clients.end()) return;
+    Connection& conn = it->second;
+
+    if (!flush_client(reactor, client_fd, conn)) return;
+    if (conn.output.empty() && conn.read_paused) {
+        // Edge-triggered readiness will not fire again for bytes that were
+        // already waiting, so pick them up now
+        conn.read_paused = false;
+        handle_client_data(reactor, client_fd);
     }
-    else if (upper_cmd == "GET") {
-        std::string key;
-        iss >> key;
-        if (key.empty()) {
-            return "-ERR wrong number of arguments for 'get' command\r\n";
+}
+
+void Server::resume_stalled(Reactor& reactor) {
+    std::vector<int> stalled;
+    stalled.swap(reactor.stalled);
+    for (int client_fd : stalled) {
+        // The fd may have been closed, and even reused, since it stalled
+        auto it = reactor.clients.find(client_fd);
+        if (it == reactor.clients.end() || !it->second.write_stalled) continue;
+        it->second.write_stalled = false;
+        // Edge-triggered: bytes already in the socket will not be reported again
+        handle_client_data(reactor, client_fd);
+    }
+}
+
+bool Server::flush_client(Reactor& reactor, int client_fd, Connection& conn) {
+    switch (conn.output.flush(client_fd)) {
+    case OutputBuffer::FlushResult::Done:
+        if (conn.write_watched) {
+            reactor.poller.watch_writable(client_fd, false);
+            conn.write_watched = false;
         }
-        std::string value = storage->get(key);
-        if (value.empty()) {
-            return "$-1\r\n";
+        return true;
+    case OutputBuffer::FlushResult::Blocked:
+        // Socket buffer is full; resume when the poller reports it writable
+        if (!conn.write_watched) {
+            reactor.poller.watch_writable(client_fd, true);
+            conn.write_watched = true;
         }
-        return "$" + std::to_string(value.length()) + "\r\n" + value + "\r\n";
+        return true;
+    case OutputBuffer::FlushResult::Error:
+        break;
     }
-    else if (upper_cmd == "DEL") {
-        std::string key;
-        iss >> key;
-        if (key.empty()) {
-            return "-ERR wrong number of arguments for 'del' command\r\n";
+    close_client(reactor, client_fd);
+    return false;
+}
+
+void Server::close_client(Reactor& reactor, int client_fd) {
+    close(client_fd);
+    reactor.clients.erase(client_fd);
+}
+
+namespace {
+
+// Case-insensitive match of a command name against an upper-case keyword
+bool command_is(std::string_view name, const char* keyword) {
+    for (size_t i = 0; i < name.size(); i++) {
+        if ((name[i] & ~0x20) != keyword[i]) return false;
+    }
+    return true;
+}
+
+void append_integer(OutputBuffer& out, size_t value) {
+    char digits[20];
+    char* p = digits + sizeof(digits);
+    do {
+        *--p = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value);
+    out.append(p, digits + sizeof(digits) - p);
+}
+
+}  // namespace
+
+Server::Command Server::lookup_command(std::string_view name) {
+    // Dispatch on length and first letter so at most one keyword is compared
+    switch (name.size()) {
+    case 3:
+        switch (name[0] & ~0x20) {
+        case 'G': return command_is(name, "GET") ? Command::Get : Command::Unknown;
+        case 'S': return command_is(name, "SET") ? Command::Set : Command::Unknown;
+        case 'D': return command_is(name, "DEL") ? Command::Del : Command::Unknown;
+        }
+        break;
+    case 4:
+        switch (name[0] & ~0x20) {
+        case 'P': return command_is(name, "PING") ? Command::Ping : Command::Unknown;
+        case 'I': return command_is(name, "INFO") ? Command::Info : Command::Unknown;
+        case 'E': return command_is(name, "EXIT") ? Command::Exit : Command::Unknown;
         }
-        if (storage->del(key)) {
-            return ":1\r\n";
+        break;
+    case 5:
+        return command_is(name, "CLEAR") ? Command::Clear : Command::Unknown;
+    case 7:
+        return command_is(name, "FLUSHDB") ? Command::Clear : Command::Unknown;
+    case 8:
+        return command_is(name, "FLUSHALL") ? Command::Clear : Command::Unknown;
+    }
+    return Command::Unknown;
+}
+
+bool Server::process_command(const std::vector<std::string_view>& args, OutputBuffer& out) {
+    switch (lookup_command(args[0])) {
+    case Command::Ping:  cmd_ping(args, out); break;
+    case Command::Set:   cmd_set(args, out); return true;
+    case Command::Get:   cmd_get(args, out); break;
+    case Command::Del:   cmd_del(args, out); return true;
+    case Command::Clear: cmd_clear(args, out); return true;
+    case Command::Info:  cmd_info(args, out); break;
+    case Command::Exit:  cmd_exit(args, out); break;
+    case Command::Unknown: {
+        out += "-ERR unknown command '";
+        // Keep the reply a single protocol line whatever the client sent
+        for (char c : args[0]) {
+            out += (c == '\r' || c == '\n') ? ' ' : c;
         }
-        return ":0\r\n";
+        out += "'\r\n";
+        break;
     }
-    else if (upper_cmd == "CLEAR" || upper_cmd == "FLUSHALL" || upper_cmd == "FLUSHDB") {
-        storage->clear();
-        return "+OK\r\n";
     }
-    else if (upper_cmd == "EXIT") {
-        // Stop the server gracefully
-        should_stop = true;
-        storage->stop_async_writer();
-        return "+OK\r\n";
+    return false;
+}
+
+void Server::cmd_ping(const std::vector<std::string_view>&, OutputBuffer& out) {
+    out += "+PONG\r\n";
+}
+
+void Server::cmd_set(const std::vector<std::string_view>& args, OutputBuffer& out) {
+    if (args.size() != 3 || args[1].empty() || args[2].empty()) {
+        out += "-ERR wrong number of arguments for 'set' command\r\n";
+        return;
     }
-    else {
-        return "-ERR unknown command '" + cmd + "'\r\n";
+    if (storage->set(args[1], args[2])) {
+        out += "+OK\r\n";
+        return;
     }
+    out += "-ERR key or value too large\r\n";
 }
 
-std::string Server::encode_resp(const std::string& response) {
-    // If response is already encoded (starts with +, -, :, $, or *)
-    if (!response.empty() && (response[0] == '+' || response[0] == '-' || 
-        response[0] == ':' || response[0] == '$' || response[0] == '*')) {
-        return response;
-    }
-    
-    if (response == "NULL") {
-        return "$-1\r\n";
+void Server::cmd_get(const std::vector<std::string_view>& args, OutputBuffer& out) {
+    if (args.size() != 2 || args[1].empty()) {
+        out += "-ERR wrong number of arguments for 'get' command\r\n";
+        return;
     }
-    else if (response == "PONG") {
-        return "+PONG\r\n";
+    // The value is copied straight from the cache into the reply
+    bool found = storage->read(args[1], [&out](std::string_view value) {
+        out += '$';
+        append_integer(out, value.length());
+        out += "\r\n";
+        out += value;
+        out += "\r\n";
+    });
+    if (!found) {
+        out += "$-1\r\n";
     }
-    else if (response == "OK") {
-        return "+OK\r\n";
+}
+
+void Server::cmd_del(const std::vector<std::string_view>& args, OutputBuffer& out) {
+    if (args.size() < 2) {
+        out += "-ERR wrong number of arguments for 'del' command\r\n";
+        return;
     }
-    else if (response.substr(0, 6) == "Error:") {
-        return "-" + response + "\r\n";
+    size_t deleted = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (!args[i].empty() && storage->del(args[i])) {
+            deleted++;
+        }
     }
-    else if (response.substr(0, 2) == "# ") {
-        // Handle INFO command response
-        return "$" + std::to_string(response.length()) + "\r\n" + response + "\r\n";
+    out += ':';
+    append_integer(out, deleted);
+    out += "\r\n";
+}
+
+void Server::cmd_clear(const std::vector<std::string_view>&, OutputBuffer& out) {
+    storage->clear();
+    out += "+OK\r\n";
+}
+
+void Server::cmd_info(const std::vector<std::string_view>&, OutputBuffer& out) {
+    // Cache section of Redis' INFO, same field names
+    const LRUCache& cache = storage->cache();
+    CacheStats stats = cache.stats();
+    std::string info = "# Cache\r\n";
+    info += "maxmemory:" + std::to_string(cache.max_bytes()) + "\r\n";
+    info += "maxmemory_policy:";
+    switch (cache.policy()) {
+    case EvictionPolicy::LRU:    info += "lru"; break;
+    case EvictionPolicy::S3FIFO: info += "s3fifo"; break;
+    case EvictionPolicy::CLOCK:  info += "clock"; break;
+    }
+    info += "\r\n";
+    info += "used_memory_cache:" + std::to_string(cache.memory_used()) + "\r\n";
+    info += "cached_keys:" + std::to_string(cache.size()) + "\r\n";
+    info += "keyspace_hits:" + std::to_string(stats.hits) + "\r\n";
+    info += "keyspace_misses:" + std::to_string(stats.misses) + "\r\n";
+    out += '$';
+    append_integer(out, info.size());
+    out += "\r\n";
+    out += info;
+    out += "\r\n";
+}
+
+void Server::cmd_exit(const std::vector<std::string_view>&, OutputBuffer& out) {
+    // Stop the server gracefully
+    should_stop = true;
+    storage->stop_async_writer();
+    out += "+OK\r\n";
+}
+
+void Server::run() {
+    // Reactor 0 runs on the calling thread, the rest get a thread each
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < reactors.size(); i++) {
+        threads.emplace_back(&Server::run_reactor, this, std::ref(*reactors[i]));
     }
-    else {
-        // Bulk string response
-        return "$" + std::to_string(response.length()) + "\r\n" + response + "\r\n";
+    run_reactor(*reactors[0]);
+    for (auto& thread : threads) {
+        thread.join();
     }
 }
 
-void Server::run() {
-    struct kevent events[MAX_EVENTS];
-    
-    while (!should_stop) {  // Check should_stop flag
-        int nev = kevent(kq, nullptr, 0, events, MAX_EVENTS, nullptr);
-        
-        if (nev < 0) {
-            if (errno == EINTR) continue;
-            throw std::runtime_error("kevent error");
-        }
-        
+void Server::run_reactor(Reactor& reactor) {
+    while (!should_stop) {
+        // Wake up periodically so stop() requests are noticed promptly, and
+        // more often while connections wait for the write backlog to drain
+        int nev = reactor.poller.wait(reactor.stalled.empty() ? 100 : BACKLOG_POLL_MS);
+
         for (int i = 0; i < nev; i++) {
-            int fd = events[i].ident;
-            
-            if (fd == server_fd) {
+            PollEvent ev = reactor.poller.event(i);
+
+            if (ev.fd == reactor.server_fd) {
                 // New connection
-                handle_new_connection();
+                handle_new_connection(reactor);
             }
-            else {
-                // Client data
-                if (events[i].flags & EV_EOF) {
-                    close(fd);
-                    client_buffers.erase(fd);
+            else if (ev.readable || ev.writable) {
+                // Both handlers ignore fds that were closed earlier in this
+                // batch; a closed peer is detected by read() returning 0
+                if (ev.writable) {
+                    handle_client_write(reactor, ev.fd);
                 }
-                else {
-                    handle_client_data(fd);
+                if (ev.readable) {
+                    handle_client_data(reactor, ev.fd);
                 }
             }
+            else if (ev.hangup) {
+                close_client(reactor, ev.fd);
+            }
+        }
+
+        if (!reactor.stalled.empty() && !storage->write_backlogged()) {
+            resume_stalled(reactor);
         }
     }
-    
+
     // Clean up when server stops
-    stop();
+    close_reactor(reactor);
 }
 
 void Server::stop() {
+    // Only flag the event loops; each reactor releases its sockets once it
+    // observes this. Safe to call from a signal handler.
+    should_stop = true;
+}
+
+void Server::close_reactor(Reactor& reactor) {
     // Close all client connections
-    for (const auto& pair : client_buffers) {
+    for (const auto& pair : reactor.clients) {
         close(pair.first);
     }
-    client_buffers.clear();
-    
+    reactor.clients.clear();
+
     // Close server socket
-    if (server_fd >= 0) {
-        close(server_fd);
-        server_fd = -1;
-    }
-    
-    // Close kqueue
-    if (kq >= 0) {
-        close(kq);
-        kq = -1;
+    if (reactor.server_fd >= 0) {
+        close(reactor.server_fd);
+        reactor.server_fd = -1;
     }
-} 
\ No newline at end of file
+}
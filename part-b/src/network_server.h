@@ -1,13 +1,30 @@
 #pragma once
 
+#include "output_buffer.h"
+#include "poller.h"
+#include "resp_parser.h"
 #include "storage_engine.h"
+#include <atomic>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 class Server {
 public:
-    Server();
+    // num_reactors > 1 starts that many event loop threads, each with its own
+    // SO_REUSEPORT listening socket and poller, sharing one StorageEngine.
+    // Reading from clients pauses while more than write_backlog bytes of
+    // writes are waiting for the disk, and resumes at half that. Cached
+    // values are held to max_memory bytes, evicted by the given policy; 0
+    // serves every GET from disk. disk_engine picks the on-disk format.
+    explicit Server(size_t num_reactors = 1, FsyncPolicy fsync_policy = FsyncPolicy::Interval,
+                    unsigned fsync_interval_ms = 1000,
+                    size_t write_backlog = StorageEngine::DEFAULT_BACKLOG_HIGH_WATER,
+                    size_t max_memory = StorageEngine::DEFAULT_CACHE_BYTES,
+                    EvictionPolicy eviction = EvictionPolicy::LRU,
+                    DiskEngine disk_engine = DiskEngine::Log);
     ~Server();
 
     void run();
@@ -16,19 +33,58 @@ public:
 private:
     static constexpr int PORT = 9001;
     static constexpr int LISTEN_BACKLOG = 128;
-    static constexpr int MAX_EVENTS = 1024;
+    static constexpr size_t READ_CHUNK_SIZE = 16384;
+    // Stop reading a client's requests while this many reply bytes are unsent
+    static constexpr size_t OUTPUT_HIGH_WATER = 4 * 1024 * 1024;
+    // How often a reactor with stalled connections checks the write backlog
+    static constexpr int BACKLOG_POLL_MS = 5;
 
-    int server_fd = -1;
-    int kq = -1;
-    bool should_stop = false;
+    struct Connection {
+        RespParser parser;
+        OutputBuffer output;
+        bool write_watched = false;  // Registered for write readiness
+        bool read_paused = false;    // Stopped reading until output drains
+        bool write_stalled = false;  // Stopped reading until the disk catches up
+    };
+
+    // One event loop. Connections never migrate between reactors, so nothing
+    // in here is shared across threads.
+    struct Reactor {
+        int server_fd = -1;
+        Poller poller;
+        std::unordered_map<int, Connection> clients;
+        // Connections with write_stalled set, resumed once the backlog drains
+        std::vector<int> stalled;
+        // Scratch space reused for every request handled by this reactor
+        std::vector<std::string_view> args;
+    };
+
+    enum class Command { Unknown, Ping, Set, Get, Del, Clear, Info, Exit };
+
+    std::atomic<bool> should_stop{false};
     std::unique_ptr<StorageEngine> storage;
-    std::unordered_map<int, std::string> client_buffers;
+    std::vector<std::unique_ptr<Reactor>> reactors;
 
-    void setup_server();
-    void setup_kqueue();
+    int setup_server(bool reuse_port);
+    void run_reactor(Reactor& reactor);
+    void close_reactor(Reactor& reactor);
     void set_nonblocking(int fd);
-    void handle_new_connection();
-    void handle_client_data(int client_fd);
-    std::string process_command(const std::string& command);
-    std::string encode_resp(const std::string& response);
+    void handle_new_connection(Reactor& reactor);
+    void handle_client_data(Reactor& reactor, int client_fd);
+    void handle_client_write(Reactor& reactor, int client_fd);
+    void resume_stalled(Reactor& reactor);
+    bool flush_client(Reactor& reactor, int client_fd, Connection& conn);
+    void close_client(Reactor& reactor, int client_fd);
+
+    // Runs one parsed request and appends its RESP reply to out. Returns true
+    // if the command modified the store.
+    bool process_command(const std::vector<std::string_view>& args, OutputBuffer& out);
+    static Command lookup_command(std::string_view name);
+    void cmd_ping(const std::vector<std::string_view>& args, OutputBuffer& out);
+    void cmd_set(const std::vector<std::string_view>& args, OutputBuffer& out);
+    void cmd_get(const std::vector<std::string_view>& args, OutputBuffer& out);
+    void cmd_del(const std::vector<std::string_view>& args, OutputBuffer& out);
+    void cmd_clear(const std::vector<std::string_view>& args, OutputBuffer& out);
+    void cmd_info(const std::vector<std::string_view>& args, OutputBuffer& out);
+    void cmd_exit(const std::vector<std::string_view>& args, OutputBuffer& out);
 }; 
\ No newline at end of file
@@ -0,0 +1,82 @@
+#include "output_buffer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/uio.h>
+
+OutputBuffer::Block OutputBuffer::take_block() {
+    if (!spare_.empty()) {
+        Block block = std::move(spare_.back());
+        spare_.pop_back();
+        block.used = 0;
+        return block;
+    }
+    Block block;
+    block.data.reset(new char[BLOCK_SIZE]);
+    return block;
+}
+
+void OutputBuffer::append(const char* data, size_t n) {
+    size_ += n;
+    while (n > 0) {
+        if (blocks_.empty() || blocks_.back().used == BLOCK_SIZE) {
+            blocks_.push_back(take_block());
+        }
+        Block& tail = blocks_.back();
+        size_t chunk = std::min(n, BLOCK_SIZE - tail.used);
+        memcpy(tail.data.get() + tail.used, data, chunk);
+        tail.used += chunk;
+        data += chunk;
+        n -= chunk;
+    }
+}
+
+void OutputBuffer::consume(size_t n) {
+    size_ -= n;
+    while (n > 0) {
+        Block& front = blocks_.front();
+        size_t available = front.used - head_;
+        if (n < available) {
+            head_ += n;
+            return;
+        }
+        n -= available;
+        head_ = 0;
+        if (blocks_.size() == 1) {
+            // Keep the last block around for the next batch of replies
+            front.used = 0;
+            return;
+        }
+        if (spare_.size() < MAX_SPARE_BLOCKS) {
+            spare_.push_back(std::move(front));
+        }
+        blocks_.pop_front();
+    }
+}
+
+OutputBuffer::FlushResult OutputBuffer::flush(int fd) {
+    while (size_ > 0) {
+        struct iovec iov[MAX_IOV];
+        int count = 0;
+        size_t offset = head_;
+        for (auto it = blocks_.begin(); it != blocks_.end() && count < MAX_IOV; ++it) {
+            if (it->used > offset) {
+                iov[count].iov_base = it->data.get() + offset;
+                iov[count].iov_len = it->used - offset;
+                count++;
+            }
+            offset = 0;
+        }
+
+        ssize_t sent = writev(fd, iov, count);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return FlushResult::Blocked;
+            }
+            return FlushResult::Error;
+        }
+        consume(static_cast<size_t>(sent));
+    }
+    return FlushResult::Done;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Per-connection reply queue.
+//
+// Replies are appended into a chain of fixed-size blocks and the whole chain
+// is sent with one writev() per flush, so a pipelined batch costs one syscall
+// instead of one write per reply. Blocks that have been sent are recycled, and
+// data the socket could not take yet stays queued until the poller reports the
+// socket writable again.
+class OutputBuffer {
+public:
+    static constexpr size_t BLOCK_SIZE = 16384;
+    static constexpr int MAX_IOV = 64;
+
+    enum class FlushResult {
+        Done,     // Everything was written
+        Blocked,  // The socket buffer is full; wait for write readiness
+        Error     // The connection is broken
+    };
+
+    void append(const char* data, size_t n);
+    void append(std::string_view s) { append(s.data(), s.size()); }
+
+    OutputBuffer& operator+=(std::string_view s) {
+        append(s.data(), s.size());
+        return *this;
+    }
+    OutputBuffer& operator+=(char c) {
+        append(&c, 1);
+        return *this;
+    }
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+
+    FlushResult flush(int fd);
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t used = 0;
+    };
+
+    std::deque<Block> blocks_;
+    std::vector<Block> spare_;  // Recycled blocks, at most MAX_SPARE_BLOCKS
+    size_t head_ = 0;           // Bytes of blocks_.front() already sent
+    size_t size_ = 0;           // Bytes queued and not yet sent
+
+    static constexpr size_t MAX_SPARE_BLOCKS = 1;
+
+    Block take_block();
+    void consume(size_t n);
+};
@@ -0,0 +1,109 @@
+#include "poller.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+#if defined(BLINKDB_POLLER_EPOLL)
+
+Poller::Poller() {
+    fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to create epoll instance: " + std::string(strerror(errno)));
+    }
+}
+
+void Poller::add(int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        throw std::runtime_error("Failed to add fd to epoll: " + std::string(strerror(errno)));
+    }
+}
+
+void Poller::remove(int fd) {
+    // Closing the fd also drops it from the interest list; this is for callers
+    // that keep the descriptor open.
+    epoll_ctl(fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void Poller::watch_writable(int fd, bool enabled) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    if (enabled) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = fd;
+    if (epoll_ctl(fd_, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        throw std::runtime_error("Failed to modify fd in epoll: " + std::string(strerror(errno)));
+    }
+}
+
+int Poller::wait(int timeout_ms) {
+    int n = epoll_wait(fd_, events_, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        throw std::runtime_error("epoll_wait error: " + std::string(strerror(errno)));
+    }
+    return n;
+}
+
+#else  // BLINKDB_POLLER_KQUEUE
+
+Poller::Poller() {
+    fd_ = kqueue();
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to create kqueue: " + std::string(strerror(errno)));
+    }
+}
+
+void Poller::add(int fd) {
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    if (kevent(fd_, &ev, 1, nullptr, 0, nullptr) < 0) {
+        throw std::runtime_error("Failed to add fd to kqueue: " + std::string(strerror(errno)));
+    }
+}
+
+void Poller::remove(int fd) {
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+    kevent(fd_, ev, 2, nullptr, 0, nullptr);
+}
+
+void Poller::watch_writable(int fd, bool enabled) {
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_WRITE, enabled ? (EV_ADD | EV_CLEAR) : EV_DELETE, 0, 0, nullptr);
+    if (kevent(fd_, &ev, 1, nullptr, 0, nullptr) < 0 && enabled) {
+        throw std::runtime_error("Failed to modify fd in kqueue: " + std::string(strerror(errno)));
+    }
+}
+
+int Poller::wait(int timeout_ms) {
+    struct timespec ts;
+    struct timespec* tsp = nullptr;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    int n = kevent(fd_, nullptr, 0, events_, MAX_EVENTS, tsp);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        throw std::runtime_error("kevent error: " + std::string(strerror(errno)));
+    }
+    return n;
+}
+
+#endif
+
+Poller::~Poller() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
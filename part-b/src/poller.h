@@ -0,0 +1,69 @@
+#pragma once
+
+#if defined(BLINKDB_POLLER_EPOLL)
+#include <sys/epoll.h>
+#elif defined(BLINKDB_POLLER_KQUEUE)
+#include <sys/event.h>
+#else
+#error "No poller backend selected (define BLINKDB_POLLER_EPOLL or BLINKDB_POLLER_KQUEUE)"
+#endif
+
+// A single readiness notification returned by Poller::wait().
+struct PollEvent {
+    int fd;
+    bool readable;
+    bool writable;
+    bool hangup;  // Peer closed the connection or the socket reported an error
+};
+
+// Thin wrapper over the platform event queue (epoll on Linux, kqueue on BSD/macOS).
+//
+// Descriptors are registered edge-triggered (EPOLLET / EV_CLEAR): a notification
+// is delivered once per readiness transition, so callers must drain reads and
+// accepts until EAGAIN before waiting again. The backend is chosen at build time
+// by the Makefile, so there is no runtime dispatch on the hot path.
+class Poller {
+public:
+    static constexpr int MAX_EVENTS = 1024;
+
+    Poller();
+    ~Poller();
+
+    Poller(const Poller&) = delete;
+    Poller& operator=(const Poller&) = delete;
+
+    void add(int fd);
+    void remove(int fd);
+    // Turns write-readiness notifications for fd on or off. Only enabled
+    // while a connection has replies the socket could not take yet.
+    void watch_writable(int fd, bool enabled);
+
+    // Blocks for at most timeout_ms (-1 = forever) and returns the number of
+    // ready events; 0 on timeout or when interrupted by a signal.
+    int wait(int timeout_ms);
+
+    // Decodes the i-th event of the last wait() straight from the kernel buffer.
+    PollEvent event(int i) const {
+#if defined(BLINKDB_POLLER_EPOLL)
+        const struct epoll_event& ev = events_[i];
+        return {ev.data.fd,
+                (ev.events & EPOLLIN) != 0,
+                (ev.events & EPOLLOUT) != 0,
+                (ev.events & (EPOLLHUP | EPOLLERR)) != 0};
+#else
+        const struct kevent& ev = events_[i];
+        return {static_cast<int>(ev.ident),
+                ev.filter == EVFILT_READ,
+                ev.filter == EVFILT_WRITE,
+                (ev.flags & (EV_EOF | EV_ERROR)) != 0};
+#endif
+    }
+
+private:
+    int fd_ = -1;
+#if defined(BLINKDB_POLLER_EPOLL)
+    struct epoll_event events_[MAX_EVENTS];
+#else
+    struct kevent events_[MAX_EVENTS];
+#endif
+};
@@ -0,0 +1,215 @@
+#include "resp_parser.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+char* RespParser::prepare(size_t min_space) {
+    if (start_ == end_) {
+        // Everything received so far has been parsed; rewind for free
+        start_ = pos_ = scan_ = end_ = 0;
+    } else if (buf_.size() - end_ < min_space && start_ > 0) {
+        // Slide the partially received request to the front instead of growing.
+        // Only the bytes of that one request move, at most once per refill.
+        size_t pending = end_ - start_;
+        memmove(buf_.data(), buf_.data() + start_, pending);
+        pos_ -= start_;
+        scan_ -= start_;
+        end_ = pending;
+        start_ = 0;
+    }
+    if (buf_.size() - end_ < min_space) {
+        buf_.resize(std::max(buf_.size() * 2, end_ + min_space));
+    }
+    return buf_.data() + end_;
+}
+
+size_t RespParser::find_crlf() {
+    scan_ = std::max(scan_, pos_);
+    while (scan_ < end_) {
+        const char* cr = static_cast<const char*>(
+            memchr(buf_.data() + scan_, '\r', end_ - scan_));
+        if (!cr) {
+            scan_ = end_;
+            break;
+        }
+        size_t at = cr - buf_.data();
+        if (at + 1 == end_) {
+            // The '\n' may still be in flight; look at this '\r' again next time
+            scan_ = at;
+            break;
+        }
+        if (buf_[at + 1] == '\n') {
+            return at;
+        }
+        scan_ = at + 1;
+    }
+    return std::string::npos;
+}
+
+size_t RespParser::find_newline() {
+    scan_ = std::max(scan_, pos_);
+    const char* nl = static_cast<const char*>(
+        memchr(buf_.data() + scan_, '\n', end_ - scan_));
+    if (!nl) {
+        scan_ = end_;
+        return std::string::npos;
+    }
+    return nl - buf_.data();
+}
+
+bool RespParser::parse_integer(size_t from, size_t to, long& out) const {
+    bool negative = false;
+    if (from < to && buf_[from] == '-') {
+        negative = true;
+        from++;
+    }
+    if (from == to) return false;
+
+    long value = 0;
+    for (size_t i = from; i < to; i++) {
+        char c = buf_[i];
+        if (c < '0' || c > '9') return false;
+        if (value > (LONG_MAX - (c - '0')) / 10) return false;
+        value = value * 10 + (c - '0');
+    }
+    out = negative ? -value : value;
+    return true;
+}
+
+RespParser::Status RespParser::fail(const char* message) {
+    error_ = message;
+    return Status::Error;
+}
+
+void RespParser::finish(std::vector<std::string_view>& args) {
+    const char* base = buf_.data() + start_;
+    for (const auto& span : spans_) {
+        args.emplace_back(base + span.first, span.second);
+    }
+    spans_.clear();
+    start_ = pos_;
+    state_ = State::Start;
+}
+
+RespParser::Status RespParser::next(std::vector<std::string_view>& args) {
+    args.clear();
+
+    while (true) {
+        switch (state_) {
+        case State::Start: {
+            if (pos_ == end_) return Status::Incomplete;
+            if (buf_[pos_] != '*') {
+                state_ = State::Inline;
+                break;
+            }
+
+            size_t crlf = find_crlf();
+            if (crlf == std::string::npos) {
+                if (end_ - pos_ > MAX_INLINE_LENGTH) {
+                    return fail("Protocol error: too big mbulk count string");
+                }
+                return Status::Incomplete;
+            }
+            long count;
+            if (!parse_integer(pos_ + 1, crlf, count) || count > MAX_MULTIBULK_LENGTH) {
+                return fail("Protocol error: invalid multibulk length");
+            }
+            pos_ = crlf + 2;
+            if (count <= 0) {
+                // Empty or null arrays carry no command
+                start_ = pos_;
+                break;
+            }
+            args_left_ = count;
+            spans_.clear();
+            state_ = State::BulkHeader;
+            break;
+        }
+
+        case State::BulkHeader: {
+            if (pos_ == end_) return Status::Incomplete;
+            if (buf_[pos_] != '$') {
+                return fail("Protocol error: expected '$'");
+            }
+
+            size_t crlf = find_crlf();
+            if (crlf == std::string::npos) {
+                if (end_ - pos_ > MAX_INLINE_LENGTH) {
+                    return fail("Protocol error: too big bulk count string");
+                }
+                return Status::Incomplete;
+            }
+            long len;
+            if (!parse_integer(pos_ + 1, crlf, len) ||
+                len > static_cast<long>(MAX_BULK_LENGTH)) {
+                return fail("Protocol error: invalid bulk length");
+            }
+            pos_ = crlf + 2;
+            if (len < 0) {
+                // Null bulk string, passed on as an empty argument
+                spans_.emplace_back(pos_ - start_, 0);
+                if (--args_left_ == 0) {
+                    finish(args);
+                    return Status::Ok;
+                }
+                break;
+            }
+            bulk_len_ = len;
+            state_ = State::BulkBody;
+            break;
+        }
+
+        case State::BulkBody: {
+            size_t needed = static_cast<size_t>(bulk_len_) + 2;
+            if (end_ - pos_ < needed) return Status::Incomplete;
+            if (buf_[pos_ + bulk_len_] != '\r' || buf_[pos_ + bulk_len_ + 1] != '\n') {
+                return fail("Protocol error: expected CRLF after bulk string");
+            }
+            spans_.emplace_back(pos_ - start_, static_cast<size_t>(bulk_len_));
+            pos_ += needed;
+            if (--args_left_ == 0) {
+                finish(args);
+                return Status::Ok;
+            }
+            state_ = State::BulkHeader;
+            break;
+        }
+
+        case State::Inline: {
+            size_t nl = find_newline();
+            if (nl == std::string::npos) {
+                if (end_ - pos_ > MAX_INLINE_LENGTH) {
+                    return fail("Protocol error: too big inline request");
+                }
+                return Status::Incomplete;
+            }
+            size_t line_end = nl;
+            if (line_end > pos_ && buf_[line_end - 1] == '\r') {
+                line_end--;
+            }
+
+            // Split on spaces and tabs
+            spans_.clear();
+            size_t i = pos_;
+            while (i < line_end) {
+                while (i < line_end && (buf_[i] == ' ' || buf_[i] == '\t')) i++;
+                size_t word = i;
+                while (i < line_end && buf_[i] != ' ' && buf_[i] != '\t') i++;
+                if (i > word) {
+                    spans_.emplace_back(word - start_, i - word);
+                }
+            }
+            pos_ = nl + 1;
+
+            if (spans_.empty()) {
+                // Blank line
+                start_ = pos_;
+                state_ = State::Start;
+                break;
+            }
+            finish(args);
+            return Status::Ok;
+        }
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Incremental RESP request parser that owns a connection's read buffer.
+//
+// Bytes are read from the socket straight into the buffer (prepare/commit) and
+// next() parses them in place behind a read cursor. Parsing is resumable: when
+// a request is split across reads the parser remembers how far it got, so each
+// byte is scanned once no matter how the stream is fragmented. Arguments come
+// back as string_views into the buffer; they stay valid until the next call to
+// prepare().
+//
+// Both multi-bulk requests (*N\r\n$len\r\n...) and inline commands (PING\r\n)
+// are accepted.
+class RespParser {
+public:
+    enum class Status {
+        Ok,          // A complete request was stored in args
+        Incomplete,  // Need more bytes
+        Error        // Malformed input; error() describes it
+    };
+
+    static constexpr size_t MAX_BULK_LENGTH = 512 * 1024 * 1024;
+    static constexpr long MAX_MULTIBULK_LENGTH = 1024 * 1024;
+    static constexpr size_t MAX_INLINE_LENGTH = 64 * 1024;
+
+    // Returns a pointer to at least min_space writable bytes at the end of the
+    // buffered data. Invalidates previously returned argument views.
+    char* prepare(size_t min_space);
+    // Marks n bytes written through the pointer from prepare() as received.
+    void commit(size_t n) { end_ += n; }
+
+    // Parses the next request. args is cleared and refilled; its capacity is
+    // reused, so steady-state parsing does not allocate.
+    Status next(std::vector<std::string_view>& args);
+
+    const std::string& error() const { return error_; }
+    size_t buffered() const { return end_ - start_; }
+
+private:
+    enum class State {
+        Start,       // Expecting '*' or an inline command
+        BulkHeader,  // Expecting "$<len>\r\n"
+        BulkBody,    // Expecting <len> bytes followed by "\r\n"
+        Inline       // Scanning an inline command for its terminator
+    };
+
+    std::vector<char> buf_;
+    size_t start_ = 0;  // First byte of the request being parsed
+    size_t pos_ = 0;    // Parse cursor, start_ <= pos_ <= end_
+    size_t end_ = 0;    // One past the last received byte
+    size_t scan_ = 0;   // Where the search for the current line's terminator resumes
+
+    State state_ = State::Start;
+    long args_left_ = 0;
+    long bulk_len_ = 0;
+    // Argument (offset, length) pairs relative to start_, so compaction does
+    // not have to rewrite them
+    std::vector<std::pair<size_t, size_t>> spans_;
+    std::string error_;
+
+    // Finds the "\r\n" ending the line at pos_; returns its offset or npos.
+    size_t find_crlf();
+    // Finds the '\n' ending the inline command at pos_; returns its offset or npos.
+    size_t find_newline();
+    bool parse_integer(size_t from, size_t to, long& out) const;
+    Status fail(const char* message);
+    void finish(std::vector<std::string_view>& args);
+};
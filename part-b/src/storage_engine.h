@@ -1,247 +1,794 @@
 #pragma once
 
+#include <algorithm>
 #include <string>
+#include <string_view>
+#include <cstring>
+#include <new>
 #include <unordered_map>
 #include <mutex>
-#include <list>
+#include <shared_mutex>
 #include <iostream>
-#include <map>
 #include <vector>
 #include <memory>
 #include <thread>
 #include <condition_variable>
 #include <atomic>
-#include <fstream>
+#include <stdexcept>
 #include <filesystem>
-#include <queue>
-#ifdef __APPLE__
-#include <mach-o/dyld.h>
-#endif
+#include <chrono>
+#include <unistd.h>
+#include "disk_storage.h"
+#include "log_record.h"
+#include "log_storage.h"
+#include "lsm_storage.h"
+
+// Which entries the cache gives up when it is over budget.
+//   LRU:    the least recently used; one pass over a large key range (a scan
+//           or bulk load) evicts the whole working set
+//   S3FIFO: new keys enter a small FIFO and only move to the main FIFO if
+//           they are hit again before they reach its end, so one-off keys
+//           leave without touching the main queue. Keys evicted from the
+//           small FIFO are remembered (hash only) and go straight to main
+//           if they come back. Hits only bump a counter, never relink.
+//           (Yang et al., "FIFO queues are all you need for cache eviction")
+//   CLOCK:  second-chance FIFO approximating LRU. A hit only sets the
+//           entry's reference bit; eviction passes over entries with the bit
+//           set (clearing it) and removes the first one without.
+// Under CLOCK and S3FIFO a hit changes nothing but an atomic counter, so
+// get() runs under a shared lock and readers of a shard proceed in
+// parallel; LRU must relink the hit entry and takes the lock exclusively.
+enum class EvictionPolicy {
+    LRU,
+    S3FIFO,
+    CLOCK
+};
+
+// Counted per get() on the cache
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
 
+// Cache bounded by memory rather than entry count (a "maxmemory" budget).
+// Every entry is charged for its key, value and bookkeeping, and inserting
+// evicts entries, chosen by the EvictionPolicy, until the total is back
+// under budget.
+//
+// An entry is a single block: the Node header followed by the key and value
+// bytes. Blocks are rounded up to size classes and recycled per shard, and
+// the key index is an intrusive hash table chained through the nodes, so
+// once the free lists have warmed up, put/evict churn does not call malloc.
 class LRUCache {
 private:
     struct Node {
-        std::string key;
-        std::string value;
-        Node* prev;
-        Node* next;
-        Node(const std::string& k, const std::string& v) 
-            : key(k), value(v), prev(nullptr), next(nullptr) {}
+        Node* prev = nullptr;
+        Node* next = nullptr;
+        Node* chain = nullptr;  // Next node in the same hash bucket
+        size_t hash = 0;
+        uint32_t key_size = 0;
+        uint32_t value_size = 0;
+        uint32_t block_size = 0;  // Bytes allocated for the header and data
+        // S3FIFO: hits since insertion or last demotion, capped at MAX_FREQ.
+        // CLOCK: the reference bit. Set by readers holding the shard lock
+        // shared; a lost update only costs a slightly early eviction.
+        std::atomic<uint8_t> freq{0};
+        bool in_main = false;  // S3FIFO: which queue the node is on
+
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+        const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+        std::string_view key() const { return std::string_view(data(), key_size); }
+        std::string_view value() const { return std::string_view(data() + key_size, value_size); }
     };
 
-    size_t capacity_;
-    std::unordered_map<std::string, Node*> cache_;
-    Node* head_;
-    Node* tail_;
-    std::mutex mutex_;
-
-    void move_to_front(Node* node) {
-        if (node == head_) return;
-        
-        if (node == tail_) {
-            tail_ = node->prev;
-            tail_->next = nullptr;
-        } else {
-            node->prev->next = node->next;
-            node->next->prev = node->prev;
-        }
-        
-        node->prev = nullptr;
-        node->next = head_;
-        head_->prev = node;
-        head_ = node;
+    static constexpr uint8_t MAX_FREQ = 3;
+    // S3FIFO: share of each shard's budget given to the small queue
+    static constexpr size_t SMALL_QUEUE_PERCENT = 10;
+    // Block sizes handed out by NodePool: steps of 16 bytes up to 128, then
+    // four classes per power of two. Larger entries get exact-size blocks
+    // from the heap and are not recycled.
+    static constexpr size_t SIZE_CLASSES[] = {
+        64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+        640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096};
+    static constexpr size_t NUM_SIZE_CLASSES = sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+
+    static size_t block_size_for(size_t key_size, size_t value_size) {
+        size_t bytes = sizeof(Node) + key_size + value_size;
+        const size_t* end = SIZE_CLASSES + NUM_SIZE_CLASSES;
+        const size_t* c = std::lower_bound(SIZE_CLASSES, end, bytes);
+        return c == end ? bytes : *c;
     }
 
-    void evict_lru() {
-        if (tail_) {
-            cache_.erase(tail_->key);
-            Node* temp = tail_;
-            tail_ = tail_->prev;
-            if (tail_) tail_->next = nullptr;
-            delete temp;
+    // Per-shard free lists of node blocks, one per size class. Holds at most
+    // max_free_bytes; blocks freed past that go back to the heap, so a shift
+    // in value sizes cannot strand much memory in the wrong class.
+    class NodePool {
+    public:
+        NodePool() = default;
+        NodePool(const NodePool&) = delete;
+        NodePool& operator=(const NodePool&) = delete;
+        ~NodePool() { trim(); }
+
+        void set_max_free_bytes(size_t bytes) { max_free_bytes_ = bytes; }
+
+        void* allocate(size_t block_size) {
+            int c = class_of(block_size);
+            if (c >= 0 && free_[c] != nullptr) {
+                FreeBlock* block = free_[c];
+                free_[c] = block->next;
+                free_bytes_ -= block_size;
+                return block;
+            }
+            return ::operator new(block_size);
         }
-    }
 
-public:
-    LRUCache(size_t capacity) : capacity_(capacity), head_(nullptr), tail_(nullptr) {}
-    
-    ~LRUCache() {
-        Node* current = head_;
-        while (current) {
-            Node* temp = current;
-            current = current->next;
-            delete temp;
+        void release(void* p, size_t block_size) {
+            int c = class_of(block_size);
+            if (c < 0 || free_bytes_ + block_size > max_free_bytes_) {
+                ::operator delete(p);
+                return;
+            }
+            FreeBlock* block = static_cast<FreeBlock*>(p);
+            block->next = free_[c];
+            free_[c] = block;
+            free_bytes_ += block_size;
+        }
+
+        // Returns every free block to the heap
+        void trim() {
+            for (FreeBlock*& head : free_) {
+                while (head != nullptr) {
+                    FreeBlock* next = head->next;
+                    ::operator delete(head);
+                    head = next;
+                }
+            }
+            free_bytes_ = 0;
+        }
+
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        // Index of the class exactly block_size bytes long, or -1
+        static int class_of(size_t block_size) {
+            const size_t* end = SIZE_CLASSES + NUM_SIZE_CLASSES;
+            const size_t* c = std::lower_bound(SIZE_CLASSES, end, block_size);
+            return c != end && *c == block_size ? static_cast<int>(c - SIZE_CLASSES) : -1;
         }
-    }
 
-    size_t capacity() const { return capacity_; }
-    size_t size() const { return cache_.size(); }
+        FreeBlock* free_[NUM_SIZE_CLASSES] = {};
+        size_t free_bytes_ = 0;
+        size_t max_free_bytes_ = 0;
+    };
+
+    // Chained hash table over nodes that already carry their hash and chain
+    // pointer, so indexing an entry allocates nothing. Grows at load factor 1.
+    class NodeTable {
+    public:
+        static constexpr size_t INITIAL_BUCKETS = 16;
+
+        NodeTable() : buckets_(INITIAL_BUCKETS, nullptr) {}
 
-    bool get(const std::string& key, std::string& value) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        auto it = cache_.find(key);
-        if (it != cache_.end()) {
-            move_to_front(it->second);
-            value = it->second->value;
+        size_t size() const { return count_; }
+
+        Node* find(std::string_view key, size_t hash) const {
+            for (Node* node = buckets_[hash & (buckets_.size() - 1)]; node; node = node->chain) {
+                if (node->hash == hash && node->key() == key) {
+                    return node;
+                }
+            }
+            return nullptr;
+        }
+
+        void insert(Node* node) {
+            if (count_ >= buckets_.size()) {
+                rehash(buckets_.size() * 2);
+            }
+            Node*& bucket = buckets_[node->hash & (buckets_.size() - 1)];
+            node->chain = bucket;
+            bucket = node;
+            count_++;
+        }
+
+        void erase(Node* node) {
+            Node** link = &buckets_[node->hash & (buckets_.size() - 1)];
+            while (*link != node) {
+                link = &(*link)->chain;
+            }
+            *link = node->chain;
+            count_--;
+        }
+
+        // Puts fresh where old was; both carry the same key
+        void replace(Node* old, Node* fresh) {
+            Node** link = &buckets_[old->hash & (buckets_.size() - 1)];
+            while (*link != old) {
+                link = &(*link)->chain;
+            }
+            fresh->chain = old->chain;
+            *link = fresh;
+        }
+
+        // Forgets every node (without freeing them) and shrinks back
+        void reset() {
+            std::vector<Node*>(INITIAL_BUCKETS, nullptr).swap(buckets_);
+            count_ = 0;
+        }
+
+    private:
+        void rehash(size_t bucket_count) {
+            std::vector<Node*> buckets(bucket_count, nullptr);
+            for (Node* head : buckets_) {
+                while (head != nullptr) {
+                    Node* next = head->chain;
+                    Node*& bucket = buckets[head->hash & (bucket_count - 1)];
+                    head->chain = bucket;
+                    bucket = head;
+                    head = next;
+                }
+            }
+            buckets_.swap(buckets);
+        }
+
+        std::vector<Node*> buckets_;  // Size is a power of two
+        size_t count_ = 0;
+    };
+
+    // S3FIFO: hashes of keys recently evicted from the small queue, oldest
+    // first, with a multiset over them for lookups. A ring buffer plus an
+    // open-addressed table of counts; both only grow, when the shard holds
+    // more entries than ever before, so steady churn allocates nothing.
+    class GhostSet {
+    public:
+        // Adds hash, then forgets the oldest hashes until at most limit remain
+        void push(size_t hash, size_t limit) {
+            if (count_ == ring_.size()) {
+                grow();
+            }
+            ring_[(head_ + count_) & (ring_.size() - 1)] = hash;
+            count_++;
+            add(hash);
+            while (count_ > limit) {
+                take(ring_[head_]);
+                head_ = (head_ + 1) & (ring_.size() - 1);
+                count_--;
+            }
+        }
+
+        // Removes one copy of hash; true if there was one
+        bool take(size_t hash) {
+            if (slots_.empty()) return false;
+            size_t mask = slots_.size() - 1;
+            size_t i = hash & mask;
+            while (slots_[i].count != 0 && slots_[i].hash != hash) {
+                i = (i + 1) & mask;
+            }
+            if (slots_[i].count == 0) return false;
+            if (--slots_[i].count == 0) {
+                erase_slot(i);
+            }
             return true;
         }
-        return false;
-    }
 
-    bool put(const std::string& key, const std::string& value) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        auto it = cache_.find(key);
-        if (it != cache_.end()) {
-            it->second->value = value;
-            move_to_front(it->second);
+        void clear() {
+            std::vector<size_t>().swap(ring_);
+            std::vector<Slot>().swap(slots_);
+            head_ = count_ = 0;
+        }
+
+    private:
+        struct Slot {
+            size_t hash = 0;
+            size_t count = 0;  // 0 marks an empty slot
+        };
+
+        static constexpr size_t INITIAL_RING = 16;
+
+        void add(size_t hash, size_t copies = 1) {
+            size_t mask = slots_.size() - 1;
+            size_t i = hash & mask;
+            while (slots_[i].count != 0 && slots_[i].hash != hash) {
+                i = (i + 1) & mask;
+            }
+            slots_[i].hash = hash;
+            slots_[i].count += copies;
+        }
+
+        // Empties slot i, shifting later entries of its probe run back so
+        // lookups never stop early at the gap
+        void erase_slot(size_t i) {
+            size_t mask = slots_.size() - 1;
+            for (size_t j = (i + 1) & mask; slots_[j].count != 0; j = (j + 1) & mask) {
+                size_t home = slots_[j].hash & mask;
+                // Move j into the gap unless its home lies in (i, j]
+                bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+                if (!stays) {
+                    slots_[i] = slots_[j];
+                    i = j;
+                }
+            }
+            slots_[i] = Slot();
+        }
+
+        // Doubles the ring and rebuilds the table at half load
+        void grow() {
+            std::vector<size_t> ring(std::max(INITIAL_RING, ring_.size() * 2));
+            for (size_t n = 0; n < count_; n++) {
+                ring[n] = ring_[(head_ + n) & (ring_.size() - 1)];
+            }
+            ring_.swap(ring);
+            head_ = 0;
+            std::vector<Slot> slots(ring_.size() * 2);
+            slots_.swap(slots);
+            for (const Slot& slot : slots) {
+                if (slot.count != 0) {
+                    add(slot.hash, slot.count);
+                }
+            }
+        }
+
+        std::vector<size_t> ring_;  // Size is a power of two
+        size_t head_ = 0;
+        size_t count_ = 0;
+        std::vector<Slot> slots_;   // Twice the ring's size
+    };
+
+    // Doubly-linked queue, most recently inserted at head
+    struct Queue {
+        Node* head = nullptr;
+        Node* tail = nullptr;
+        size_t bytes = 0;
+
+        void push_front(Node* node, size_t cost) {
+            node->prev = nullptr;
+            node->next = head;
+            if (head) head->prev = node;
+            else tail = node;
+            head = node;
+            bytes += cost;
+        }
+
+        void unlink(Node* node, size_t cost) {
+            if (node->prev) node->prev->next = node->next;
+            else head = node->next;
+            if (node->next) node->next->prev = node->prev;
+            else tail = node->prev;
+            bytes -= cost;
+        }
+
+        // Puts fresh at old's position
+        void replace(Node* old, Node* fresh, size_t old_cost, size_t fresh_cost) {
+            fresh->prev = old->prev;
+            fresh->next = old->next;
+            if (old->prev) old->prev->next = fresh;
+            else head = fresh;
+            if (old->next) old->next->prev = fresh;
+            else tail = fresh;
+            bytes = bytes - old_cost + fresh_cost;
+        }
+    };
+
+    // One independently locked cache. Keys are spread across shards by
+    // hash, so threads touching different keys rarely contend on a lock.
+    // Aligned to a cache line so neighbouring shards' mutexes don't false-share.
+    struct alignas(64) Shard {
+        EvictionPolicy policy_ = EvictionPolicy::LRU;
+        size_t max_bytes_ = 0;
+        size_t small_max_bytes_ = 0;
+        NodeTable table_;
+        NodePool pool_;
+        Queue main_;   // LRU: the whole LRU list, most recent at head. CLOCK:
+                       // the ring, with the hand at tail
+        Queue small_;  // S3FIFO only
+        // S3FIFO: hashes of keys recently evicted from small_, oldest first.
+        // Holds at most as many hashes as the shard holds entries; not
+        // charged to the budget.
+        GhostSet ghost_;
+        std::atomic<uint64_t> hits_{0};
+        std::atomic<uint64_t> misses_{0};
+        mutable std::shared_mutex mutex_;
+
+        ~Shard() {
+            clear_locked();
+        }
+
+        size_t bytes() const {
+            return main_.bytes + small_.bytes;
+        }
+
+        static size_t cost(const Node* node) {
+            return charge(node->block_size);
+        }
+
+        Queue& queue_of(const Node* node) {
+            return node->in_main ? main_ : small_;
+        }
+
+        Node* new_node(std::string_view key, size_t hash, std::string_view value) {
+            size_t block_size = block_size_for(key.size(), value.size());
+            Node* node = new (pool_.allocate(block_size)) Node();
+            node->hash = hash;
+            node->key_size = static_cast<uint32_t>(key.size());
+            node->value_size = static_cast<uint32_t>(value.size());
+            node->block_size = static_cast<uint32_t>(block_size);
+            std::memcpy(node->data(), key.data(), key.size());
+            std::memcpy(node->data() + key.size(), value.data(), value.size());
+            return node;
+        }
+
+        void free_node(Node* node) {
+            size_t block_size = node->block_size;
+            node->~Node();
+            pool_.release(node, block_size);
+        }
+
+        void clear_locked() {
+            for (Queue* queue : {&main_, &small_}) {
+                Node* current = queue->head;
+                while (current) {
+                    Node* temp = current;
+                    current = current->next;
+                    free_node(temp);
+                }
+                *queue = Queue();
+            }
+            table_.reset();
+            pool_.trim();
+            ghost_.clear();
+        }
+
+        // Unlinks node, drops it from the table and frees it
+        void erase(Node* node) {
+            queue_of(node).unlink(node, cost(node));
+            table_.erase(node);
+            free_node(node);
+        }
+
+        // Records a hit on node under the shard's policy. Needs the lock
+        // exclusively for LRU, shared otherwise.
+        void touch(Node* node) {
+            if (policy_ == EvictionPolicy::LRU) {
+                main_.unlink(node, cost(node));
+                main_.push_front(node, cost(node));
+                return;
+            }
+            // Load first so hot entries stop dirtying their cache line once
+            // the counter is saturated
+            uint8_t limit = policy_ == EvictionPolicy::CLOCK ? 1 : MAX_FREQ;
+            uint8_t freq = node->freq.load(std::memory_order_relaxed);
+            if (freq < limit) {
+                node->freq.store(freq + 1, std::memory_order_relaxed);
+            }
+        }
+
+        // Takes one hit away from node; false if it had none
+        static bool spend_hit(Node* node) {
+            uint8_t freq = node->freq.load(std::memory_order_relaxed);
+            if (freq == 0) return false;
+            node->freq.store(freq - 1, std::memory_order_relaxed);
             return true;
         }
 
-        if (cache_.size() >= capacity_) {
-            evict_lru();
+        void remember_evicted(size_t hash) {
+            ghost_.push(hash, std::max<size_t>(table_.size(), 1));
         }
 
-        Node* new_node = new Node(key, value);
-        cache_[key] = new_node;
-        
-        if (!head_) {
-            head_ = tail_ = new_node;
-        } else {
-            new_node->next = head_;
-            head_->prev = new_node;
-            head_ = new_node;
+        // Takes hash out of the ghost set; true if it was there
+        bool forget_evicted(size_t hash) {
+            return ghost_.take(hash);
         }
-        
-        return true;
-    }
 
-    bool remove(const std::string& key) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        auto it = cache_.find(key);
-        if (it != cache_.end()) {
-            Node* node = it->second;
-            if (node == head_) {
-                head_ = node->next;
-                if (head_) head_->prev = nullptr;
-                else tail_ = nullptr;
-            } else if (node == tail_) {
-                tail_ = node->prev;
-                if (tail_) tail_->next = nullptr;
+        // Frees at least one entry or demotes one, never touching keep.
+        // Only called while over budget, which keep alone never is, so there
+        // is always another entry to work on.
+        void evict_one(const Node* keep) {
+            if (policy_ == EvictionPolicy::LRU) {
+                erase(main_.tail);
+                return;
+            }
+            if (policy_ == EvictionPolicy::CLOCK) {
+                // Advance the hand: referenced entries (and keep) go around
+                // again with the bit cleared
+                Node* node = main_.tail;
+                if (spend_hit(node) || node == keep) {
+                    main_.unlink(node, cost(node));
+                    main_.push_front(node, cost(node));
+                } else {
+                    erase(node);
+                }
+                return;
+            }
+            bool from_small = small_.tail != nullptr && small_.tail != keep &&
+                              (small_.bytes > small_max_bytes_ || main_.tail == nullptr || main_.tail == keep);
+            if (from_small) {
+                Node* node = small_.tail;
+                if (node->freq.load(std::memory_order_relaxed) > 0) {
+                    // Hit while on probation: promote
+                    small_.unlink(node, cost(node));
+                    node->freq.store(0, std::memory_order_relaxed);
+                    node->in_main = true;
+                    main_.push_front(node, cost(node));
+                } else {
+                    remember_evicted(node->hash);
+                    erase(node);
+                }
             } else {
-                node->prev->next = node->next;
-                node->next->prev = node->prev;
+                Node* node = main_.tail;
+                if (spend_hit(node) || node == keep) {
+                    // Second chance: back to the head with one less hit
+                    main_.unlink(node, cost(node));
+                    main_.push_front(node, cost(node));
+                } else {
+                    erase(node);
+                }
+            }
+        }
+
+        template <typename Fn>
+        bool read(std::string_view key, size_t hash, Fn& fn) {
+            if (policy_ == EvictionPolicy::LRU) {
+                std::unique_lock<std::shared_mutex> lock(mutex_);
+                return find_locked(key, hash, fn);
             }
-            cache_.erase(key);
-            delete node;
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            return find_locked(key, hash, fn);
+        }
+
+        template <typename Fn>
+        bool find_locked(std::string_view key, size_t hash, Fn& fn) {
+            Node* node = table_.find(key, hash);
+            if (node == nullptr) {
+                misses_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            touch(node);
+            fn(node->value());
+            hits_.fetch_add(1, std::memory_order_relaxed);
             return true;
         }
-        return false;
-    }
-};
 
-class DiskStorage {
-private:
-    std::string data_file_;
-    std::mutex mutex_;
-    std::unordered_map<std::string, std::string> data_;
+        // Returns false if the entry alone exceeds the shard's budget; it is
+        // then not cached, and any older value for key is dropped. Also
+        // false, with nothing changed, if guard() does.
+        template <typename Guard>
+        bool put(std::string_view key, size_t hash, std::string_view value, Guard& guard) {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            if (!guard()) {
+                return false;
+            }
+            size_t block_size = block_size_for(key.size(), value.size());
+            Node* node = table_.find(key, hash);
+            if (charge(block_size) > max_bytes_) {
+                if (node != nullptr) {
+                    erase(node);
+                }
+                return false;
+            }
+
+            if (node != nullptr && node->block_size == block_size) {
+                // Same size class: overwrite in place
+                std::memcpy(node->data() + node->key_size, value.data(), value.size());
+                node->value_size = static_cast<uint32_t>(value.size());
+                touch(node);
+            } else if (node != nullptr) {
+                // Move to a block of the right class, keeping the position
+                Node* fresh = new_node(key, hash, value);
+                fresh->freq.store(node->freq.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                fresh->in_main = node->in_main;
+                queue_of(node).replace(node, fresh, cost(node), cost(fresh));
+                table_.replace(node, fresh);
+                free_node(node);
+                node = fresh;
+                touch(node);
+            } else {
+                node = new_node(key, hash, value);
+                table_.insert(node);
+                // LRU and CLOCK keep everything on main_; S3FIFO admits to
+                // small_ unless the key was evicted from there recently
+                node->in_main = policy_ != EvictionPolicy::S3FIFO || forget_evicted(hash);
+                queue_of(node).push_front(node, cost(node));
+            }
 
-    std::filesystem::path get_executable_path() {
-        #ifdef __APPLE__
-            char path[1024];
-            uint32_t size = sizeof(path);
-            if (_NSGetExecutablePath(path, &size) == 0) {
-                return std::filesystem::path(path).parent_path();
+            while (bytes() > max_bytes_) {
+                evict_one(node);
             }
-        #else
-            char result[PATH_MAX];
-            ssize_t count = readlink("/proc/self/exe", result, sizeof(result));
-            if (count != -1) {
-                return std::filesystem::path(result).parent_path();
+            return true;
+        }
+
+        template <typename Guard>
+        bool remove(std::string_view key, size_t hash, Guard& guard) {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            Node* node = table_.find(key, hash);
+            if (!guard(node != nullptr)) {
+                return false;
             }
-        #endif
-        return std::filesystem::current_path();
+            if (node != nullptr) {
+                erase(node);
+                return true;
+            }
+            return false;
+        }
+    };
+
+    size_t max_bytes_;
+    EvictionPolicy policy_;
+    size_t shard_mask_;
+    std::unique_ptr<Shard[]> shards_;
+
+    static size_t hash_key(std::string_view key) {
+        return std::hash<std::string_view>{}(key);
     }
 
-    void ensure_directory_exists() {
-        std::filesystem::path exe_path = get_executable_path();
-        std::filesystem::path storage_dir = exe_path / "disk_storage";
-        std::filesystem::create_directories(storage_dir);
+    Shard& shard_for(size_t hash) {
+        // The shard tables bucket on the low bits of the same hash; pick the
+        // shard from the high bits so each shard's buckets stay evenly used
+        hash ^= hash >> 32;
+        hash *= 0x9E3779B97F4A7C15ULL;
+        return shards_[(hash >> 40) & shard_mask_];
     }
 
-    void load_data() {
-        std::ifstream file(data_file_);
-        if (!file.is_open()) return;
+    // A block plus its share of the table: one bucket slot, doubled because
+    // the table can be half empty right after it grows
+    static size_t charge(size_t block_size) {
+        return block_size + 2 * sizeof(Node*);
+    }
 
-        std::string line;
-        while (std::getline(file, line)) {
-            size_t pos = line.find('=');
-            if (pos != std::string::npos) {
-                std::string key = line.substr(0, pos);
-                std::string value = line.substr(pos + 1);
-                data_[key] = value;
-            }
+public:
+    static constexpr size_t DEFAULT_SHARDS = 16;
+    // Smallest budget worth giving a shard of its own
+    static constexpr size_t MIN_SHARD_BYTES = 1024 * 1024;
+    // Free node blocks each shard may keep for reuse, as a share of its
+    // budget; held on top of the budget
+    static constexpr size_t POOL_PERCENT = 5;
+
+    // Memory charged for one cached entry
+    static size_t entry_bytes(size_t key_size, size_t value_size) {
+        return charge(block_size_for(key_size, value_size));
+    }
+
+    // num_shards is rounded down to a power of two and reduced so each shard
+    // gets at least MIN_SHARD_BYTES, so small caches keep close to exact
+    // eviction order. Each shard holds an equal slice of the budget and
+    // evicts on its own. A budget of 0 caches nothing.
+    LRUCache(size_t max_bytes, EvictionPolicy policy = EvictionPolicy::LRU,
+             size_t num_shards = DEFAULT_SHARDS)
+        : max_bytes_(max_bytes), policy_(policy) {
+        size_t limit = std::max<size_t>(1, std::min(num_shards, max_bytes / MIN_SHARD_BYTES));
+        size_t count = 1;
+        while (count * 2 <= limit) {
+            count *= 2;
+        }
+        shard_mask_ = count - 1;
+        shards_ = std::make_unique<Shard[]>(count);
+        for (size_t i = 0; i < count; i++) {
+            shards_[i].policy_ = policy;
+            shards_[i].max_bytes_ = max_bytes / count;
+            shards_[i].small_max_bytes_ = shards_[i].max_bytes_ * SMALL_QUEUE_PERCENT / 100;
+            shards_[i].pool_.set_max_free_bytes(shards_[i].max_bytes_ * POOL_PERCENT / 100);
         }
-        file.close();
     }
 
-    void save_data() {
-        std::ofstream file(data_file_);
-        if (!file.is_open()) return;
+    size_t max_bytes() const { return max_bytes_; }
+    EvictionPolicy policy() const { return policy_; }
+    size_t shard_count() const { return shard_mask_ + 1; }
 
-        for (const auto& [key, value] : data_) {
-            file << key << "=" << value << "\n";
+    size_t size() const {
+        size_t total = 0;
+        for (size_t i = 0; i <= shard_mask_; i++) {
+            std::shared_lock<std::shared_mutex> lock(shards_[i].mutex_);
+            total += shards_[i].table_.size();
         }
-        file.close();
+        return total;
     }
 
-public:
-    DiskStorage() {
-        try {
-            ensure_directory_exists();
-            std::filesystem::path exe_path = get_executable_path();
-            data_file_ = (exe_path / "disk_storage" / "data.txt").string();
-            load_data();
-        } catch (const std::exception& e) {
-            // If loading fails, start with empty data
-            data_.clear();
+    // Bytes charged for the cached entries
+    size_t memory_used() const {
+        size_t total = 0;
+        for (size_t i = 0; i <= shard_mask_; i++) {
+            std::shared_lock<std::shared_mutex> lock(shards_[i].mutex_);
+            total += shards_[i].bytes();
         }
+        return total;
     }
 
-    ~DiskStorage() {
-        save_data();
+    // Hits and misses since construction; clear() does not reset them
+    CacheStats stats() const {
+        CacheStats total;
+        for (size_t i = 0; i <= shard_mask_; i++) {
+            total.hits += shards_[i].hits_.load(std::memory_order_relaxed);
+            total.misses += shards_[i].misses_.load(std::memory_order_relaxed);
+        }
+        return total;
     }
 
-    bool get(const std::string& key, std::string& value) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        auto it = data_.find(key);
-        if (it != data_.end()) {
-            value = it->second;
-            return true;
+    void clear() {
+        for (size_t i = 0; i <= shard_mask_; i++) {
+            std::unique_lock<std::shared_mutex> lock(shards_[i].mutex_);
+            shards_[i].clear_locked();
         }
-        return false;
     }
 
-    bool put(const std::string& key, const std::string& value) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        data_[key] = value;
-        save_data();
-        return true;
+    bool get(std::string_view key, std::string& value) {
+        return read(key, [&value](std::string_view cached) { value.assign(cached); });
+    }
+
+    // Calls fn(std::string_view value) with the cached value, without
+    // copying it, while the shard lock is held. fn must not use the cache.
+    template <typename Fn>
+    bool read(std::string_view key, Fn&& fn) {
+        size_t hash = hash_key(key);
+        return shard_for(hash).read(key, hash, fn);
+    }
+
+    bool put(std::string_view key, std::string_view value) {
+        return put(key, value, [] { return true; });
+    }
+
+    // Calls guard() under the shard lock before storing; if it returns false
+    // the cache is left as it was. Lets a caller order the update against
+    // something else done under the same lock.
+    template <typename Guard>
+    bool put(std::string_view key, std::string_view value, Guard&& guard) {
+        size_t hash = hash_key(key);
+        return shard_for(hash).put(key, hash, value, guard);
     }
 
-    void remove(const std::string& key) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        data_.erase(key);
-        save_data();
+    bool remove(std::string_view key) {
+        return remove(key, [](bool) { return true; });
+    }
+
+    // Like put(): guard(cached), told whether key is cached, runs under the
+    // shard lock first and can veto the removal
+    template <typename Guard>
+    bool remove(std::string_view key, Guard&& guard) {
+        size_t hash = hash_key(key);
+        return shard_for(hash).remove(key, hash, guard);
     }
 };
 
+// When writes reach stable storage.
+//   Always:   each SET/DEL reply is held until an fsync covers it; concurrent
+//             writes are grouped so one fsync serves the whole batch
+//   Interval: fsync at most every N ms in the background (Redis "everysec")
+//   Never:    leave flushing to the OS
+enum class FsyncPolicy {
+    Always,
+    Interval,
+    Never
+};
+
 class StorageEngine {
 public:
-    StorageEngine(size_t cache_size = 1) 
-        : cache_(std::make_unique<LRUCache>(cache_size))
+    // Default bounds on memory held by writes waiting for the disk; see
+    // set_write_backlog_limits()
+    static constexpr size_t DEFAULT_BACKLOG_HIGH_WATER = 64 * 1024 * 1024;
+    static constexpr size_t DEFAULT_BACKLOG_LOW_WATER = 32 * 1024 * 1024;
+    // Default memory budget of the value cache; see LRUCache
+    static constexpr size_t DEFAULT_CACHE_BYTES = 256 * 1024 * 1024;
+
+    // data_dir: where the disk engine keeps its files; empty for
+    // disk_storage/ next to the executable
+    StorageEngine(size_t cache_bytes = DEFAULT_CACHE_BYTES, FsyncPolicy fsync_policy = FsyncPolicy::Interval,
+                  unsigned fsync_interval_ms = 1000, EvictionPolicy eviction = EvictionPolicy::LRU,
+                  DiskEngine disk_engine = DiskEngine::Log, const std::filesystem::path& data_dir = {})
+        : cache_(std::make_unique<LRUCache>(cache_bytes, eviction))
+        , write_ring_(std::make_unique<RingSlot[]>(WRITE_RING_SIZE))
+        , fsync_policy_(fsync_policy)
+        , fsync_interval_(fsync_interval_ms)
+        // Polling only pays off when the writer has a core of its own
+        , spin_limit_(std::thread::hardware_concurrency() > 1 ? MIN_WRITER_SPIN : 0)
         , running_(false) {
+        for (size_t i = 0; i < WRITE_RING_SIZE; i++) {
+            write_ring_[i].seq.store(i, std::memory_order_relaxed);
+        }
         try {
-            disk_storage_ = std::make_unique<DiskStorage>();
+            if (disk_engine == DiskEngine::LSM) {
+                disk_storage_ = std::make_unique<LsmStorage>(LsmStorage::DEFAULT_MEMTABLE_BYTES, data_dir);
+            } else {
+                disk_storage_ = std::make_unique<LogStorage>(LogStorage::DEFAULT_SEGMENT_BYTES, data_dir);
+            }
             running_ = true;
             write_thread_ = std::thread(&StorageEngine::async_write_worker, this);
         } catch (const std::exception& e) {
@@ -251,20 +798,18 @@ public:
     }
     
     ~StorageEngine() {
-        if (running_) {
-            running_ = false;
-            write_cv_.notify_one();
-            if (write_thread_.joinable()) {
-                write_thread_.join();
-            }
+        stop_async_writer();
+        force_flush();  // Writes the worker had not reached yet
+        if (fsync_policy_ != FsyncPolicy::Never && !disk_storage_->sync()) {
+            std::cerr << "StorageEngine: final fsync failed; recent writes may be lost" << std::endl;
         }
     }
     
-    bool set(const std::string& key, const std::string& value) {
+    bool set(std::string_view key, std::string_view value) {
         return put(key, value);
     }
     
-    std::string get(const std::string& key) {
+    std::string get(std::string_view key) {
         std::string value;
         if (get(key, value)) {
             return value;
@@ -272,119 +817,653 @@ public:
         return "";
     }
     
-    bool get(const std::string& key, std::string& value) {
-        // First check cache
-        if (cache_->get(key, value)) {
-            return true;
-        }
+    bool get(std::string_view key, std::string& value) {
+        return cache_->get(key, value) || load(key, value);
+    }
 
-        // If not in cache, check disk storage
-        if (disk_storage_->get(key, value)) {
-            // Add to cache
-            cache_->put(key, value);
+    // Calls fn(std::string_view value) with key's value if it has one. A
+    // cached value is passed straight from the cache, under its lock, so fn
+    // must not call back into the engine; anything else is read into a
+    // per-thread buffer first, so a steady stream of reads allocates nothing.
+    template <typename Fn>
+    bool read(std::string_view key, Fn&& fn) {
+        if (cache_->read(key, fn)) {
             return true;
         }
-        return false;
+        thread_local std::string buffer;
+        bool found = load(key, buffer);
+        if (found) {
+            fn(std::string_view(buffer));
+        }
+        if (buffer.capacity() > MAX_READ_BUFFER) {
+            std::string().swap(buffer);  // One huge value should not pin its buffer
+        }
+        return found;
     }
     
-    bool del(const std::string& key) {
-        try {
-            // First check if key exists in either cache or disk
-            std::string value;
-            bool exists = false;
-            
-            // Check cache first
-            if (cache_->get(key, value)) {
-                exists = true;
-                cache_->remove(key);
-            }
-            
-            // Then check disk storage
-            if (disk_storage_->get(key, value)) {
-                exists = true;
-                disk_storage_->remove(key);
-            }
-            
-            return exists;
-        } catch (const std::exception& e) {
-            return false;
+    bool del(std::string_view key) {
+        if (!LogRecord::fits(key.size(), 0)) {
+            return false;  // Could never have been written
+        }
+        std::unique_lock<std::mutex> lock(write_mutex_);
+        wait_for_backlog_space_locked(lock);
+        // The cache only holds live keys, so a cached key is deleted without
+        // looking further. Holding write_mutex_ makes this thread the ring's
+        // consumer, so it drains the ring itself when that is full.
+        bool exists = false;
+        while (true) {
+            drain_ring_locked();
+            bool cached = false;
+            bool pushed = false;
+            cache_->remove(key, [&](bool in_cache) {
+                cached = in_cache;
+                if (!cached && !exists) return false;
+                pushed = push_write(LogRecord::Type::Delete, key, {});
+                return pushed;
+            });
+            if (pushed) {
+                break;
+            }
+            if (cached || exists) {
+                // Ring full: make room as its consumer
+                if (drain_ring_locked() == 0) {
+                    wait_for_ring_head(ring_head_);
+                }
+                continue;
+            }
+            const WriteOp* op = find_unwritten_locked(key);
+            exists = op != nullptr ? op->type == LogRecord::Type::Put : disk_storage_->contains(key);
+            if (!exists) {
+                return false;
+            }
         }
+        lock.unlock();
+        wake_writer();
+        return true;
     }
     
     void clear() {
-        cache_ = std::make_unique<LRUCache>(cache_->capacity());
-        disk_storage_ = std::make_unique<DiskStorage>();
+        // Clear in place: other reactor threads may be using cache_ and
+        // disk_storage_ concurrently, so the objects must not be replaced.
+        // flush_mutex_ first, so a batch the writer already took is either
+        // fully on disk before the truncation or never written.
+        std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        // Drop every write claimed so far, waiting out any still being
+        // filled in; the ring is drained before the cache is cleared, so a
+        // value cached by a dropped write is cleared with the rest
+        uint64_t end = enqueued_.load();
+        while (drain_ring_locked(), ring_head_ < end) {
+            wait_for_ring_head(ring_head_);
+        }
+        write_queue_.clear();
+        queued_.clear();
+        // A batch the disk rejected waits here for its retry; drop it too
+        batch_.clear();
+        in_flight_.clear();
+        backlog_bytes_ -= queue_bytes_ + batch_bytes_;
+        queue_bytes_ = 0;
+        batch_bytes_ = 0;
+        update_backlog_locked();
+        space_cv_.notify_all();
+        cache_->clear();
+        disk_storage_->clear();
+        // Counts as a write, so the writer wakes up to sync the truncation;
+        // the dropped writes are superseded
+        push_barrier_locked();
+        unsynced_ = true;
+        wake_writer();
     }
     
     void force_flush() {
-        std::lock_guard<std::mutex> lock(write_mutex_);
-        while (!write_queue_.empty()) {
-            auto [key, value] = write_queue_.front();
-            write_queue_.pop();
-            disk_storage_->put(key, value);
-        }
+        write_queued();
+    }
+
+    // Position of the most recently queued write. Passing it to wait_durable()
+    // waits for that write and every one queued before it.
+    uint64_t write_position() {
+        return enqueued_.load();
+    }
+
+    // With FsyncPolicy::Always, blocks until the writes up to position are on
+    // stable storage; otherwise returns true at once. False if an fsync that
+    // covered them failed: the OS may have dropped their dirty pages, so they
+    // must not be acknowledged even if a later fsync succeeds.
+    bool wait_durable(uint64_t position) {
+        if (fsync_policy_ != FsyncPolicy::Always) return true;
+        std::unique_lock<std::mutex> lock(write_mutex_);
+        durable_cv_.wait(lock, [this, position] {
+            return synced_ >= position || sync_failed_ >= position || !running_;
+        });
+        return synced_ >= position && sync_failed_ < position;
     }
     
     size_t size() const {
         return cache_->size();
     }
+
+    // Bytes the cache is charged for, never more than its budget
+    size_t cache_memory() const {
+        return cache_->memory_used();
+    }
+
+    // For budget, policy and hit/miss counters
+    const LRUCache& cache() const {
+        return *cache_;
+    }
     
     void sync() {
         force_flush();
     }
     
+    // Writers block once high_water bytes of writes are waiting for the disk.
+    // write_backlogged() turns true at that point and stays true until the
+    // backlog drains to low_water, so callers that can hold back input (the
+    // server stops reading sockets) do so before they would block.
+    void set_write_backlog_limits(size_t high_water, size_t low_water) {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        backlog_high_water_ = std::max<size_t>(high_water, 1);
+        backlog_low_water_ = std::min(low_water, backlog_high_water_.load() - 1);
+        update_backlog_locked();
+        space_cv_.notify_all();
+    }
+
+    bool write_backlogged() const {
+        return backlogged_.load(std::memory_order_relaxed);
+    }
+
+    // Writes waiting for the writer: distinct keys already queued, plus
+    // writes still in the ring
     size_t pending_write_count() const {
         std::lock_guard<std::mutex> lock(const_cast<std::mutex&>(write_mutex_));
-        return write_queue_.size();
+        return write_queue_.size() + static_cast<size_t>(enqueued_.load() - ring_head_);
     }
     
     void stop_async_writer() {
-        running_ = false;
-        write_cv_.notify_one();
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            running_ = false;
+        }
+        {
+            // Orders the store before a parking writer's last check
+            std::lock_guard<std::mutex> lock(park_mutex_);
+            park_cv_.notify_one();
+        }
+        durable_cv_.notify_all();
+        space_cv_.notify_all();
         if (write_thread_.joinable()) {
             write_thread_.join();
         }
     }
     
-    bool put(const std::string& key, const std::string& value) {
-        // First try to put in cache
-        if (cache_->put(key, value)) {
-            // If successful, queue async write to disk
-            {
-                std::lock_guard<std::mutex> lock(write_mutex_);
-                write_queue_.push({key, value});
+    // Hands the write to the writer thread through the ring, without taking
+    // write_mutex_ unless the backlog or the ring is full. The write goes
+    // into the ring under the key's cache shard lock, in the same step as
+    // the cache update, so the cache never disagrees with the order writes
+    // reach the disk. False, and nothing is written, if the key or value is
+    // over the disk format's size limits.
+    bool put(std::string_view key, std::string_view value) {
+        if (!LogRecord::fits(key.size(), value.size())) {
+            return false;
+        }
+        while (true) {
+            if (backlog_bytes_.load(std::memory_order_relaxed) >=
+                backlog_high_water_.load(std::memory_order_relaxed)) {
+                std::unique_lock<std::mutex> lock(write_mutex_);
+                wait_for_backlog_space_locked(lock);
+            }
+            uint32_t drains = ring_drains_.load();
+            // put() is also false when the value is too big to cache, so
+            // whether the write went in is tracked separately
+            bool pushed = false;
+            cache_->put(key, value, [&] {
+                pushed = push_write(LogRecord::Type::Put, key, value);
+                return pushed;
+            });
+            if (pushed) {
+                break;
+            }
+            // Ring full: make some room as its consumer if write_mutex_ is
+            // free. If it is not, its holder or the writer drains the ring
+            // soon, so sleep until it does rather than queue on the lock.
+            std::unique_lock<std::mutex> lock(write_mutex_, std::try_to_lock);
+            if (!lock.owns_lock()) {
+                ring_drains_.wait(drains);
+            } else if (drain_ring_locked(PRODUCER_DRAIN) == 0) {
+                wait_for_ring_head(ring_head_);
             }
-            write_cv_.notify_one();
-            return true;
         }
-
-        // If cache is full, write directly to disk
-        return disk_storage_->put(key, value);
+        wake_writer();
+        return true;
     }
     
 private:
-    void async_write_worker() {
-        while (running_) {
+    // Bounds on how many times the writer polls for new writes before it
+    // parks; see wait_for_work()
+    static constexpr unsigned MIN_WRITER_SPIN = 64;
+    static constexpr unsigned MAX_WRITER_SPIN = 8192;
+    // Writes the ring holds before producers have to drain it themselves
+    static constexpr size_t WRITE_RING_SIZE = 65536;
+    // Ring positions a producer that finds the ring full drains itself
+    static constexpr size_t PRODUCER_DRAIN = 256;
+    // Ring positions the writer drains per hold of write_mutex_
+    static constexpr size_t WRITER_DRAIN = 32;
+    // Pause between attempts to write a batch the disk rejected
+    static constexpr std::chrono::milliseconds WRITE_RETRY_DELAY{100};
+    // Largest per-thread buffer read() keeps between calls
+    static constexpr size_t MAX_READ_BUFFER = 1024 * 1024;
+
+    // Approximate memory a queued write holds: the key twice (op and
+    // queued_ map), the value, and container overhead
+    static size_t write_op_bytes(size_t key_size, size_t value_size) {
+        return 2 * key_size + value_size + 96;
+    }
+
+    // Blocks while the backlog is at its high-water mark. An empty queue is
+    // always below it, so a single write larger than the limit still goes in.
+    void wait_for_backlog_space_locked(std::unique_lock<std::mutex>& lock) {
+        space_cv_.wait(lock, [this] { return backlog_bytes_ < backlog_high_water_ || !running_; });
+    }
+
+    void update_backlog_locked() {
+        if (backlog_bytes_ >= backlog_high_water_) {
+            backlogged_ = true;
+        } else if (backlog_bytes_ <= backlog_low_water_) {
+            backlogged_ = false;
+        }
+    }
+
+    // One position of write_ring_, a bounded multi-producer queue (after
+    // Vyukov). seq says whose turn the slot is for position p: claimable
+    // when seq == p, holding p's write once seq == p + 1, and freed for
+    // p + WRITE_RING_SIZE by the consumer.
+    struct alignas(64) RingSlot {
+        std::atomic<uint64_t> seq{0};
+        WriteOp op;
+        bool barrier = false;  // Pushed by clear(); carries no write
+    };
+
+    // Claims the next ring position for the caller to fill in, or returns
+    // nullptr if the ring is full. Taking enqueued_ (sequentially
+    // consistent) also pairs with the writer's parking; see wait_for_work().
+    RingSlot* claim_slot(uint64_t& position) {
+        position = enqueued_.load(std::memory_order_relaxed);
+        while (true) {
+            RingSlot& slot = write_ring_[position & (WRITE_RING_SIZE - 1)];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq == position) {
+                if (enqueued_.compare_exchange_weak(position, position + 1)) {
+                    return &slot;
+                }
+            } else if (seq < position) {
+                return nullptr;  // Still holds the write from one lap back
+            } else {
+                position = enqueued_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Claims a ring position for the write, fills it in and hands it to
+    // the consumer; false if the ring is full. Callers run it under the
+    // key's cache shard lock, which keeps the claimed-but-empty window the
+    // consumer has to wait out short. The backlog is charged first, so the
+    // consumer never credits bytes not yet charged.
+    bool push_write(LogRecord::Type type, std::string_view key, std::string_view value) {
+        uint64_t position;
+        RingSlot* claimed = claim_slot(position);
+        if (claimed == nullptr) {
+            return false;
+        }
+        RingSlot& slot = *claimed;
+        slot.op.type = type;
+        slot.op.key.assign(key);
+        slot.op.value.assign(value);
+        slot.barrier = false;
+        size_t bytes = write_op_bytes(key.size(), value.size());
+        if (backlog_bytes_.fetch_add(bytes) + bytes >= backlog_high_water_.load(std::memory_order_relaxed)) {
+            backlogged_ = true;
+        }
+        slot.seq.store(position + 1, std::memory_order_release);
+        slot.seq.notify_all();  // Only a syscall while a consumer waits on it
+        return true;
+    }
+
+    // Sleeps until position has been filled in, if a producer has claimed
+    // it. Draining stops at such a slot, and the producer may have been
+    // preempted halfway, so waiting here beats spinning on a busy core. An
+    // unclaimed position means the ring emptied meanwhile; waiting for a
+    // producer to come along could then deadlock with producers queued on
+    // write_mutex_, so it returns at once.
+    void wait_for_ring_head(uint64_t position) {
+        if (enqueued_.load() == position) {
+            return;
+        }
+        write_ring_[position & (WRITE_RING_SIZE - 1)].seq.wait(position, std::memory_order_acquire);
+    }
+
+    // A position with no write, so the writer wakes and syncs
+    void push_barrier_locked() {
+        RingSlot* slot;
+        uint64_t position;
+        while ((slot = claim_slot(position)) == nullptr) {
+            if (drain_ring_locked() == 0) {
+                wait_for_ring_head(ring_head_);
+            }
+        }
+        slot->barrier = true;
+        slot->seq.store(position + 1, std::memory_order_release);
+        slot->seq.notify_all();
+    }
+
+    // Moves published writes from the ring into write_queue_, in position
+    // order, stopping at the first slot a producer is still filling in or
+    // after limit positions. Whoever holds write_mutex_ is the ring's
+    // consumer. Returns how many positions it consumed.
+    size_t drain_ring_locked(size_t limit = WRITE_RING_SIZE) {
+        size_t drained = 0;
+        while (drained < limit) {
+            RingSlot& slot = write_ring_[ring_head_ & (WRITE_RING_SIZE - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != ring_head_ + 1) {
+                break;
+            }
+            if (!slot.barrier) {
+                enqueue_locked(slot.op);
+            }
+            slot.seq.store(ring_head_ + WRITE_RING_SIZE, std::memory_order_release);
+            ring_head_++;
+            drained++;
+        }
+        if (drained > 0) {
+            update_backlog_locked();
+            ring_drains_.fetch_add(1);
+            ring_drains_.notify_all();  // Only a syscall while a producer waits
+        }
+        return drained;
+    }
+
+    // Queues a write taken from the ring, folding it into any write to the
+    // same key that is still queued: only the last value (or the delete)
+    // ever reaches the disk.
+    void enqueue_locked(WriteOp& op) {
+        auto it = queued_.find(op.key);
+        if (it == queued_.end()) {
+            queued_.emplace(op.key, write_queue_.size());
+            queue_bytes_ += write_op_bytes(op.key.size(), op.value.size());
+            write_queue_.push_back(std::move(op));
+        } else {
+            // The new write was charged in full when published; the one it
+            // replaces is credited back
+            WriteOp& queued = write_queue_[it->second];
+            size_t replaced = write_op_bytes(queued.key.size(), queued.value.size());
+            backlog_bytes_ -= replaced;
+            queue_bytes_ = queue_bytes_ - replaced + write_op_bytes(op.key.size(), op.value.size());
+            queued.type = op.type;
+            queued.value.swap(op.value);  // The slot keeps the old buffer for reuse
+        }
+    }
+
+    // Called after queueing a write. While the writer is awake it finds the
+    // write on its own, so the common case is one atomic load instead of a
+    // futex wake per request.
+    void wake_writer() {
+        if (writer_parked_.load()) {
+            std::lock_guard<std::mutex> lock(park_mutex_);
+            park_cv_.notify_one();
+        }
+    }
+
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    bool has_work() const {
+        return enqueued_.load() != written_.load(std::memory_order_relaxed) || !running_;
+    }
+
+    // Waits until a write is queued, the deadline (if any) passes or the
+    // engine stops. The writer polls before it parks: under load the next
+    // write arrives within microseconds, and until the writer parks
+    // wake_writer() leaves the condition variable alone. The polling budget
+    // adapts, growing while polling finds work and shrinking while the
+    // writer ends up parking anyway.
+    void wait_for_work(const std::chrono::steady_clock::time_point* deadline) {
+        for (unsigned i = 0; i < spin_limit_; i++) {
+            if (has_work()) {
+                if (i > 0) spin_limit_ = std::min(spin_limit_ * 2, MAX_WRITER_SPIN);
+                return;
+            }
+            cpu_relax();
+        }
+        if (spin_limit_ > 0) {
+            spin_limit_ = std::max(spin_limit_ / 2, MIN_WRITER_SPIN);
+        }
+
+        std::unique_lock<std::mutex> lock(park_mutex_);
+        // Paired with claim_slot()'s advance of enqueued_ and wake_writer()'s
+        // load (all sequentially consistent): either the check below sees the new write or the
+        // producer sees the flag and notifies.
+        writer_parked_ = true;
+        auto ready = [this] { return has_work(); };
+        if (deadline) {
+            park_cv_.wait_until(lock, *deadline, ready);
+        } else {
+            park_cv_.wait(lock, ready);
+        }
+        writer_parked_ = false;
+    }
+
+    // Looks key up past the cache: writes that have not reached the disk
+    // yet, then the disk, caching what it finds there
+    bool load(std::string_view key, std::string& value) {
+        uint64_t position;
+
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            drain_ring_locked();
+            if (const WriteOp* op = find_unwritten_locked(key)) {
+                if (op->type == LogRecord::Type::Delete) {
+                    return false;
+                }
+                value.assign(op->value);
+                return true;
+            }
+            position = ring_head_;
+        }
+
+        // Then the disk
+        if (!disk_storage_->get(key, value)) {
+            return false;
+        }
+        // Add to cache, unless a write claimed since the lookup (or one still
+        // being filled in then) may have superseded it. Writes claim their
+        // position under the same shard lock the check runs under.
+        cache_->put(key, value, [&] { return enqueued_.load() == position; });
+        return true;
+    }
+    
+
+    // The newest write to key not yet on disk, or nullptr
+    const WriteOp* find_unwritten_locked(std::string_view key) const {
+        auto it = queued_.find(key);
+        if (it != queued_.end()) {
+            return &write_queue_[it->second];
+        }
+        it = in_flight_.find(key);
+        if (it != in_flight_.end()) {
+            return &batch_[it->second];
+        }
+        return nullptr;
+    }
+
+    // Takes the whole queue in one lock hold and writes it as one batch.
+    // flush_mutex_ stays held until the batch is on disk so clear() cannot
+    // run in between and let the batch resurrect cleared keys.
+    //
+    // If the disk rejects the batch it stays in batch_, where lookups still
+    // find it and the backlog still counts it, and is retried before
+    // anything queued after it. Rewriting the part that did land is
+    // harmless: the batch holds one write per key. False if the write failed.
+    bool write_queued() {
+        std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+        // Fold the ring in short lock holds so producers that need
+        // write_mutex_ are not held up behind the whole ring. Also done
+        // while a rejected batch waits, so the ring keeps making room.
+        while (true) {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            if (drain_ring_locked(WRITER_DRAIN) < WRITER_DRAIN) break;
+        }
+        {
             std::unique_lock<std::mutex> lock(write_mutex_);
-            write_cv_.wait(lock, [this] { 
-                return !running_ || !write_queue_.empty(); 
-            });
-            
+            if (batch_.empty()) {
+                drain_ring_locked();
+                if (write_queue_.empty()) {
+                    // Barriers, or writes clear() dropped: they count as written
+                    written_ = ring_head_;
+                    uint64_t head = ring_head_;
+                    lock.unlock();
+                    wait_for_ring_head(head);
+                    return true;
+                }
+                // The emptied batch_ becomes the next queue, keeping its
+                // capacity, so a steady load stops allocating once both have grown
+                batch_.swap(write_queue_);
+                in_flight_.swap(queued_);
+                batch_end_ = ring_head_;
+                batch_bytes_ = queue_bytes_;
+                queue_bytes_ = 0;
+            }
+        }
+
+        if (!disk_storage_->write_batch(batch_)) {
+            if (!write_failing_) {
+                std::cerr << "StorageEngine: disk write failed; holding " << batch_.size()
+                          << " writes to retry" << std::endl;
+                write_failing_ = true;
+            }
+            return false;
+        }
+        if (write_failing_) {
+            std::cerr << "StorageEngine: disk writes succeeded again" << std::endl;
+            write_failing_ = false;
+        }
+
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        batch_.clear();
+        in_flight_.clear();
+        written_ = std::max(written_.load(), batch_end_);
+        unsynced_ = true;
+        // The batch stays counted until written, so the bound covers it too
+        backlog_bytes_ -= batch_bytes_;
+        batch_bytes_ = 0;
+        update_backlog_locked();
+        space_cv_.notify_all();
+        return true;
+    }
+
+    void async_write_worker() {
+        auto last_sync = std::chrono::steady_clock::now();
+        while (true) {
+            bool interval_sync_pending;
+            {
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                interval_sync_pending = fsync_policy_ == FsyncPolicy::Interval && unsynced_;
+            }
+            if (interval_sync_pending) {
+                auto deadline = last_sync + fsync_interval_;
+                wait_for_work(&deadline);
+            } else {
+                wait_for_work(nullptr);
+            }
             if (!running_) break;
-            
-            auto [key, value] = write_queue_.front();
-            write_queue_.pop();
-            lock.unlock();
-            
-            disk_storage_->put(key, value);
+
+            // Writers keep queueing while a batch is written, and with
+            // FsyncPolicy::Always they all wait on the single sync that
+            // follows, so batches grow with the load instead of paying one
+            // fsync per write.
+            if (!write_queued()) {
+                // Back off instead of spinning on a failing disk; the backlog
+                // limit holds writers back meanwhile
+                std::this_thread::sleep_for(WRITE_RETRY_DELAY);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(write_mutex_);
+            auto now = std::chrono::steady_clock::now();
+            bool sync_due = fsync_policy_ == FsyncPolicy::Always ||
+                            (fsync_policy_ == FsyncPolicy::Interval && now - last_sync >= fsync_interval_);
+            if (unsynced_ && sync_due) {
+                uint64_t target = written_;
+                unsynced_ = false;
+                lock.unlock();
+                bool ok = disk_storage_->sync();
+                lock.lock();
+                last_sync = now;
+                if (ok) {
+                    synced_ = std::max(synced_, target);
+                } else {
+                    // Fail the writes waiting on this sync and try again
+                    // with the next one
+                    std::cerr << "StorageEngine: fsync failed; writes up to " << target
+                              << " are not durable" << std::endl;
+                    sync_failed_ = std::max(sync_failed_, target);
+                    unsynced_ = true;
+                }
+                durable_cv_.notify_all();
+            }
         }
     }
     
     std::unique_ptr<LRUCache> cache_;
     std::unique_ptr<DiskStorage> disk_storage_;
-    std::queue<std::pair<std::string, std::string>> write_queue_;
+    // Writes handed over by put() and del(), in order, until the consumer
+    // folds them into write_queue_. Positions up to enqueued_ are claimed,
+    // those below ring_head_ consumed.
+    std::unique_ptr<RingSlot[]> write_ring_;
+    uint64_t ring_head_ = 0;  // Guarded by write_mutex_
+    std::atomic<uint32_t> ring_drains_{0};  // Bumped whenever positions are freed
+    // Writes waiting for the writer thread, at most one per key, plus where
+    // each key's write sits in the vector
+    std::vector<WriteOp> write_queue_;
+    StringMap<size_t> queued_;
+    // The batch being written and its key positions; only resized under
+    // both locks, read by lookups under write_mutex_
+    std::vector<WriteOp> batch_;
+    StringMap<size_t> in_flight_;
+    // Where batch_ ends in write order and the backlog bytes it holds,
+    // guarded by flush_mutex_ and write_mutex_
+    uint64_t batch_end_ = 0;
+    size_t batch_bytes_ = 0;
+    size_t queue_bytes_ = 0;  // Backlog bytes held by write_queue_; guarded by write_mutex_
+    bool write_failing_ = false;  // The last write_batch() failed; guarded by flush_mutex_
+    std::mutex flush_mutex_;  // Held from taking a batch until it is on disk
     std::mutex write_mutex_;
-    std::condition_variable write_cv_;
+    std::condition_variable durable_cv_;  // Signalled after each sync
+    std::condition_variable space_cv_;    // Signalled when the backlog shrinks
+    // Bytes held by the ring, write_queue_ and batch_. Producers add to it
+    // without a lock; it only shrinks under write_mutex_.
+    std::atomic<size_t> backlog_bytes_{0};
+    std::atomic<size_t> backlog_high_water_{DEFAULT_BACKLOG_HIGH_WATER};
+    std::atomic<size_t> backlog_low_water_{DEFAULT_BACKLOG_LOW_WATER};
+    std::atomic<bool> backlogged_{false};
+    FsyncPolicy fsync_policy_;
+    std::chrono::milliseconds fsync_interval_;
+    // Write sequence numbers. Producers claim positions by advancing
+    // enqueued_; the rest change under write_mutex_. The first two are
+    // atomic so the writer can poll them without the lock.
+    std::atomic<uint64_t> enqueued_{0};  // Ring positions claimed so far
+    std::atomic<uint64_t> written_{0};   // Of those, handed to disk_storage_ (or dropped by clear)
+    uint64_t synced_ = 0;     // Of those, known to be on stable storage
+    uint64_t sync_failed_ = 0;  // Highest position a failed sync covered
+    bool unsynced_ = false;   // Disk changed since the last sync
+    // Writer wakeup: producers only touch park_mutex_ while the writer is parked
+    std::mutex park_mutex_;
+    std::condition_variable park_cv_;
+    std::atomic<bool> writer_parked_{false};
+    unsigned spin_limit_;  // Writer thread only
     std::thread write_thread_;
     std::atomic<bool> running_;
-}; 
\ No newline at end of file
+};
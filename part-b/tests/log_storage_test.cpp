@@ -0,0 +1,262 @@
+// Tests for LogStorage: a randomized run checked against a std::map across
+// restarts, hint files, merges interrupted at each step of their install,
+// torn and corrupt segment tails, the upgrade of files from before
+// checksums, and writes that survive SIGKILL.
+#include "src/log_storage.h"
+#include "tests/test_util.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <thread>
+
+// The smallest segments LogStorage allows, so a few MB of writes seal
+// many segments and trigger merges
+static constexpr uint64_t SEGMENT_BYTES = 64 * 1024;
+
+static std::string key_for(uint64_t i) {
+    char buf[32];
+    snprintf(buf, sizeof buf, "key%07llu", static_cast<unsigned long long>(i));
+    return buf;
+}
+
+static size_t count_files(const std::filesystem::path& dir, const std::string& extension) {
+    size_t count = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == extension) count++;
+    }
+    return count;
+}
+
+// Hints are written in the background; waits until every segment but the
+// active one has its hint
+static bool wait_for_hints(const std::filesystem::path& dir) {
+    for (int i = 0; i < 500; i++) {
+        if (count_files(dir, ".hint") + 1 >= count_files(dir, ".data")) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+static void matches_a_model_across_restarts(const std::filesystem::path& dir) {
+    std::mt19937_64 rng(1);
+    std::map<std::string, std::string> model;
+    auto db = std::make_unique<LogStorage>(SEGMENT_BYTES, dir);
+    uint64_t ops = 0;
+    for (int round = 0; round < 6; round++) {
+        // Reads racing hint writes and merges never find keys never written
+        std::atomic<bool> stop{false};
+        std::atomic<bool> phantom{false};
+        std::thread reader([&] {
+            std::string value;
+            for (uint64_t i = 0; !stop; i++) {
+                if (db->get(key_for(5000000 + i % 1000), value)) phantom = true;
+                db->get(key_for(i % 20000), value);
+            }
+        });
+        for (int b = 0; b < 200; b++) {
+            std::vector<WriteOp> batch;
+            int n = 1 + rng() % 100;
+            for (int i = 0; i < n; i++, ops++) {
+                std::string key = key_for(rng() % 20000);
+                if (rng() % 5 == 0) {
+                    batch.push_back({LogRecord::Type::Delete, key, ""});
+                    model.erase(key);
+                } else {
+                    std::string value(rng() % 300, static_cast<char>('a' + rng() % 26));
+                    value += std::to_string(ops);
+                    batch.push_back({LogRecord::Type::Put, key, value});
+                    model[key] = value;
+                }
+            }
+            CHECK(db->write_batch(batch));
+        }
+        stop = true;
+        reader.join();
+        CHECK(!phantom);
+
+        if (round == 3) {
+            db->clear();
+            model.clear();
+        }
+        // Restart: sealed segments load from their hints, the rest are scanned
+        db.reset();
+        db = std::make_unique<LogStorage>(SEGMENT_BYTES, dir);
+        size_t lost = 0, resurrected = 0;
+        for (uint64_t i = 0; i < 20000; i++) {
+            std::string key = key_for(i), value;
+            auto it = model.find(key);
+            bool found = db->get(key, value);
+            if (it != model.end() && (!found || value != it->second)) lost++;
+            if (it == model.end() && found) resurrected++;
+        }
+        CHECK(lost == 0);
+        CHECK(resurrected == 0);
+    }
+}
+
+static void damaged_hints_fall_back_to_the_segment(const std::filesystem::path& dir) {
+    std::map<std::string, std::string> model;
+    {
+        LogStorage db(SEGMENT_BYTES, dir);
+        for (uint64_t i = 0; i < 2000; i++) {
+            std::string key = key_for(i % 1500);
+            if (i % 11 == 0) {
+                db.remove(key);
+                model.erase(key);
+            } else {
+                model[key] = std::string(400, 'h') + std::to_string(i);
+                CHECK(db.put(key, model[key]));
+            }
+        }
+        CHECK(wait_for_hints(dir));
+    }
+    CHECK(count_files(dir, ".hint") >= 4);
+
+    // One hint loses its tail, one has a flipped byte; both must be ignored
+    std::vector<std::filesystem::path> hints;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == ".hint") hints.push_back(entry.path());
+    }
+    std::sort(hints.begin(), hints.end());
+    std::filesystem::resize_file(hints[0], std::filesystem::file_size(hints[0]) / 2);
+    flip_byte(hints[1], 10);
+
+    LogStorage db(SEGMENT_BYTES, dir);
+    for (uint64_t i = 0; i < 1500; i++) {
+        std::string key = key_for(i), value;
+        auto it = model.find(key);
+        bool found = db.get(key, value);
+        CHECK(found == (it != model.end()));
+        if (found && it != model.end()) CHECK(value == it->second);
+    }
+}
+
+static void clear_keeps_an_empty_segment(const std::filesystem::path& dir) {
+    LogStorage db(SEGMENT_BYTES, dir);
+    db.clear();
+    CHECK(std::filesystem::exists(dir / "000001.data"));
+    CHECK(count_files(dir, ".data") == 1);
+    CHECK(db.put("a", "1"));
+    db.clear();
+    CHECK(!std::filesystem::exists(dir / "000001.data"));
+    CHECK(count_files(dir, ".data") == 1);
+    std::string value;
+    CHECK(!db.get("a", value));
+}
+
+// Crashes the process at one step of installing a merge
+class CrashingLogStorage : public LogStorage {
+public:
+    CrashingLogStorage(const std::filesystem::path& dir, int crash_at)
+        : LogStorage(SEGMENT_BYTES, dir), crash_at_(crash_at) {}
+
+protected:
+    void merge_install_step(int renamed) override {
+        if (renamed == crash_at_) _exit(9);
+    }
+
+private:
+    int crash_at_;
+};
+
+// Write i puts value i to key i % KEYS, so the newest value found tells
+// how far the writes got, and every key must hold its last write up to it
+static void interrupted_merges_are_rolled_forward(const std::filesystem::path& root) {
+    constexpr uint64_t KEYS = 5000;
+    // Crash right after MERGE is written, with one output file renamed, and
+    // with the first output fully in place
+    for (int crash_at = 0; crash_at <= 2; crash_at++) {
+        std::filesystem::path dir = root / std::to_string(crash_at);
+        pid_t pid = fork();
+        if (pid == 0) {
+            CrashingLogStorage db(dir, crash_at);
+            for (uint64_t i = 0; i < 3000000; i++) {
+                if (!db.put(numbered_key(i % KEYS), std::to_string(i) + std::string(200, 'v'))) _exit(2);
+            }
+            _exit(3);  // No merge reached the crash point
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 9);
+        CHECK(std::filesystem::exists(dir / "MERGE"));
+        size_t segments = count_files(dir, ".data");
+
+        // Recovery finishes the renames and drops the inputs the outputs replaced
+        LogStorage db(SEGMENT_BYTES, dir);
+        CHECK(!std::filesystem::exists(dir / "MERGE"));
+        CHECK(count_files(dir, ".merge") == 0);
+        CHECK(count_files(dir, ".data") < segments);
+        uint64_t newest = 0;
+        std::string value;
+        for (uint64_t k = 0; k < KEYS; k++) {
+            if (db.get(numbered_key(k), value)) newest = std::max<uint64_t>(newest, std::stoull(value));
+        }
+        CHECK(newest >= KEYS);
+        size_t bad = 0;
+        for (uint64_t k = 0; k < KEYS; k++) {
+            uint64_t last = newest - (newest - k) % KEYS;
+            if (!db.get(numbered_key(k), value) || std::stoull(value) != last) bad++;
+        }
+        CHECK(bad == 0);
+    }
+}
+
+// A data.log from before segments holds Format::V1 records, the last one
+// torn; it becomes the first segment, rewritten in the current format
+static void legacy_log_is_upgraded(const std::filesystem::path& dir) {
+    std::string log;
+    encode_v1_record(log, LogRecord::Type::Put, "a", "old-a");
+    encode_v1_record(log, LogRecord::Type::Put, "b", "bee");
+    encode_v1_record(log, LogRecord::Type::Put, "big", std::string(5000, 'x'));
+    encode_v1_record(log, LogRecord::Type::Put, "a", "new-a");
+    encode_v1_record(log, LogRecord::Type::Delete, "b", "");
+    encode_v1_record(log, LogRecord::Type::Put, "c", "sea");
+    size_t intact = log.size();
+    encode_v1_record(log, LogRecord::Type::Put, "torn", "never acknowledged");
+    log.resize(intact + 12);
+    std::ofstream(dir / "data.log", std::ios::binary) << log;
+
+    auto check = [](LogStorage& db) {
+        std::string value;
+        CHECK(db.get("a", value) && value == "new-a");
+        CHECK(!db.get("b", value));
+        CHECK(db.get("big", value) && value == std::string(5000, 'x'));
+        CHECK(db.get("c", value) && value == "sea");
+        CHECK(!db.get("torn", value));
+    };
+    {
+        LogStorage db(SEGMENT_BYTES, dir);
+        check(db);
+        CHECK(db.put("d", "dee"));
+    }
+    CHECK(!std::filesystem::exists(dir / "data.log"));
+    char magic[8] = {};
+    std::ifstream(dir / "000001.data", std::ios::binary).read(magic, sizeof magic);
+    CHECK(std::memcmp(magic, "BLDBLOGF", sizeof magic) == 0);
+
+    LogStorage db(SEGMENT_BYTES, dir);
+    check(db);
+    std::string value;
+    CHECK(db.get("d", value) && value == "dee");
+}
+
+int main() {
+    run("matches_a_model_across_restarts", matches_a_model_across_restarts);
+    run("damaged_hints_fall_back_to_the_segment", damaged_hints_fall_back_to_the_segment);
+    run("clear_keeps_an_empty_segment", clear_keeps_an_empty_segment);
+    run("interrupted_merges_are_rolled_forward", interrupted_merges_are_rolled_forward);
+    run("damaged_tail_is_dropped", [](const std::filesystem::path& root) {
+        check_damaged_tail_is_dropped(
+            root, [](const std::filesystem::path& dir) { return std::make_unique<LogStorage>(SEGMENT_BYTES, dir); },
+            [](const std::filesystem::path& dir) { return newest_file(dir, ".data"); });
+    });
+    run("legacy_log_is_upgraded", legacy_log_is_upgraded);
+    run("acked_writes_survive_kill", [](const std::filesystem::path& dir) {
+        check_acked_writes_survive_kill([&] { return std::make_unique<LogStorage>(SEGMENT_BYTES, dir); });
+    });
+    return report();
+}
@@ -0,0 +1,222 @@
+// Tests for LsmStorage: a randomized run checked against a std::map across
+// restarts, WAL replay, MANIFEST recovery, writes over the size limits,
+// torn and corrupt WAL tails, files from before checksums, and writes that
+// survive SIGKILL.
+#include "src/lsm_storage.h"
+#include "tests/test_util.h"
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <random>
+#include <thread>
+
+// Small memtables, so a few thousand writes flush and compact many times
+static constexpr size_t MEMTABLE_BYTES = 64 * 1024;
+
+static std::string key_for(uint64_t i) {
+    char buf[32];
+    snprintf(buf, sizeof buf, "key%07llu", static_cast<unsigned long long>(i));
+    return buf;
+}
+
+static void matches_a_model_across_restarts(const std::filesystem::path& dir) {
+    std::mt19937_64 rng(1);
+    std::map<std::string, std::string> model;
+    auto db = std::make_unique<LsmStorage>(MEMTABLE_BYTES, dir);
+    uint64_t ops = 0;
+    bool compacted = false;
+    for (int round = 0; round < 6; round++) {
+        // Reads racing flushes and compactions never find keys never written
+        std::atomic<bool> stop{false};
+        std::atomic<bool> phantom{false};
+        std::thread reader([&] {
+            std::string value;
+            for (uint64_t i = 0; !stop; i++) {
+                if (db->get(key_for(5000000 + i % 1000), value)) phantom = true;
+                db->get(key_for(i % 20000), value);
+            }
+        });
+        for (int b = 0; b < 200; b++) {
+            std::vector<WriteOp> batch;
+            int n = 1 + rng() % 100;
+            for (int i = 0; i < n; i++, ops++) {
+                std::string key = key_for(rng() % 20000);
+                if (rng() % 5 == 0) {
+                    batch.push_back({LogRecord::Type::Delete, key, ""});
+                    model.erase(key);
+                } else {
+                    std::string value(rng() % 300, static_cast<char>('a' + rng() % 26));
+                    value += std::to_string(ops);
+                    batch.push_back({LogRecord::Type::Put, key, value});
+                    model[key] = value;
+                }
+            }
+            CHECK(db->write_batch(batch));
+        }
+        stop = true;
+        reader.join();
+        CHECK(!phantom);
+
+        std::vector<uint64_t> levels = db->level_bytes();
+        for (size_t level = 1; level < levels.size(); level++) {
+            if (levels[level] > 0) compacted = true;
+        }
+        if (round == 3) {
+            db->clear();
+            model.clear();
+        }
+        // Restart: tables come back from the MANIFEST, the memtable from its WAL
+        db.reset();
+        db = std::make_unique<LsmStorage>(MEMTABLE_BYTES, dir);
+        size_t lost = 0, resurrected = 0;
+        for (uint64_t i = 0; i < 20000; i++) {
+            std::string key = key_for(i), value;
+            auto it = model.find(key);
+            bool found = db->get(key, value);
+            if (it != model.end() && (!found || value != it->second)) lost++;
+            if (it == model.end() && found) resurrected++;
+        }
+        CHECK(lost == 0);
+        CHECK(resurrected == 0);
+    }
+    CHECK(compacted);
+}
+
+static void wal_replays_unflushed_writes(const std::filesystem::path& dir) {
+    {
+        LsmStorage db(MEMTABLE_BYTES, dir);
+        CHECK(db.put("a", "1"));
+        CHECK(db.write_batch({{LogRecord::Type::Put, "b", "2"}, {LogRecord::Type::Put, "c", "3"},
+                              {LogRecord::Type::Delete, "a", ""}}));
+        // Still in the memtable: nothing but the WAL has it
+        CHECK(db.level_bytes()[0] == 0);
+    }
+    LsmStorage db(MEMTABLE_BYTES, dir);
+    std::string value;
+    CHECK(!db.get("a", value));
+    CHECK(db.get("b", value) && value == "2");
+    CHECK(db.get("c", value) && value == "3");
+    // Recovery wrote the replayed memtable out as a level-0 table
+    CHECK(db.level_bytes()[0] > 0);
+}
+
+static void manifest_recovery_deletes_leftovers(const std::filesystem::path& dir) {
+    std::mt19937_64 rng(2);
+    std::map<std::string, std::string> model;
+    {
+        LsmStorage db(MEMTABLE_BYTES, dir);
+        for (int i = 0; i < 3000; i++) {
+            std::string key = key_for(rng() % 2000);
+            model[key] = std::string(100, 'v') + std::to_string(i);
+            CHECK(db.put(key, model[key]));
+        }
+    }
+    // What a crash between writing a table and the MANIFEST leaves behind
+    std::filesystem::path lsm = dir / "lsm";
+    for (const char* name : {"999999.sst", "999998.tmp"}) {
+        std::ofstream(lsm / name) << "partial";
+    }
+    LsmStorage db(MEMTABLE_BYTES, dir);
+    CHECK(!std::filesystem::exists(lsm / "999999.sst"));
+    CHECK(!std::filesystem::exists(lsm / "999998.tmp"));
+    for (const auto& [key, expected] : model) {
+        std::string value;
+        CHECK(db.get(key, value) && value == expected);
+    }
+}
+
+static void oversized_writes_are_rejected(const std::filesystem::path& dir) {
+    std::string too_long(LogRecord::MAX_KEY_SIZE + 1, 'k');
+    {
+        LsmStorage db(MEMTABLE_BYTES, dir);
+        CHECK(db.put("a", "1"));
+        CHECK(!db.put(too_long, "2"));
+        CHECK(!db.write_batch({{LogRecord::Type::Put, "c", "3"}, {LogRecord::Type::Delete, too_long, ""}}));
+        CHECK(db.put("b", "4"));
+    }
+    // Nothing of a refused batch was written, and the log replays past it
+    for (int restart = 0; restart < 2; restart++) {
+        LsmStorage db(MEMTABLE_BYTES, dir);
+        std::string value;
+        CHECK(db.get("a", value) && value == "1");
+        CHECK(db.get("b", value) && value == "4");
+        CHECK(!db.get("c", value));
+        CHECK(!db.get(too_long, value));
+    }
+}
+
+// A table and a WAL from before checksums: the table, in the format from
+// before filters, is read in place, and the WAL, whose last record is
+// torn, is replayed into a new level-0 table
+static void legacy_files_are_read(const std::filesystem::path& dir) {
+    std::filesystem::path lsm = dir / "lsm";
+    std::filesystem::create_directories(lsm);
+    std::ofstream(lsm / "MANIFEST") << "blinkdb-lsm 1\nnext_file 3\nlog 2\ntable 1 1\n";
+
+    // One block of records, then [blocks:u32][first_key][offset:u64][size:u32]
+    // per block and the last key, then the 32-byte footer
+    std::string table;
+    encode_v1_record(table, LogRecord::Type::Put, "a", "old-a");
+    encode_v1_record(table, LogRecord::Type::Put, "b", "bee");
+    encode_v1_record(table, LogRecord::Type::Put, "c", "sea");
+    std::string index;
+    char field[8];
+    auto add_u32 = [&](uint32_t v) {
+        LogRecord::put_u32(field, v);
+        index.append(field, 4);
+    };
+    add_u32(1);
+    add_u32(1);
+    index += "a";
+    LogRecord::put_u64(field, 0);
+    index.append(field, 8);
+    add_u32(static_cast<uint32_t>(table.size()));
+    add_u32(1);
+    index += "c";
+    char footer[32];
+    LogRecord::put_u64(footer, table.size());
+    LogRecord::put_u64(footer + 8, index.size());
+    LogRecord::put_u64(footer + 16, 3);
+    LogRecord::put_u64(footer + 24, 0x3154535342444c42ULL);  // "BLDBSST1"
+    table += index;
+    table.append(footer, sizeof footer);
+    std::ofstream(lsm / "000001.sst", std::ios::binary) << table;
+
+    std::string wal;
+    encode_v1_record(wal, LogRecord::Type::Put, "a", "new-a");
+    encode_v1_record(wal, LogRecord::Type::Delete, "b", "");
+    encode_v1_record(wal, LogRecord::Type::Put, "d", "dee");
+    size_t intact = wal.size();
+    encode_v1_record(wal, LogRecord::Type::Put, "torn", "never acknowledged");
+    wal.resize(intact + 12);
+    std::ofstream(lsm / "000002.wal", std::ios::binary) << wal;
+
+    for (int restart = 0; restart < 2; restart++) {
+        LsmStorage db(MEMTABLE_BYTES, dir);
+        std::string value;
+        CHECK(db.get("a", value) && value == "new-a");
+        CHECK(!db.get("b", value));
+        CHECK(db.get("c", value) && value == "sea");
+        CHECK(db.get("d", value) && value == "dee");
+        CHECK(!db.get("torn", value));
+        CHECK(db.level_bytes()[0] > 0);
+        CHECK(!std::filesystem::exists(lsm / "000002.wal"));
+    }
+}
+
+int main() {
+    run("matches_a_model_across_restarts", matches_a_model_across_restarts);
+    run("wal_replays_unflushed_writes", wal_replays_unflushed_writes);
+    run("manifest_recovery_deletes_leftovers", manifest_recovery_deletes_leftovers);
+    run("damaged_wal_tail_is_dropped", [](const std::filesystem::path& root) {
+        check_damaged_tail_is_dropped(
+            root, [](const std::filesystem::path& dir) { return std::make_unique<LsmStorage>(MEMTABLE_BYTES, dir); },
+            [](const std::filesystem::path& dir) { return newest_file(dir / "lsm", ".wal"); });
+    });
+    run("oversized_writes_are_rejected", oversized_writes_are_rejected);
+    run("legacy_files_are_read", legacy_files_are_read);
+    run("acked_writes_survive_kill", [](const std::filesystem::path& dir) {
+        check_acked_writes_survive_kill([&] { return std::make_unique<LsmStorage>(MEMTABLE_BYTES, dir); });
+    });
+    return report();
+}
@@ -0,0 +1,111 @@
+// Tests for OutputBuffer: replies spanning many blocks and more than one
+// writev() worth of them, sends the socket takes only part of, and a
+// broken connection.
+#include "src/output_buffer.h"
+#include "tests/test_util.h"
+#include <fcntl.h>
+#include <sys/socket.h>
+
+// A reply of n bytes that says where it sits in the stream
+static std::string reply(size_t i, size_t n) {
+    std::string s(n, static_cast<char>('a' + i % 26));
+    s[0] = static_cast<char>(i);
+    return s;
+}
+
+// Reads whatever the socket holds right now
+static std::string drain(int fd) {
+    std::string got;
+    char buf[65536];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof buf, MSG_DONTWAIT)) > 0) {
+        got.append(buf, static_cast<size_t>(n));
+    }
+    return got;
+}
+
+static bool socket_pair(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return false;
+    // A small send buffer, so flushes block partway through a block
+    int size = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    return fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0;
+}
+
+// Replies of every size around the block size, queued while earlier ones
+// are still only partly sent, reach the peer whole and in order
+static void replies_arrive_in_order(const std::filesystem::path&) {
+    int fds[2];
+    CHECK(socket_pair(fds));
+    OutputBuffer out;
+    std::string sent, received;
+    size_t blocked = 0;
+    for (size_t i = 0; i < 400; i++) {
+        size_t n = (i * 7919) % (3 * OutputBuffer::BLOCK_SIZE) + 1;
+        std::string r = reply(i, n);
+        out += r;
+        sent += r;
+        // Let replies pile up past MAX_IOV blocks before flushing
+        if (i % 50 != 49) continue;
+        OutputBuffer::FlushResult result;
+        while ((result = out.flush(fds[0])) == OutputBuffer::FlushResult::Blocked) {
+            blocked++;
+            CHECK(!out.empty());
+            received += drain(fds[1]);
+            CHECK(received == sent.substr(0, received.size()));
+        }
+        CHECK(result == OutputBuffer::FlushResult::Done);
+        CHECK(out.empty() && out.size() == 0);
+    }
+    received += drain(fds[1]);
+    CHECK(blocked > 0);
+    CHECK(received == sent);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// What the socket could not take stays queued, and later replies go
+// after it
+static void blocked_flush_keeps_the_rest(const std::filesystem::path&) {
+    int fds[2];
+    CHECK(socket_pair(fds));
+    OutputBuffer out;
+    std::string sent = reply(1, 5 * OutputBuffer::BLOCK_SIZE + 17);
+    out += sent;
+    CHECK(out.flush(fds[0]) == OutputBuffer::FlushResult::Blocked);
+    size_t queued = out.size();
+    CHECK(queued > 0 && queued < sent.size());
+    std::string received = drain(fds[1]);
+    CHECK(received.size() == sent.size() - queued);
+
+    std::string more = reply(2, 100);
+    out += more;
+    sent += more;
+    CHECK(out.size() == queued + more.size());
+    while (out.flush(fds[0]) == OutputBuffer::FlushResult::Blocked) {
+        received += drain(fds[1]);
+    }
+    received += drain(fds[1]);
+    CHECK(received == sent);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void broken_connection_is_an_error(const std::filesystem::path&) {
+    int fds[2];
+    CHECK(socket_pair(fds));
+    close(fds[1]);
+    OutputBuffer out;
+    out += "+OK\r\n";
+    CHECK(out.flush(fds[0]) == OutputBuffer::FlushResult::Error);
+    close(fds[0]);
+}
+
+int main() {
+    // As in the server: a write to a closed peer is an error, not a signal
+    signal(SIGPIPE, SIG_IGN);
+    run("replies_arrive_in_order", replies_arrive_in_order);
+    run("blocked_flush_keeps_the_rest", blocked_flush_keeps_the_rest);
+    run("broken_connection_is_an_error", broken_connection_is_an_error);
+    return report();
+}
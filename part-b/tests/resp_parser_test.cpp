@@ -0,0 +1,120 @@
+// Tests for RespParser: requests split across reads at every point, bad
+// lengths, and a bulk string at the maximum length.
+#include "src/resp_parser.h"
+#include "tests/test_util.h"
+#include <algorithm>
+#include <cstring>
+
+using Requests = std::vector<std::vector<std::string>>;
+
+// Feeds stream to the parser chunk bytes per read, parsing after each read
+// as the server does; false if the parser reports an error
+static bool parse_in_chunks(std::string_view stream, size_t chunk, Requests& requests) {
+    RespParser parser;
+    std::vector<std::string_view> args;
+    for (size_t at = 0; at < stream.size(); at += chunk) {
+        size_t n = std::min(chunk, stream.size() - at);
+        memcpy(parser.prepare(n), stream.data() + at, n);
+        parser.commit(n);
+        RespParser::Status status;
+        while ((status = parser.next(args)) == RespParser::Status::Ok) {
+            requests.emplace_back(args.begin(), args.end());
+        }
+        if (status == RespParser::Status::Error) return false;
+    }
+    return parser.buffered() == 0;
+}
+
+static void requests_split_at_every_byte(const std::filesystem::path&) {
+    std::string value("binary\r\nvalue\0NUL", 17);
+    std::string stream = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+    stream += "PING\r\n";
+    stream += "  GET \t key  \n";
+    stream += "*0\r\n";
+    stream += "\r\n";
+    stream += "*2\r\n$3\r\nDEL\r\n$-1\r\n";
+    stream += "*1\r\n$" + std::to_string(3 * RespParser::MAX_INLINE_LENGTH) + "\r\n" +
+              std::string(3 * RespParser::MAX_INLINE_LENGTH, 'v') + "\r\n";
+    Requests expected = {{"SET", "key", value},
+                         {"PING"},
+                         {"GET", "key"},
+                         {"DEL", ""},
+                         {std::string(3 * RespParser::MAX_INLINE_LENGTH, 'v')}};
+
+    for (size_t chunk : {size_t(1), size_t(2), size_t(3), size_t(7), size_t(64), size_t(4096), stream.size()}) {
+        Requests requests;
+        CHECK(parse_in_chunks(stream, chunk, requests));
+        CHECK(requests == expected);
+    }
+    // Every two-read split of the first few requests
+    std::string head = stream.substr(0, stream.find("*0\r\n"));
+    for (size_t split = 1; split < head.size(); split++) {
+        RespParser parser;
+        std::vector<std::string_view> args;
+        memcpy(parser.prepare(split), head.data(), split);
+        parser.commit(split);
+        Requests requests;
+        while (parser.next(args) == RespParser::Status::Ok) requests.emplace_back(args.begin(), args.end());
+        size_t rest = head.size() - split;
+        memcpy(parser.prepare(rest), head.data() + split, rest);
+        parser.commit(rest);
+        while (parser.next(args) == RespParser::Status::Ok) requests.emplace_back(args.begin(), args.end());
+        CHECK(requests == Requests(expected.begin(), expected.begin() + 3));
+    }
+}
+
+static void bad_lengths_are_errors(const std::filesystem::path&) {
+    std::string too_long = std::to_string(RespParser::MAX_BULK_LENGTH + 1);
+    std::string too_many = std::to_string(RespParser::MAX_MULTIBULK_LENGTH + 1);
+    for (const std::string& stream : std::vector<std::string>{
+            "*x\r\n", "*-\r\n", "*99999999999999999999999\r\n", "*" + too_many + "\r\n",
+            "*1\r\n$\r\n", "*1\r\n$1x\r\n", "*1\r\n$" + too_long + "\r\n", "*1\r\n:3\r\n", "*1\r\n$3\r\nabcd\r\n",
+            // Length lines that never end
+            "*" + std::string(RespParser::MAX_INLINE_LENGTH + 1, '1'),
+            "*1\r\n$" + std::string(RespParser::MAX_INLINE_LENGTH + 1, '1')}) {
+        for (size_t chunk : {size_t(1), stream.size()}) {
+            Requests requests;
+            CHECK(!parse_in_chunks(stream, chunk, requests));
+            CHECK(requests.empty());
+        }
+    }
+}
+
+static void bulk_at_the_maximum_length(const std::filesystem::path&) {
+    RespParser parser;
+    std::vector<std::string_view> args;
+    std::string header = "*2\r\n$3\r\nSET\r\n$" + std::to_string(RespParser::MAX_BULK_LENGTH) + "\r\n";
+    memcpy(parser.prepare(header.size()), header.data(), header.size());
+    parser.commit(header.size());
+    CHECK(parser.next(args) == RespParser::Status::Incomplete);
+
+    // The body arrives in socket-sized reads, the last one with a request
+    // after it
+    constexpr size_t READ = 1 << 20;
+    for (size_t left = RespParser::MAX_BULK_LENGTH; left > 0;) {
+        size_t n = std::min(READ, left);
+        char* p = parser.prepare(n);
+        memset(p, 'v', n);
+        if (left == RespParser::MAX_BULK_LENGTH) p[0] = 'a';
+        if (left == n) p[n - 1] = 'z';
+        parser.commit(n);
+        left -= n;
+        if (left > 0) CHECK(parser.next(args) == RespParser::Status::Incomplete);
+    }
+    memcpy(parser.prepare(8), "\r\nPING\r\n", 8);
+    parser.commit(8);
+    CHECK(parser.next(args) == RespParser::Status::Ok);
+    CHECK(args.size() == 2 && args[0] == "SET");
+    CHECK(args.size() == 2 && args[1].size() == RespParser::MAX_BULK_LENGTH);
+    CHECK(args.size() == 2 && args[1].front() == 'a' && args[1].back() == 'z');
+    CHECK(parser.next(args) == RespParser::Status::Ok);
+    CHECK(args.size() == 1 && args[0] == "PING");
+    CHECK(parser.buffered() == 0);
+}
+
+int main() {
+    run("requests_split_at_every_byte", requests_split_at_every_byte);
+    run("bad_lengths_are_errors", bad_lengths_are_errors);
+    run("bulk_at_the_maximum_length", bulk_at_the_maximum_length);
+    return report();
+}
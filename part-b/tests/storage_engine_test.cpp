@@ -0,0 +1,118 @@
+// Tests for StorageEngine: writes over the disk format's size limits, on
+// both disk engines, and the write ring wrapping under concurrent writers.
+#include "src/storage_engine.h"
+#include "tests/test_util.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <sys/resource.h>
+
+static std::unique_ptr<StorageEngine> open_engine(DiskEngine engine, const std::filesystem::path& dir,
+                                                  size_t cache_bytes = 0,
+                                                  FsyncPolicy fsync_policy = FsyncPolicy::Always) {
+    return std::make_unique<StorageEngine>(cache_bytes, fsync_policy, 1000, EvictionPolicy::LRU, engine, dir);
+}
+
+// A key over the limit is refused up front rather than written as a record
+// recovery cannot read, which would take every later write with it
+static void oversized_keys_are_rejected(const std::filesystem::path& root) {
+    std::string too_long(LogRecord::MAX_KEY_SIZE + 1, 'k');
+    std::string longest(LogRecord::MAX_KEY_SIZE, 'm');
+    for (DiskEngine engine : {DiskEngine::Log, DiskEngine::LSM}) {
+        std::filesystem::path dir = root / (engine == DiskEngine::Log ? "log" : "lsm");
+        {
+            auto db = open_engine(engine, dir);
+            CHECK(db->set("a", "1"));
+            CHECK(!db->set(too_long, "2"));
+            CHECK(db->get(too_long) == "");
+            CHECK(!db->del(too_long));
+            CHECK(db->set("b", "3"));
+            CHECK(db->set(longest, "4"));
+        }
+        auto db = open_engine(engine, dir);
+        CHECK(db->get("a") == "1");
+        CHECK(db->get("b") == "3");
+        CHECK(db->get(longest) == "4");
+        CHECK(db->get(too_long) == "");
+    }
+}
+
+// Writers on several threads push several times more writes than the
+// ring holds, so every slot is reused many times, by the writer thread
+// and by producers that find the ring full and drain it themselves.
+// Writer w puts i to its key i % KEYS. In the last pass over its keys it
+// deletes on every 7th i instead; a DEL drains the ring, so earlier
+// deletes would keep it from ever filling. Meanwhile a reader must never
+// see a key's value go backwards. Every key must end at its last write,
+// before and after a restart. This runs without a cache, where reads look
+// in the ring, and with one.
+static void ring_wraps_under_concurrent_writers(const std::filesystem::path& root) {
+    constexpr uint64_t WRITERS = 4;
+    constexpr uint64_t WRITES = 100000;  // Per writer; the ring holds 65536 in all
+    constexpr uint64_t KEYS = 500;       // Per writer
+    auto check_final = [&](StorageEngine& db) {
+        size_t bad = 0;
+        for (uint64_t key = 0; key < WRITERS * KEYS; key++) {
+            uint64_t last = WRITES - KEYS + key % KEYS;
+            std::string want = last % 7 == 0 ? "" : std::to_string(last);
+            if (db.get(numbered_key(key)) != want) bad++;
+        }
+        CHECK(bad == 0);
+    };
+    for (size_t cache_bytes : {size_t(0), StorageEngine::DEFAULT_CACHE_BYTES}) {
+        std::filesystem::path dir = root / std::to_string(cache_bytes);
+        {
+            // Opened on a thread at the lowest priority, which the writer
+            // thread inherits, so on a busy or single core the writers fill
+            // the ring faster than it is drained
+            std::unique_ptr<StorageEngine> db;
+            std::thread([&] {
+                setpriority(PRIO_PROCESS, static_cast<id_t>(gettid()), 19);
+                db = open_engine(DiskEngine::Log, dir, cache_bytes, FsyncPolicy::Never);
+            }).join();
+            std::atomic<bool> stop{false};
+            std::atomic<bool> backwards{false};
+            std::thread reader([&] {
+                std::vector<int64_t> seen(WRITERS * KEYS, -1);
+                std::string value;
+                for (uint64_t i = 0; !stop; i++) {
+                    uint64_t key = (i * 7919) % seen.size();
+                    if (!db->get(numbered_key(key), value)) continue;
+                    int64_t got = std::stoll(value);
+                    if (got < seen[key]) backwards = true;
+                    seen[key] = got;
+                    // Reads drain the ring too; leave room for it to fill
+                    if (i % 16 == 0) std::this_thread::sleep_for(std::chrono::microseconds(200));
+                }
+            });
+            std::vector<std::thread> writers;
+            for (uint64_t w = 0; w < WRITERS; w++) {
+                writers.emplace_back([&, w] {
+                    for (uint64_t i = 0; i < WRITES; i++) {
+                        std::string key = numbered_key(w * KEYS + i % KEYS);
+                        if (i % 7 == 0 && i >= WRITES - KEYS) {
+                            db->del(key);
+                        } else {
+                            db->set(key, std::to_string(i));
+                        }
+                    }
+                });
+            }
+            for (std::thread& writer : writers) {
+                writer.join();
+            }
+            stop = true;
+            reader.join();
+            CHECK(!backwards);
+            check_final(*db);
+        }
+        auto db = open_engine(DiskEngine::Log, dir, cache_bytes, FsyncPolicy::Never);
+        check_final(*db);
+    }
+}
+
+int main() {
+    run("oversized_keys_are_rejected", oversized_keys_are_rejected);
+    run("ring_wraps_under_concurrent_writers", ring_wraps_under_concurrent_writers);
+    return report();
+}
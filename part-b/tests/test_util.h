@@ -0,0 +1,232 @@
+// Minimal test harness shared by the tests in this directory: CHECK()
+// records a failure and carries on, run() gives each test a fresh scratch
+// directory for its disk files. Also holds the checks every disk engine
+// must pass.
+#pragma once
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "src/disk_storage.h"
+
+inline int failures = 0;
+
+#define CHECK(cond)                                                                    \
+    do {                                                                               \
+        if (!(cond)) {                                                                 \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond "\n"; \
+            failures++;                                                                \
+        }                                                                              \
+    } while (0)
+
+inline void run(const char* name, const std::function<void(const std::filesystem::path&)>& test) {
+    char dir[] = "/tmp/blinkdb_test_XXXXXX";
+    if (!mkdtemp(dir)) {
+        std::cerr << "Failed to create a directory for " << name << std::endl;
+        failures++;
+        return;
+    }
+    int before = failures;
+    test(dir);
+    std::cout << (failures == before ? "PASS " : "FAIL ") << name << std::endl;
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+}
+
+inline int report() {
+    if (failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+inline std::string numbered_key(uint64_t i) {
+    std::string key = "k";
+    key += std::to_string(i);
+    return key;
+}
+
+// The last file in dir with this extension; file names are zero-padded
+// numbers, so that is the newest one
+inline std::filesystem::path newest_file(const std::filesystem::path& dir, const std::string& extension) {
+    std::filesystem::path newest;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == extension && entry.path() > newest) newest = entry.path();
+    }
+    return newest;
+}
+
+inline void flip_byte(const std::filesystem::path& path, uint64_t offset) {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekg(offset);
+    char byte = static_cast<char>(file.get());
+    file.seekp(offset);
+    file.put(static_cast<char>(byte ^ 0x40));
+}
+
+// Appends a record as written before checksums (LogRecord::Format::V1)
+inline void encode_v1_record(std::string& out, LogRecord::Type type, std::string_view key, std::string_view value) {
+    char header[9];
+    header[0] = static_cast<char>(type);
+    LogRecord::put_u32(header + 1, static_cast<uint32_t>(key.size()));
+    LogRecord::put_u32(header + 5, static_cast<uint32_t>(value.size()));
+    out.append(header, sizeof header);
+    out.append(key.data(), key.size());
+    out.append(value.data(), value.size());
+}
+
+// Runs writes in a child process that then exits without closing the
+// store, leaving its files as a crash would
+template <typename Writes>
+void write_then_crash(Writes writes) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        writes();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Ways check_damaged_tail_is_dropped() damages the end of a log
+enum class TailDamage {
+    Torn,           // The last record is cut short
+    Corrupt,        // The last record has a flipped byte
+    OversizedTorn,  // Part of a record over the size limits follows
+    Oversized       // A whole, checksummed record over the limits follows
+};
+
+// A crash leaves the newest log (the file newest_log() returns for a store
+// directory) with each TailDamage in turn. The store opened with open(dir)
+// must drop the damaged record and nothing before it, and take new writes
+// that survive the next restart. A whole record over the size limits is
+// no crash's doing: opening must fail and leave the log as it is.
+template <typename Open, typename NewestLog>
+void check_damaged_tail_is_dropped(const std::filesystem::path& root, Open open, NewestLog newest_log) {
+    for (TailDamage damage : {TailDamage::Torn, TailDamage::Corrupt, TailDamage::OversizedTorn,
+                              TailDamage::Oversized}) {
+        std::filesystem::path dir = root / std::to_string(static_cast<int>(damage));
+        write_then_crash([&] {
+            std::unique_ptr<DiskStorage> db = open(dir);
+            for (uint64_t i = 0; i < 100; i++) {
+                if (!db->put(numbered_key(i), std::to_string(i))) _exit(2);
+            }
+            if (!db->put(numbered_key(7), "last") || !db->sync()) _exit(2);
+        });
+        std::filesystem::path log = newest_log(dir);
+        uint64_t size = std::filesystem::file_size(log);
+        std::string oversized;
+        LogRecord::encode(oversized, LogRecord::Type::Put, std::string(LogRecord::MAX_KEY_SIZE + 1, 'k'), "v");
+        switch (damage) {
+        case TailDamage::Torn:
+            std::filesystem::resize_file(log, size - 3);
+            break;
+        case TailDamage::Corrupt:
+            flip_byte(log, size - 2);
+            break;
+        case TailDamage::OversizedTorn:
+            oversized.resize(oversized.size() - 3);
+            [[fallthrough]];
+        case TailDamage::Oversized:
+            std::ofstream(log, std::ios::binary | std::ios::app) << oversized;
+            break;
+        }
+
+        if (damage == TailDamage::Oversized) {
+            bool refused = false;
+            try {
+                open(dir);
+            } catch (const std::runtime_error&) {
+                refused = true;
+            }
+            CHECK(refused);
+            CHECK(std::filesystem::exists(log) && std::filesystem::file_size(log) == size + oversized.size());
+            continue;
+        }
+        // Only a damaged last put of key 7 is lost
+        std::string last = damage == TailDamage::OversizedTorn ? "last" : "7";
+        for (int restart = 0; restart < 2; restart++) {
+            std::unique_ptr<DiskStorage> db = open(dir);
+            size_t bad = 0;
+            std::string value;
+            for (uint64_t i = 0; i < 100; i++) {
+                if (!db->get(numbered_key(i), value) || value != (i == 7 ? last : std::to_string(i))) bad++;
+            }
+            CHECK(bad == 0);
+            if (restart == 0) {
+                CHECK(db->put("after", "recovery") && db->sync());
+            } else {
+                CHECK(db->get("after", value) && value == "recovery");
+            }
+        }
+    }
+}
+
+// A child process opens the store with open() and writes and syncs batches,
+// reporting each acknowledged one over a pipe, until it is SIGKILLed at a
+// different point each trial. Every acknowledged write must then read back.
+template <typename Open>
+void check_acked_writes_survive_kill(Open open) {
+    constexpr uint64_t KEYS = 30000;
+    constexpr uint64_t BATCH = 50;
+    uint64_t base = 0;
+    for (int trial = 0; trial < 4; trial++) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            CHECK(false);
+            return;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            std::unique_ptr<DiskStorage> db = open();
+            for (uint64_t i = base;; i += BATCH) {
+                std::vector<WriteOp> batch;
+                for (uint64_t j = i; j < i + BATCH; j++) {
+                    batch.push_back({LogRecord::Type::Put, numbered_key(j % KEYS),
+                                     std::to_string(j) + std::string(100, 'x')});
+                }
+                if (!db->write_batch(batch) || !db->sync()) _exit(2);
+                uint64_t acked = i + BATCH;
+                if (write(fds[1], &acked, sizeof acked) != sizeof acked) _exit(2);
+            }
+        }
+        close(fds[1]);
+        usleep(200000 + trial * 150000);
+        kill(pid, SIGKILL);
+        int status;
+        waitpid(pid, &status, 0);
+        uint64_t acked = base, x;
+        while (read(fds[0], &x, sizeof x) == sizeof x) acked = x;
+        close(fds[0]);
+
+        // Each key holds its last acknowledged value or a later one
+        std::unique_ptr<DiskStorage> db = open();
+        size_t bad = 0;
+        for (uint64_t j = std::max(base, acked > KEYS ? acked - KEYS : 0); j < acked; j++) {
+            std::string value;
+            if (!db->get(numbered_key(j % KEYS), value)) {
+                bad++;
+                continue;
+            }
+            uint64_t got = std::stoull(value);
+            if (got < j || got % KEYS != j % KEYS) bad++;
+        }
+        CHECK(acked > base);
+        CHECK(bad == 0);
+        // Keep values increasing across trials
+        base = acked + 1000000;
+        base -= base % BATCH;
+    }
+}